@@ -0,0 +1,247 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/admission.h"
+
+#include <mordor/config.h>
+#include <mordor/fibersynchronization.h>
+#include <mordor/log.h>
+
+#include "postguard/timerwheel.h"
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:admission");
+
+static ConfigVar<size_t>::ptr g_targetLimit =
+    Config::lookup("postguard.admission.target", (size_t)0u,
+        "Maximum backend connections to each host, port and dbname (0 for no limit)");
+static ConfigVar<size_t>::ptr g_userLimit =
+    Config::lookup("postguard.admission.user", (size_t)0u,
+        "Maximum backend connections for each Unix user (0 for no limit)");
+static ConfigVar<size_t>::ptr g_queueLimit =
+    Config::lookup("postguard.admission.queue", (size_t)1024u,
+        "Maximum number of clients waiting for a backend connection");
+static ConfigVar<unsigned long long>::ptr g_queueDeadline =
+    Config::lookup("postguard.admission.deadline", 30000000ull,
+        "How long a client can wait for a backend connection (us, 0 for no limit)");
+
+namespace Postguard {
+
+struct Admission::Waiter
+{
+    enum State
+    {
+        WAITING,
+        ADMITTED,
+        EXPIRED
+    };
+
+    Waiter(const std::string &target, const std::string &user)
+        : target(target),
+          user(user),
+          state(WAITING),
+          event(false)
+    {}
+
+    std::string target, user;
+    State state;
+    FiberEvent event;
+};
+
+Admission::Ticket::Ticket(Admission &admission, const std::string &target,
+    const std::string &user)
+    : m_admission(admission),
+      m_target(target),
+      m_user(user)
+{}
+
+Admission::Ticket::~Ticket()
+{
+    m_admission.release(m_target, m_user);
+}
+
+Admission::Admission(TimerWheel &timerWheel)
+    : m_timerWheel(timerWheel),
+      m_waiting(0u)
+{}
+
+Admission::Ticket::ptr
+Admission::acquire(const std::string &target, const std::string &user,
+    size_t limit, unsigned long long timeout)
+{
+    std::shared_ptr<Waiter> waiter(new Waiter(target, user));
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        Target &t = m_targets[target];
+        // the most recent caller wins, so a reloaded limit takes effect
+        t.limit = limit;
+        std::list<std::pair<std::string, std::list<std::shared_ptr<Waiter> > > >::iterator it;
+        for (it = t.queues.begin(); it != t.queues.end(); ++it) {
+            if (it->first == user)
+                break;
+        }
+        if (it == t.queues.end())
+            it = t.queues.insert(t.queues.end(), std::make_pair(user,
+                std::list<std::shared_ptr<Waiter> >()));
+        it->second.push_back(waiter);
+        ++m_waiting;
+        dispatch(t);
+
+        if (waiter->state == Waiter::ADMITTED)
+            return Ticket::ptr(new Ticket(*this, target, user));
+        if (m_waiting > g_queueLimit->val()) {
+            remove(waiter);
+            MORDOR_LOG_WARNING(g_log) << user << " rejected for " << target
+                << ": queue is full";
+            throw AdmissionRejectedError("sorry, too many clients already");
+        }
+        MORDOR_LOG_VERBOSE(g_log) << user << " waiting for " << target
+            << " (" << m_waiting << " waiting)";
+    }
+
+    unsigned long long deadline = g_queueDeadline->val();
+    if (deadline == 0ull || deadline > timeout)
+        deadline = timeout;
+    TimerWheel::Timeout::ptr expiry;
+    if (deadline != ~0ull)
+        expiry = m_timerWheel.add(deadline,
+            std::bind(&Admission::expire, this, waiter));
+    waiter->event.wait();
+    expiry.reset();
+
+    if (waiter->state != Waiter::ADMITTED) {
+        MORDOR_LOG_WARNING(g_log) << user << " rejected for " << target
+            << ": timed out waiting";
+        throw AdmissionRejectedError("sorry, too many clients already; timed out waiting for a connection");
+    }
+    return Ticket::ptr(new Ticket(*this, target, user));
+}
+
+std::string
+Admission::target(const std::map<std::string, std::string> &parameters)
+{
+    // Same defaults as Server::connect
+    std::string host = "/tmp", port = "5432", dbname;
+    std::map<std::string, std::string>::const_iterator it;
+    if ( (it = parameters.find("hostaddr")) != parameters.end())
+        host = it->second;
+    else if ( (it = parameters.find("host")) != parameters.end())
+        host = it->second;
+    if ( (it = parameters.find("port")) != parameters.end())
+        port = it->second;
+    if ( (it = parameters.find("dbname")) != parameters.end())
+        dbname = it->second;
+    else if ( (it = parameters.find("user")) != parameters.end())
+        dbname = it->second;
+    return host + ":" + port + "/" + dbname;
+}
+
+void
+Admission::release(const std::string &target, const std::string &user)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    std::map<std::string, size_t>::iterator it = m_users.find(user);
+    if (--it->second == 0u)
+        m_users.erase(it);
+    --m_targets[target].active;
+    // the user's slot may be what another target's waiters need
+    dispatch();
+    prune(target);
+}
+
+void
+Admission::dispatch()
+{
+    for (std::map<std::string, Target>::iterator it(m_targets.begin());
+        it != m_targets.end();
+        ++it)
+        dispatch(it->second);
+}
+
+void
+Admission::dispatch(Target &target)
+{
+    std::list<std::pair<std::string, std::list<std::shared_ptr<Waiter> > > >::iterator it =
+        target.queues.begin();
+    while (it != target.queues.end()) {
+        if (!available(target, it->first)) {
+            ++it;
+            continue;
+        }
+        std::shared_ptr<Waiter> waiter = it->second.front();
+        it->second.pop_front();
+        admit(target, waiter);
+        // this user has had their turn; back of the line
+        if (it->second.empty())
+            it = target.queues.erase(it);
+        else
+            target.queues.splice(target.queues.end(), target.queues, it++);
+    }
+}
+
+bool
+Admission::available(const Target &target, const std::string &user) const
+{
+    size_t targetLimit = target.limit != 0u ? target.limit : g_targetLimit->val();
+    size_t userLimit = g_userLimit->val();
+    if (targetLimit != 0u && target.active >= targetLimit)
+        return false;
+    if (userLimit != 0u) {
+        std::map<std::string, size_t>::const_iterator it = m_users.find(user);
+        if (it != m_users.end() && it->second >= userLimit)
+            return false;
+    }
+    return true;
+}
+
+void
+Admission::admit(Target &target, std::shared_ptr<Waiter> waiter)
+{
+    ++target.active;
+    ++m_users[waiter->user];
+    --m_waiting;
+    waiter->state = Waiter::ADMITTED;
+    waiter->event.set();
+}
+
+bool
+Admission::remove(std::shared_ptr<Waiter> waiter)
+{
+    if (waiter->state != Waiter::WAITING)
+        return false;
+    Target &target = m_targets[waiter->target];
+    std::list<std::pair<std::string, std::list<std::shared_ptr<Waiter> > > >::iterator it;
+    for (it = target.queues.begin(); it != target.queues.end(); ++it) {
+        if (it->first == waiter->user) {
+            it->second.remove(waiter);
+            if (it->second.empty())
+                target.queues.erase(it);
+            break;
+        }
+    }
+    --m_waiting;
+    waiter->state = Waiter::EXPIRED;
+    prune(waiter->target);
+    return true;
+}
+
+void
+Admission::expire(std::shared_ptr<Waiter> waiter)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (remove(waiter))
+        waiter->event.set();
+}
+
+void
+Admission::prune(const std::string &target)
+{
+    std::map<std::string, Target>::iterator it = m_targets.find(target);
+    if (it != m_targets.end() && it->second.active == 0u &&
+        it->second.queues.empty())
+        m_targets.erase(it);
+}
+
+}
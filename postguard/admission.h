@@ -0,0 +1,101 @@
+#ifndef __POSTGUARD_ADMISSION_H__
+#define __POSTGUARD_ADMISSION_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <list>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace Postguard {
+
+class TimerWheel;
+
+/// The client has to be turned away without a backend connection
+struct AdmissionRejectedError : public std::runtime_error
+{
+    AdmissionRejectedError(const std::string &message)
+        : std::runtime_error(message)
+    {}
+};
+
+/// Admission control in front of Server::connect
+///
+/// Caps concurrent backend connections per target (host, port and dbname)
+/// and per Unix user.  Clients over a cap wait in a bounded queue; waiters
+/// for a target are admitted round robin across Unix users, so a single
+/// user opening a burst of connections can't starve everyone else.
+class Admission : boost::noncopyable
+{
+private:
+    struct Waiter;
+
+public:
+    /// Holds a backend slot until it is destroyed
+    class Ticket : boost::noncopyable
+    {
+        friend class Admission;
+    public:
+        typedef std::shared_ptr<Ticket> ptr;
+
+    private:
+        Ticket(Admission &admission, const std::string &target,
+            const std::string &user);
+
+    public:
+        ~Ticket();
+
+    private:
+        Admission &m_admission;
+        std::string m_target, m_user;
+    };
+
+public:
+    Admission(TimerWheel &timerWheel);
+
+    /// Waits for a slot to connect to target as Unix user user
+    /// @param limit Cap for this target, instead of postguard.admission.target
+    /// @param timeout Wait no longer than this (us), even if
+    ///        postguard.admission.deadline allows longer
+    /// @throws AdmissionRejectedError if the queue is full, or the slot
+    ///         doesn't become available before the queue deadline
+    Ticket::ptr acquire(const std::string &target, const std::string &user,
+        size_t limit = 0u, unsigned long long timeout = ~0ull);
+
+    /// The target key for a set of connection parameters
+    static std::string target(const std::map<std::string, std::string> &parameters);
+
+private:
+    struct Target
+    {
+        Target() : active(0u), limit(0u) {}
+
+        size_t active, limit;
+        /// Each user's waiters in arrival order, in round robin order
+        std::list<std::pair<std::string, std::list<std::shared_ptr<Waiter> > > > queues;
+    };
+
+    void release(const std::string &target, const std::string &user);
+    void dispatch();
+    void dispatch(Target &target);
+    bool available(const Target &target, const std::string &user) const;
+    void admit(Target &target, std::shared_ptr<Waiter> waiter);
+    bool remove(std::shared_ptr<Waiter> waiter);
+    void expire(std::shared_ptr<Waiter> waiter);
+    void prune(const std::string &target);
+
+private:
+    TimerWheel &m_timerWheel;
+    boost::mutex m_mutex;
+    std::map<std::string, Target> m_targets;
+    std::map<std::string, size_t> m_users;
+    size_t m_waiting;
+};
+
+}
+
+#endif
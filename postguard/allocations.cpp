@@ -0,0 +1,441 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/allocations.h"
+
+#include <atomic>
+
+#include <mordor/exception.h>
+
+#ifdef POSTGUARD_ALLOC_ACCOUNTING
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <execinfo.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <openssl/crypto.h>
+
+#include <mordor/config.h>
+#include <mordor/log.h>
+#include <mordor/timer.h>
+#endif
+
+using namespace Mordor;
+
+#ifdef POSTGUARD_ALLOC_ACCOUNTING
+static Logger::ptr g_log = Log::lookup("postguard:allocations");
+
+static ConfigVar<unsigned long long>::ptr g_sampleInterval =
+    Config::lookup("postguard.alloc.sample", 524288ull,
+        "Bytes allocated on a thread between stacks sampled for heap profiles (read once at startup, 0 to disable)");
+static ConfigVar<std::string>::ptr g_profileDir =
+    Config::lookup("postguard.alloc.profiledir", std::string("/tmp"),
+        "Directory heap profiles are written to");
+#endif
+
+namespace Postguard {
+
+// Zero is OTHER; a plain int so reading it from operator new never needs
+// to construct anything
+static thread_local int t_tag;
+
+static std::atomic<unsigned long long> g_connections(0ull), g_relayed(0ull);
+
+Allocations::Scope::Scope(Tag tag)
+    : m_previous(t_tag)
+{
+    t_tag = tag;
+}
+
+Allocations::Scope::~Scope()
+{
+    t_tag = m_previous;
+}
+
+void
+Allocations::connectionOpened()
+{
+    g_connections.fetch_add(1ull, std::memory_order_relaxed);
+}
+
+void
+Allocations::relayed(unsigned long long bytes)
+{
+    g_relayed.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+#ifdef POSTGUARD_ALLOC_ACCOUNTING
+
+static const char *TAG_NAMES[Allocations::TAGS] = {
+    "other", "client", "server", "buffer", "ssl", "jira", "pgpass"
+};
+
+struct AllocationHeader
+{
+    size_t size;
+    unsigned int tag;
+    unsigned int sampled;
+};
+static_assert(sizeof(AllocationHeader) == 16u,
+    "the header must keep the caller's memory as aligned as malloc's");
+
+// every thread hits these; keep each tag on its own cache line
+struct alignas(64) AllocationCounters
+{
+    std::atomic<long long> live;
+    std::atomic<unsigned long long> allocations;
+};
+
+struct AllocationSample
+{
+    size_t size;
+    int tag;
+    std::vector<void *> stack;
+};
+
+static AllocationCounters g_counters[Allocations::TAGS];
+static unsigned long long g_since;
+
+// Sampling for heap profiles; off until configure() sets up the table
+static std::atomic<size_t> g_sampleEvery(0u);
+static boost::mutex *g_samplesMutex;
+static std::unordered_map<void *, AllocationSample> *g_samples;
+static thread_local long long t_untilSample;
+// Set while the profiler itself allocates, so its own bookkeeping isn't
+// sampled (which would take g_samplesMutex recursively)
+static thread_local bool t_profiling;
+
+namespace {
+struct Profiling
+{
+    Profiling() : m_previous(t_profiling) { t_profiling = true; }
+    ~Profiling() { t_profiling = m_previous; }
+
+    bool m_previous;
+};
+}
+
+static void
+sample(void *pointer, size_t size, int tag)
+{
+    Profiling profiling;
+    void *frames[32];
+    int depth = backtrace(frames, 32);
+    boost::mutex::scoped_lock lock(*g_samplesMutex);
+    AllocationSample &entry = (*g_samples)[pointer];
+    entry.size = size;
+    entry.tag = tag;
+    // skip sample() and allocate()
+    entry.stack.assign(frames + std::min(depth, 2), frames + depth);
+}
+
+static void *
+allocate(size_t size, int tag)
+{
+    AllocationHeader *header = (AllocationHeader *)malloc(sizeof(AllocationHeader) + size);
+    if (!header)
+        return NULL;
+    header->size = size;
+    header->tag = tag;
+    header->sampled = 0u;
+    g_counters[tag].live.fetch_add(size, std::memory_order_relaxed);
+    g_counters[tag].allocations.fetch_add(1ull, std::memory_order_relaxed);
+
+    size_t every = g_sampleEvery.load(std::memory_order_relaxed);
+    if (every != 0u && !t_profiling) {
+        t_untilSample -= size;
+        if (t_untilSample <= 0) {
+            t_untilSample = every;
+            header->sampled = 1u;
+            try {
+                sample(header + 1, size, tag);
+            } catch (...) {
+                header->sampled = 0u;
+            }
+        }
+    }
+    return header + 1;
+}
+
+static void
+deallocate(void *pointer)
+{
+    if (!pointer)
+        return;
+    AllocationHeader *header = (AllocationHeader *)pointer - 1;
+    g_counters[header->tag].live.fetch_sub(header->size, std::memory_order_relaxed);
+    if (header->sampled) {
+        Profiling profiling;
+        boost::mutex::scoped_lock lock(*g_samplesMutex);
+        g_samples->erase(pointer);
+    }
+    free(header);
+}
+
+static void *
+reallocate(void *pointer, size_t size, int tag)
+{
+    if (!pointer)
+        return allocate(size, tag);
+    void *result = allocate(size, tag);
+    if (!result)
+        return NULL;
+    memcpy(result, pointer, std::min(size, ((AllocationHeader *)pointer - 1)->size));
+    deallocate(pointer);
+    return result;
+}
+
+static void *
+allocateOrThrow(size_t size)
+{
+    while (true) {
+        void *result = allocate(size, t_tag);
+        if (result)
+            return result;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static void *sslMalloc(size_t size, const char *, int)
+{ return allocate(size, Allocations::SSL); }
+static void *sslRealloc(void *pointer, size_t size, const char *, int)
+{ return reallocate(pointer, size, Allocations::SSL); }
+static void sslFree(void *pointer, const char *, int)
+{ deallocate(pointer); }
+#else
+static void *sslMalloc(size_t size)
+{ return allocate(size, Allocations::SSL); }
+static void *sslRealloc(void *pointer, size_t size)
+{ return reallocate(pointer, size, Allocations::SSL); }
+static void sslFree(void *pointer)
+{ deallocate(pointer); }
+#endif
+
+bool
+Allocations::enabled()
+{
+    return true;
+}
+
+void
+Allocations::configure()
+{
+    g_since = TimerManager::now();
+    // OpenSSL refuses new hooks once it has allocated anything itself
+    if (!CRYPTO_set_mem_functions(&sslMalloc, &sslRealloc, &sslFree))
+        MORDOR_LOG_WARNING(g_log) << "OpenSSL has already allocated; its "
+            "allocations won't be counted";
+
+    size_t every = (size_t)g_sampleInterval->val();
+    if (every == 0u)
+        return;
+    Profiling profiling;
+    g_samplesMutex = new boost::mutex();
+    g_samples = new std::unordered_map<void *, AllocationSample>();
+    // backtrace() allocates the first time it's called, which mustn't
+    // happen inside sample()
+    void *frame;
+    backtrace(&frame, 1);
+    g_sampleEvery.store(every);
+}
+
+std::ostream &
+Allocations::dump(std::ostream &os)
+{
+    static boost::mutex mutex;
+    static unsigned long long lastAllocations[TAGS];
+    boost::mutex::scoped_lock lock(mutex);
+    unsigned long long now = TimerManager::now();
+    double seconds = (now - g_since) / 1000000.0;
+    g_since = now;
+
+    unsigned long long total = 0ull;
+    for (int tag = 0; tag < TAGS; ++tag) {
+        unsigned long long allocations =
+            g_counters[tag].allocations.load(std::memory_order_relaxed);
+        total += allocations;
+        os << "alloc " << TAG_NAMES[tag]
+            << ": live=" << g_counters[tag].live.load(std::memory_order_relaxed)
+            << "B allocations=" << allocations;
+        if (seconds > 0.0)
+            os << " rate=" << (unsigned long long)((allocations - lastAllocations[tag]) / seconds)
+                << "/s";
+        os << std::endl;
+        lastAllocations[tag] = allocations;
+    }
+    unsigned long long connections = g_connections.load(std::memory_order_relaxed);
+    unsigned long long relayed = g_relayed.load(std::memory_order_relaxed);
+    if (connections != 0ull)
+        os << "alloc per connection: " << total / connections << std::endl;
+    if (relayed >= 1048576ull)
+        os << "alloc per relayed MB: "
+            << (unsigned long long)(total / (relayed / 1048576.0)) << std::endl;
+    return os;
+}
+
+std::string
+Allocations::dumpProfile()
+{
+    size_t every = g_sampleEvery.load();
+    if (every == 0u)
+        MORDOR_THROW_EXCEPTION(std::runtime_error("heap profile sampling is disabled"));
+
+    struct Site
+    {
+        Site() : samples(0ull), bytes(0ull), tag(OTHER) {}
+
+        unsigned long long samples, bytes;
+        int tag;
+    };
+    Profiling profiling;
+    std::map<std::vector<void *>, Site> sites;
+    {
+        boost::mutex::scoped_lock lock(*g_samplesMutex);
+        for (std::unordered_map<void *, AllocationSample>::const_iterator it(g_samples->begin());
+            it != g_samples->end();
+            ++it) {
+            Site &site = sites[it->second.stack];
+            ++site.samples;
+            // a sample stands for all the bytes allocated since the last one
+            site.bytes += std::max(it->second.size, every);
+            site.tag = it->second.tag;
+        }
+    }
+    std::vector<std::pair<unsigned long long, const std::pair<const std::vector<void *>, Site> *> > sorted;
+    for (std::map<std::vector<void *>, Site>::const_iterator it(sites.begin());
+        it != sites.end();
+        ++it)
+        sorted.push_back(std::make_pair(it->second.bytes, &*it));
+    std::sort(sorted.rbegin(), sorted.rend());
+
+    static std::atomic<unsigned int> sequence(0u);
+    std::string path = g_profileDir->val() + "/postguard." +
+        boost::lexical_cast<std::string>(getpid()) + "." +
+        boost::lexical_cast<std::string>(sequence++) + ".heap";
+    std::ofstream os(path.c_str());
+    os << "heap profile: " << sorted.size() << " stacks, sampled every "
+        << every << " bytes" << std::endl;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        const std::vector<void *> &stack = sorted[i].second->first;
+        const Site &site = sorted[i].second->second;
+        os << std::endl << site.bytes << " bytes in " << site.samples
+            << " samples (" << TAG_NAMES[site.tag] << ")" << std::endl;
+        char **symbols = backtrace_symbols(const_cast<void **>(stack.data()),
+            (int)stack.size());
+        for (size_t frame = 0; frame < stack.size(); ++frame) {
+            if (symbols)
+                os << "    " << symbols[frame] << std::endl;
+            else
+                os << "    " << stack[frame] << std::endl;
+        }
+        free(symbols);
+    }
+    os.close();
+    if (!os)
+        MORDOR_THROW_EXCEPTION(std::runtime_error("Unable to write " + path));
+    return path;
+}
+
+#else
+
+bool
+Allocations::enabled()
+{
+    return false;
+}
+
+void
+Allocations::configure()
+{}
+
+std::ostream &
+Allocations::dump(std::ostream &os)
+{
+    return os;
+}
+
+std::string
+Allocations::dumpProfile()
+{
+    MORDOR_THROW_EXCEPTION(std::runtime_error(
+        "heap profiles need a build configured with --enable-alloc-accounting"));
+}
+
+#endif
+
+}
+
+#ifdef POSTGUARD_ALLOC_ACCOUNTING
+
+void *
+operator new(size_t size)
+{
+    return Postguard::allocateOrThrow(size);
+}
+
+void *
+operator new[](size_t size)
+{
+    return Postguard::allocateOrThrow(size);
+}
+
+void *
+operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    try {
+        return Postguard::allocateOrThrow(size);
+    } catch (...) {
+        return NULL;
+    }
+}
+
+void *
+operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    try {
+        return Postguard::allocateOrThrow(size);
+    } catch (...) {
+        return NULL;
+    }
+}
+
+void
+operator delete(void *pointer) noexcept
+{
+    Postguard::deallocate(pointer);
+}
+
+void
+operator delete[](void *pointer) noexcept
+{
+    Postguard::deallocate(pointer);
+}
+
+void
+operator delete(void *pointer, const std::nothrow_t &) noexcept
+{
+    Postguard::deallocate(pointer);
+}
+
+void
+operator delete[](void *pointer, const std::nothrow_t &) noexcept
+{
+    Postguard::deallocate(pointer);
+}
+
+#endif
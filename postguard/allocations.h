@@ -0,0 +1,72 @@
+#ifndef __POSTGUARD_ALLOCATIONS_H__
+#define __POSTGUARD_ALLOCATIONS_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <iosfwd>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+
+namespace Postguard {
+
+/// Heap usage, broken down by the subsystem that allocated it
+///
+/// Only a build configured with --enable-alloc-accounting replaces
+/// operator new and delete to do the counting; otherwise everything here
+/// is a no-op, and the stats are empty.  Each allocation is charged to the
+/// tag of the innermost Scope on its thread (OpenSSL's allocations are
+/// always charged to SSL), and credited back to that tag when freed.
+class Allocations : boost::noncopyable
+{
+public:
+    enum Tag
+    {
+        OTHER,
+        CLIENT,
+        SERVER,
+        BUFFER,
+        SSL,
+        JIRA,
+        PGPASS,
+        TAGS
+    };
+
+    /// Charges allocations on this thread to a tag until destroyed
+    ///
+    /// The tag is per thread, not per fiber, so a Scope must not be held
+    /// across anything that might yield; scope the construction of state,
+    /// not the whole life of the session.
+    class Scope : boost::noncopyable
+    {
+    public:
+        Scope(Tag tag);
+        ~Scope();
+
+    private:
+        int m_previous;
+    };
+
+public:
+    static bool enabled();
+
+    /// Hook OpenSSL's allocator, and start sampling for heap profiles; call
+    /// before anything touches OpenSSL
+    static void configure();
+
+    /// Denominators for the allocation-per-connection and per-MB metrics
+    static void connectionOpened();
+    static void relayed(unsigned long long bytes);
+
+    /// Live bytes and allocation rates per tag, since the last dump
+    static std::ostream &dump(std::ostream &os);
+
+    /// Write the sampled live allocations, grouped by stack
+    /// @return The file written
+    /// @throws std::runtime_error if sampling isn't enabled, or the file
+    /// can't be written
+    static std::string dumpProfile();
+};
+
+}
+
+#endif
@@ -0,0 +1,184 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/audit.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <sstream>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <mordor/config.h>
+#include <mordor/log.h>
+#include <mordor/timer.h>
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:audit");
+
+static ConfigVar<unsigned long long>::ptr g_flushInterval =
+    Config::lookup("postguard.audit.flush", 100000ull,
+        "How often queued audit records are written out (us)");
+static ConfigVar<unsigned long long>::ptr g_fsyncInterval =
+    Config::lookup("postguard.audit.fsync", 1000000ull,
+        "How often the audit log is fsynced (us, 0 to fsync every write)");
+static ConfigVar<unsigned long long>::ptr g_maxSize =
+    Config::lookup("postguard.audit.maxsize", 67108864ull,
+        "Size at which the audit log is rotated (bytes)");
+static ConfigVar<unsigned int>::ptr g_keep =
+    Config::lookup("postguard.audit.keep", 8u,
+        "Number of rotated audit logs to keep");
+
+namespace Postguard {
+
+Audit::Audit(const std::string &path)
+    : m_path(path),
+      m_stopping(false),
+      m_fd(-1),
+      m_size(0ull),
+      m_lastSync(0ull),
+      m_nextOpen(0ull),
+      m_openBackoff(0ull),
+      m_dirty(false)
+{
+    if (m_path.empty())
+        return;
+    open();
+    m_thread = boost::thread(std::bind(&Audit::run, this));
+}
+
+Audit::~Audit()
+{
+    m_stopping = true;
+    if (m_thread.joinable())
+        m_thread.join();
+    // anything logged after the writer stopped (or with no file at all)
+    while (Node *node = m_queue.pop())
+        delete node;
+    if (m_fd >= 0)
+        ::close(m_fd);
+}
+
+void
+Audit::log(AuditRecord record)
+{
+    if (m_path.empty())
+        return;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    record.timestamp = now.tv_sec * 1000000ull + now.tv_usec;
+    Node *node = new Node();
+    node->record = std::move(record);
+    m_queue.push(node);
+}
+
+void
+Audit::run()
+{
+    while (!m_stopping) {
+        boost::this_thread::sleep(boost::posix_time::microseconds(
+            std::max(g_flushInterval->val(), 1000ull)));
+        drain();
+    }
+    drain();
+    if (m_fd >= 0 && m_dirty)
+        fdatasync(m_fd);
+}
+
+void
+Audit::drain()
+{
+    std::string batch;
+    while (Node *node = m_queue.pop()) {
+        node->record.encode(batch);
+        delete node;
+    }
+    if (!batch.empty() && m_fd >= 0) {
+        const char *data = batch.c_str();
+        size_t remaining = batch.size();
+        while (remaining > 0u) {
+            ssize_t written = ::write(m_fd, data, remaining);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                MORDOR_LOG_ERROR(g_log) << "unable to write " << m_path
+                    << ": " << errno << "; dropped " << remaining << " bytes";
+                break;
+            }
+            data += written;
+            remaining -= written;
+        }
+        m_size += batch.size() - remaining;
+        m_dirty = true;
+    }
+
+    unsigned long long now = TimerManager::now();
+    if (m_fd >= 0 && m_dirty && now - m_lastSync >= g_fsyncInterval->val()) {
+        fdatasync(m_fd);
+        m_lastSync = now;
+        m_dirty = false;
+    }
+    if (m_fd < 0 && now >= m_nextOpen)
+        open();
+    else if (m_fd >= 0 && m_size >= g_maxSize->val())
+        rotate();
+}
+
+void
+Audit::open()
+{
+    m_fd = ::open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+        0600);
+    if (m_fd < 0) {
+        // records are dropped until it can be opened; rotating again would
+        // only push the logs that were kept out
+        m_size = 0ull;
+        m_openBackoff = std::min(std::max(m_openBackoff * 2, 1000000ull),
+            60000000ull);
+        m_nextOpen = TimerManager::now() + m_openBackoff;
+        MORDOR_LOG_ERROR(g_log) << "unable to open " << m_path << ": " << errno
+            << "; retrying in " << m_openBackoff / 1000000ull << "s";
+        return;
+    }
+    m_openBackoff = 0ull;
+    struct stat stats;
+    fstat(m_fd, &stats);
+    m_size = stats.st_size;
+    if (m_size == 0ull) {
+        if (::write(m_fd, AuditRecord::MAGIC, sizeof(AuditRecord::MAGIC)) ==
+            (ssize_t)sizeof(AuditRecord::MAGIC))
+            m_size = sizeof(AuditRecord::MAGIC);
+    }
+}
+
+void
+Audit::rotate()
+{
+    if (m_fd >= 0) {
+        fdatasync(m_fd);
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    m_dirty = false;
+    // path.1 becomes path.2 and so on, overwriting the oldest; path becomes
+    // path.1
+    unsigned int keep = std::max(g_keep->val(), 1u);
+    for (unsigned int i = keep - 1; i > 0u; --i) {
+        std::ostringstream from, to;
+        from << m_path << "." << i;
+        to << m_path << "." << i + 1;
+        rename(from.str().c_str(), to.str().c_str());
+    }
+    rename(m_path.c_str(), (m_path + ".1").c_str());
+    MORDOR_LOG_INFO(g_log) << "rotated " << m_path;
+    open();
+}
+
+}
@@ -0,0 +1,61 @@
+#ifndef __POSTGUARD_AUDIT_H__
+#define __POSTGUARD_AUDIT_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <atomic>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "postguard/auditrecord.h"
+#include "postguard/mpscqueue.h"
+
+namespace Postguard {
+
+/// Audit trail of client sessions
+///
+/// Sessions hand records to a lock-free queue, so logging never blocks (or
+/// takes a lock on) an IOManager thread.  A background thread drains the
+/// queue every postguard.audit.flush, appending each batch to the file with
+/// a single write, fsyncs every postguard.audit.fsync, and rotates the file
+/// once it grows past postguard.audit.maxsize.  If the file can't be
+/// (re)opened, records are dropped while opening it is retried with a
+/// backoff of up to a minute.
+class Audit : boost::noncopyable
+{
+public:
+    /// @param path Where to write; empty to discard all records
+    Audit(const std::string &path);
+    ~Audit();
+
+    /// Stamps the record with the current time, and queues it
+    void log(AuditRecord record);
+
+private:
+    struct Node : MpscQueueNode
+    {
+        AuditRecord record;
+    };
+
+    void run();
+    void drain();
+    void open();
+    void rotate();
+
+private:
+    const std::string m_path;
+    MpscQueue<Node> m_queue;
+    std::atomic<bool> m_stopping;
+    int m_fd;
+    unsigned long long m_size, m_lastSync;
+    /// When to retry opening the file after a failure, and how long to wait
+    /// after the next one
+    unsigned long long m_nextOpen, m_openBackoff;
+    bool m_dirty;
+    boost::thread m_thread;
+};
+
+}
+
+#endif
@@ -0,0 +1,112 @@
+// Copyright (c) 2014 - Cody Cutrer
+//
+// Converts postguard audit logs to JSON, one record per line
+
+#include <stdio.h>
+#include <string.h>
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#include "postguard/auditrecord.h"
+
+using namespace Postguard;
+
+static void writeString(std::ostream &os, const std::string &value)
+{
+    os << '"';
+    for (std::string::const_iterator it(value.begin()); it != value.end(); ++it) {
+        unsigned char c = (unsigned char)*it;
+        switch (c) {
+            case '"':
+                os << "\\\"";
+                break;
+            case '\\':
+                os << "\\\\";
+                break;
+            default:
+                if (c < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    os << escaped;
+                } else {
+                    os << (char)c;
+                }
+        }
+    }
+    os << '"';
+}
+
+static void writeRecord(std::ostream &os, const AuditRecord &record)
+{
+    os << "{\"type\":\"" << AuditRecord::typeName(record.type) << "\""
+        << ",\"timestamp\":" << record.timestamp
+        << ",\"session\":" << record.session
+        << ",\"user\":";
+    writeString(os, record.user);
+    os << ",\"database\":";
+    writeString(os, record.database);
+    if (!record.issue.empty()) {
+        os << ",\"issue\":";
+        writeString(os, record.issue);
+    }
+    if (record.type == AuditRecord::SESSION_END) {
+        os << ",\"bytes_from_client\":" << record.bytesFromClient
+            << ",\"bytes_from_server\":" << record.bytesFromServer
+            << ",\"duration\":" << record.duration;
+    }
+    os << "}" << std::endl;
+}
+
+static bool convert(const char *name, std::istream &is)
+{
+    std::string data((std::istreambuf_iterator<char>(is)),
+        std::istreambuf_iterator<char>());
+    if (data.size() < sizeof(AuditRecord::MAGIC) ||
+        memcmp(data.c_str(), AuditRecord::MAGIC, sizeof(AuditRecord::MAGIC)) != 0) {
+        std::cerr << name << ": not a postguard audit log" << std::endl;
+        return false;
+    }
+    size_t offset = sizeof(AuditRecord::MAGIC);
+    while (offset < data.size()) {
+        AuditRecord record;
+        size_t consumed;
+        try {
+            consumed = record.decode(data.c_str() + offset, data.size() - offset);
+        } catch (std::exception &ex) {
+            std::cerr << name << ": " << ex.what() << " at offset " << offset
+                << std::endl;
+            return false;
+        }
+        if (consumed == 0u) {
+            // the writer was mid-batch (or crashed); everything before is good
+            std::cerr << name << ": incomplete record at offset " << offset
+                << std::endl;
+            return false;
+        }
+        writeRecord(std::cout, record);
+        offset += consumed;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+        return convert("stdin", std::cin) ? 0 : 1;
+    int rc = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::ifstream file(argv[i], std::ios::in | std::ios::binary);
+        if (!file) {
+            std::cerr << argv[i] << ": unable to open" << std::endl;
+            rc = 1;
+            continue;
+        }
+        if (!convert(argv[i], file))
+            rc = 1;
+    }
+    return rc;
+}
@@ -0,0 +1,107 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include "postguard/auditrecord.h"
+
+#include <stdexcept>
+
+#include "postguard/littleendian.h"
+
+namespace Postguard {
+
+const char AuditRecord::MAGIC[8] = { 'P', 'G', 'A', 'U', 'D', 'I', 'T', '1' };
+
+namespace {
+struct Reader
+{
+    Reader(const char *data, size_t length) : data(data), length(length) {}
+
+    unsigned long long integer(size_t bytes)
+    {
+        if (length < bytes)
+            throw std::runtime_error("truncated audit record");
+        unsigned long long value = getInteger(data, bytes);
+        data += bytes;
+        length -= bytes;
+        return value;
+    }
+
+    std::string string()
+    {
+        size_t size = (size_t)integer(2u);
+        if (length < size)
+            throw std::runtime_error("truncated audit record");
+        std::string value(data, size);
+        data += size;
+        length -= size;
+        return value;
+    }
+
+    const char *data;
+    size_t length;
+};
+}
+
+void
+AuditRecord::encode(std::string &out) const
+{
+    size_t start = out.size();
+    putInteger(out, 0u, 4u);
+    putInteger(out, type, 1u);
+    putInteger(out, timestamp, 8u);
+    putInteger(out, session, 8u);
+    putString(out, user);
+    putString(out, database);
+    putString(out, issue);
+    putInteger(out, bytesFromClient, 8u);
+    putInteger(out, bytesFromServer, 8u);
+    putInteger(out, duration, 8u);
+    // now that we know it, fill in the length
+    std::string length;
+    putInteger(length, out.size() - start - 4u, 4u);
+    out.replace(start, 4u, length);
+}
+
+size_t
+AuditRecord::decode(const char *data, size_t length)
+{
+    if (length < 4u)
+        return 0u;
+    Reader header(data, 4u);
+    size_t size = (size_t)header.integer(4u);
+    if (length - 4u < size)
+        return 0u;
+
+    Reader reader(data + 4u, size);
+    type = (Type)reader.integer(1u);
+    if (type < CONNECT || type > SESSION_END)
+        throw std::runtime_error("unknown audit record type");
+    timestamp = reader.integer(8u);
+    session = reader.integer(8u);
+    user = reader.string();
+    database = reader.string();
+    issue = reader.string();
+    bytesFromClient = reader.integer(8u);
+    bytesFromServer = reader.integer(8u);
+    duration = reader.integer(8u);
+    // anything left over is from a newer version; skip it
+    return 4u + size;
+}
+
+const char *
+AuditRecord::typeName(Type type)
+{
+    switch (type) {
+        case CONNECT:
+            return "connect";
+        case GO_ACCEPTED:
+            return "go_accepted";
+        case GO_DENIED:
+            return "go_denied";
+        case SESSION_END:
+            return "session_end";
+        default:
+            return "unknown";
+    }
+}
+
+}
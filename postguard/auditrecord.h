@@ -0,0 +1,62 @@
+#ifndef __POSTGUARD_AUDITRECORD_H__
+#define __POSTGUARD_AUDITRECORD_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <stddef.h>
+
+#include <string>
+
+namespace Postguard {
+
+/// One entry of the audit log
+///
+/// An audit file starts with the 8 byte MAGIC, followed by records, each a
+/// little endian uint32 length followed by that many bytes: the type
+/// (uint8), timestamp, session (uint64s), user, database, issue (each a
+/// uint16 length and the bytes), then bytesFromClient, bytesFromServer and
+/// duration (uint64s).
+struct AuditRecord
+{
+    enum Type
+    {
+        CONNECT     = 1,
+        GO_ACCEPTED = 2,
+        GO_DENIED   = 3,
+        SESSION_END = 4
+    };
+
+    AuditRecord(Type type = CONNECT)
+        : type(type),
+          timestamp(0ull),
+          session(0ull),
+          bytesFromClient(0ull),
+          bytesFromServer(0ull),
+          duration(0ull)
+    {}
+
+    Type type;
+    /// us since the epoch
+    unsigned long long timestamp;
+    /// Ties the records of one client connection together
+    unsigned long long session;
+    std::string user, database, issue;
+    /// Only for SESSION_END
+    unsigned long long bytesFromClient, bytesFromServer;
+    /// Only for SESSION_END (us)
+    unsigned long long duration;
+
+    /// Append the length prefixed encoding to out
+    void encode(std::string &out) const;
+    /// @return The number of bytes consumed, or 0 if data doesn't hold a
+    ///         complete record yet
+    /// @throws std::runtime_error if the record is corrupt
+    size_t decode(const char *data, size_t length);
+
+    static const char *typeName(Type type);
+
+    static const char MAGIC[8];
+};
+
+}
+
+#endif
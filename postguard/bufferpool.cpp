@@ -0,0 +1,107 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/bufferpool.h"
+
+#include <new>
+
+#include <mordor/config.h>
+#include <mordor/exception.h>
+#include <mordor/statistics.h>
+
+#include "postguard/allocations.h"
+
+using namespace Mordor;
+
+static ConfigVar<size_t>::ptr g_segmentSize =
+    Config::lookup("postguard.buffer.size", (size_t)16384u,
+        "Size of pooled buffer segments (read once at startup)");
+static ConfigVar<size_t>::ptr g_cached =
+    Config::lookup("postguard.buffer.cached", (size_t)256u,
+        "Number of free buffer segments to keep cached on each thread");
+
+static CountStatistic<unsigned long long> &g_allocated =
+    Statistics::registerStatistic("postguard.buffer.allocated",
+        CountStatistic<unsigned long long>("segments"));
+static CountStatistic<unsigned long long> &g_inUse =
+    Statistics::registerStatistic("postguard.buffer.inuse",
+        CountStatistic<unsigned long long>("segments"));
+static CountStatistic<unsigned long long> &g_hits =
+    Statistics::registerStatistic("postguard.buffer.hits",
+        CountStatistic<unsigned long long>("segments"));
+static CountStatistic<unsigned long long> &g_misses =
+    Statistics::registerStatistic("postguard.buffer.misses",
+        CountStatistic<unsigned long long>("segments"));
+
+namespace Postguard {
+
+namespace {
+/// Intrusive free list; the link lives in the free segment itself
+struct FreeList
+{
+    FreeList() : head(NULL), count(0u) {}
+    ~FreeList()
+    {
+        while (head) {
+            char *next = *(char **)head;
+            ::operator delete(head);
+            g_allocated.decrement();
+            head = next;
+        }
+    }
+
+    char *head;
+    size_t count;
+};
+}
+
+static thread_local FreeList t_free;
+
+size_t
+BufferPool::segmentSize()
+{
+    static const size_t size = std::max(g_segmentSize->val(), sizeof(char *));
+    return size;
+}
+
+char *
+BufferPool::acquire()
+{
+    g_inUse.increment();
+    if (t_free.head) {
+        char *segment = t_free.head;
+        t_free.head = *(char **)segment;
+        --t_free.count;
+        g_hits.increment();
+        return segment;
+    }
+    g_misses.increment();
+    char *segment;
+    {
+        Allocations::Scope scope(Allocations::BUFFER);
+        segment = (char *)::operator new(segmentSize(), std::nothrow);
+    }
+    if (!segment) {
+        g_inUse.decrement();
+        MORDOR_THROW_EXCEPTION(std::bad_alloc());
+    }
+    g_allocated.increment();
+    return segment;
+}
+
+void
+BufferPool::release(char *segment)
+{
+    g_inUse.decrement();
+    if (t_free.count >= g_cached->val()) {
+        ::operator delete(segment);
+        g_allocated.decrement();
+        return;
+    }
+    *(char **)segment = t_free.head;
+    t_free.head = segment;
+    ++t_free.count;
+}
+
+}
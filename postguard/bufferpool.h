@@ -0,0 +1,45 @@
+#ifndef __POSTGUARD_BUFFERPOOL_H__
+#define __POSTGUARD_BUFFERPOOL_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <stddef.h>
+
+#include <boost/noncopyable.hpp>
+
+namespace Postguard {
+
+/// Fixed-size buffer segments, cached per thread
+///
+/// Segments released on a thread go back on that thread's free list (up to
+/// postguard.buffer.cached of them), and are handed out again without
+/// touching malloc or any lock.  Fibers can migrate between threads, so a
+/// segment may well be released on a different thread than it was acquired
+/// on; that's fine, it's just memory.
+class BufferPool
+{
+public:
+    /// A segment borrowed from the pool for the lifetime of this object
+    class Segment : boost::noncopyable
+    {
+    public:
+        Segment() : m_data(BufferPool::acquire()) {}
+        ~Segment() { BufferPool::release(m_data); }
+
+        char *data() { return m_data; }
+        size_t size() const { return BufferPool::segmentSize(); }
+
+    private:
+        char *m_data;
+    };
+
+public:
+    /// Fixed for the lifetime of the process
+    static size_t segmentSize();
+
+    static char *acquire();
+    static void release(char *segment);
+};
+
+}
+
+#endif
@@ -0,0 +1,79 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/cancelkeys.h"
+
+#include <openssl/rand.h>
+
+#include <mordor/exception.h>
+
+#include "postguard/server.h"
+
+using namespace Mordor;
+
+namespace Postguard {
+
+CancelKeyMap::Key
+CancelKeyMap::insert(std::shared_ptr<Server> server, const std::string &user)
+{
+    Entry entry;
+    entry.server = server;
+    entry.user = user;
+    while (true) {
+        Key key;
+        if (RAND_bytes((unsigned char *)&key, sizeof(key)) != 1)
+            MORDOR_THROW_EXCEPTION(std::runtime_error("Unable to generate cancel key"));
+        if (combine(key) == 0ull)
+            continue;
+        Shard &s = shard(key);
+        boost::mutex::scoped_lock lock(s.mutex);
+        if (s.entries.insert(std::make_pair(combine(key), entry)).second)
+            return key;
+    }
+}
+
+void
+CancelKeyMap::erase(const Key &key)
+{
+    Shard &s = shard(key);
+    boost::mutex::scoped_lock lock(s.mutex);
+    s.entries.erase(combine(key));
+}
+
+void
+CancelKeyMap::replace(const Key &key, std::shared_ptr<Server> server)
+{
+    Shard &s = shard(key);
+    boost::mutex::scoped_lock lock(s.mutex);
+    std::unordered_map<unsigned long long, Entry>::iterator it =
+        s.entries.find(combine(key));
+    if (it != s.entries.end())
+        it->second.server = server;
+}
+
+std::shared_ptr<Server>
+CancelKeyMap::find(const Key &key, const std::string &user) const
+{
+    Shard &s = shard(key);
+    boost::mutex::scoped_lock lock(s.mutex);
+    std::unordered_map<unsigned long long, Entry>::const_iterator it =
+        s.entries.find(combine(key));
+    if (it == s.entries.end() || it->second.user != user)
+        return std::shared_ptr<Server>();
+    return it->second.server.lock();
+}
+
+unsigned long long
+CancelKeyMap::combine(const Key &key)
+{
+    return ((unsigned long long)key.pid << 32) | key.secretKey;
+}
+
+CancelKeyMap::Shard &
+CancelKeyMap::shard(const Key &key) const
+{
+    return m_shards[key.pid % SHARDS];
+}
+
+}
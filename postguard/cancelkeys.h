@@ -0,0 +1,64 @@
+#ifndef __POSTGUARD_CANCELKEYS_H__
+#define __POSTGUARD_CANCELKEYS_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace Postguard {
+
+class Server;
+
+/// Maps the proxy-issued BackendKeyData handed to clients to the backend
+/// connection it stands in for, so that CancelRequests arriving on a new
+/// connection to postguard can be forwarded
+class CancelKeyMap : boost::noncopyable
+{
+public:
+    /// pid and secret key are kept in network byte order, exactly as they
+    /// appear on the wire
+    struct Key
+    {
+        unsigned int pid, secretKey;
+    };
+
+public:
+    CancelKeyMap() {}
+
+    /// Issue a new, unique key for server, owned by the Unix user user
+    Key insert(std::shared_ptr<Server> server, const std::string &user);
+    void erase(const Key &key);
+    /// Point an issued key at a different backend connection
+    void replace(const Key &key, std::shared_ptr<Server> server);
+    /// @return NULL if the key is unknown, or was issued to a different user
+    std::shared_ptr<Server> find(const Key &key, const std::string &user) const;
+
+private:
+    struct Entry
+    {
+        std::weak_ptr<Server> server;
+        std::string user;
+    };
+
+    struct Shard
+    {
+        mutable boost::mutex mutex;
+        std::unordered_map<unsigned long long, Entry> entries;
+    };
+
+    enum { SHARDS = 16 };
+
+    static unsigned long long combine(const Key &key);
+    Shard &shard(const Key &key) const;
+
+private:
+    mutable Shard m_shards[SHARDS];
+};
+
+}
+
+#endif
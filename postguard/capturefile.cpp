@@ -0,0 +1,228 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include "postguard/capturefile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <stdexcept>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "postguard/littleendian.h"
+#include "postguard/mpscqueue.h"
+
+namespace Postguard {
+
+static const char MAGIC[8] = { 'P', 'G', 'C', 'A', 'P', 'T', '0', '1' };
+
+// How often queued chunks are written out (us)
+static const unsigned long long FLUSH_INTERVAL = 10000ull;
+// Bytes queued for all captures together before chunks are dropped
+static const size_t MAX_QUEUED = 64u * 1024u * 1024u;
+
+struct CaptureWriter::File : boost::noncopyable
+{
+    File(gzFile file) : file(file), failed(false) {}
+    ~File() { gzclose(file); }
+
+    gzFile file;
+    /// Set once a write fails or a chunk is dropped; nothing more is
+    /// queued for the file after that
+    std::atomic<bool> failed;
+};
+
+namespace {
+/// The background writer shared by all captures
+class CaptureQueue : boost::noncopyable
+{
+public:
+    static CaptureQueue &get()
+    {
+        static CaptureQueue queue;
+        return queue;
+    }
+
+    /// An empty chunk just hands the queue the file's last reference, so
+    /// it's closed (and its last block compressed) on the writer thread
+    void push(std::shared_ptr<CaptureWriter::File> file, std::string chunk)
+    {
+        size_t size = chunk.size();
+        if (m_queued.fetch_add(size, std::memory_order_relaxed) + size >
+            MAX_QUEUED && size != 0u) {
+            m_queued.fetch_sub(size, std::memory_order_relaxed);
+            file->failed = true;
+            return;
+        }
+        Node *node = new Node();
+        node->file = std::move(file);
+        node->chunk = std::move(chunk);
+        m_queue.push(node);
+    }
+
+private:
+    struct Node : MpscQueueNode
+    {
+        std::shared_ptr<CaptureWriter::File> file;
+        std::string chunk;
+    };
+
+    CaptureQueue()
+        : m_queued(0u),
+          m_stopping(false)
+    {
+        m_thread = boost::thread(std::bind(&CaptureQueue::run, this));
+    }
+
+    ~CaptureQueue()
+    {
+        m_stopping = true;
+        m_thread.join();
+    }
+
+    void run()
+    {
+        while (!m_stopping) {
+            boost::this_thread::sleep(boost::posix_time::microseconds(
+                FLUSH_INTERVAL));
+            drain();
+        }
+        drain();
+    }
+
+    void drain()
+    {
+        while (Node *node = m_queue.pop()) {
+            CaptureWriter::File &file = *node->file;
+            const std::string &chunk = node->chunk;
+            // gzwrite only hits the disk once its 64KiB buffer fills up
+            if (!chunk.empty() && !file.failed &&
+                gzwrite(file.file, chunk.c_str(), chunk.size()) != (int)chunk.size())
+                file.failed = true;
+            m_queued.fetch_sub(chunk.size(), std::memory_order_relaxed);
+            delete node;
+        }
+    }
+
+private:
+    MpscQueue<Node> m_queue;
+    std::atomic<size_t> m_queued;
+    std::atomic<bool> m_stopping;
+    boost::thread m_thread;
+};
+}
+
+CaptureWriter::CaptureWriter(const std::string &path,
+    const CaptureHeader &header, unsigned long long now)
+    : m_start(now)
+{
+    // never follow a planted symlink, or append to someone else's file
+    int fd = ::open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC,
+        0600);
+    if (fd < 0)
+        throw std::runtime_error("Unable to create " + path + ": " +
+            strerror(errno));
+    gzFile file = gzdopen(fd, "wb6");
+    if (!file) {
+        ::close(fd);
+        throw std::runtime_error("Unable to create " + path);
+    }
+    gzbuffer(file, 65536u);
+    m_file.reset(new File(file));
+    std::string out(MAGIC, sizeof(MAGIC));
+    putInteger(out, header.start, 8u);
+    putString(out, header.user);
+    putString(out, header.database);
+    putString(out, header.issue);
+    CaptureQueue::get().push(m_file, std::move(out));
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    CaptureQueue::get().push(std::move(m_file), std::string());
+}
+
+void
+CaptureWriter::write(bool fromClient, unsigned long long now,
+    const char *data, size_t length)
+{
+    if (m_file->failed.load(std::memory_order_relaxed))
+        return;
+    std::string chunk;
+    chunk.reserve(13u + length);
+    putInteger(chunk, fromClient ? 0u : 1u, 1u);
+    putInteger(chunk, now - m_start, 8u);
+    putInteger(chunk, length, 4u);
+    chunk.append(data, length);
+    CaptureQueue::get().push(m_file, std::move(chunk));
+}
+
+CaptureReader::CaptureReader(const std::string &path)
+    : m_file(gzopen(path.c_str(), "rb"))
+{
+    if (!m_file)
+        throw std::runtime_error("Unable to open " + path);
+    char magic[sizeof(MAGIC)];
+    if (!read(magic, sizeof(magic), true) ||
+        memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+        gzclose(m_file);
+        throw std::runtime_error(path + " is not a postguard capture");
+    }
+    m_header.start = integer(8u);
+    m_header.user = string();
+    m_header.database = string();
+    m_header.issue = string();
+}
+
+CaptureReader::~CaptureReader()
+{
+    gzclose(m_file);
+}
+
+bool
+CaptureReader::next(CaptureChunk &chunk)
+{
+    unsigned char direction;
+    if (!read(&direction, 1u, true))
+        return false;
+    chunk.fromClient = direction == 0u;
+    chunk.timestamp = integer(8u);
+    chunk.data.resize((size_t)integer(4u));
+    if (!chunk.data.empty())
+        read(&chunk.data[0], chunk.data.size());
+    return true;
+}
+
+bool
+CaptureReader::read(void *buffer, size_t length, bool eofOk)
+{
+    int read = gzread(m_file, buffer, length);
+    if (read == 0 && eofOk)
+        return false;
+    if (read != (int)length)
+        throw std::runtime_error("truncated capture");
+    return true;
+}
+
+unsigned long long
+CaptureReader::integer(size_t bytes)
+{
+    unsigned char buffer[8];
+    read(buffer, bytes);
+    return getInteger(buffer, bytes);
+}
+
+std::string
+CaptureReader::string()
+{
+    std::string value((size_t)integer(2u), '\0');
+    if (!value.empty())
+        read(&value[0], value.size());
+    return value;
+}
+
+}
@@ -0,0 +1,98 @@
+#ifndef __POSTGUARD_CAPTUREFILE_H__
+#define __POSTGUARD_CAPTUREFILE_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+
+#include <zlib.h>
+
+namespace Postguard {
+
+/// Gzipped recording of both directions of a relayed session
+///
+/// After the 8 byte MAGIC, a capture holds the wall clock time the capture
+/// started (us since the epoch), then the user, database and issue (each a
+/// uint16 length and the bytes), followed by chunks: a direction (uint8, 0
+/// from the client, 1 from the server), the time since the capture started
+/// (uint64, us), and the data (uint32 length and the bytes).  All integers
+/// are little endian.
+struct CaptureHeader
+{
+    CaptureHeader() : start(0ull) {}
+
+    unsigned long long start;
+    std::string user, database, issue;
+};
+
+struct CaptureChunk
+{
+    CaptureChunk() : fromClient(false), timestamp(0ull) {}
+
+    bool fromClient;
+    /// us since the capture started
+    unsigned long long timestamp;
+    std::string data;
+};
+
+/// Writes a capture without blocking the relay
+///
+/// Chunks are copied onto a lock-free queue shared by all captures, and a
+/// single background thread compresses and writes them, like the audit
+/// log.  If the disk can't keep up and too much is queued, further chunks
+/// are dropped and the capture ends early rather than growing without
+/// bound.
+class CaptureWriter : boost::noncopyable
+{
+public:
+    typedef std::shared_ptr<CaptureWriter> ptr;
+    struct File;
+
+public:
+    /// @param now Monotonic time (us) that chunk times are relative to
+    /// @throws std::runtime_error if path can't be created (or already
+    /// exists)
+    CaptureWriter(const std::string &path, const CaptureHeader &header,
+        unsigned long long now);
+    /// The file is closed by the writer once everything queued for it is
+    /// written
+    ~CaptureWriter();
+
+    /// Safe to call from both directions at once
+    void write(bool fromClient, unsigned long long now, const char *data,
+        size_t length);
+
+private:
+    std::shared_ptr<File> m_file;
+    const unsigned long long m_start;
+};
+
+class CaptureReader : boost::noncopyable
+{
+public:
+    /// @throws std::runtime_error if path isn't a capture
+    CaptureReader(const std::string &path);
+    ~CaptureReader();
+
+    const CaptureHeader &header() const { return m_header; }
+    /// @return false at the end of the capture
+    /// @throws std::runtime_error if the capture is truncated
+    bool next(CaptureChunk &chunk);
+
+private:
+    bool read(void *buffer, size_t length, bool eofOk = false);
+    unsigned long long integer(size_t bytes);
+    std::string string();
+
+private:
+    gzFile m_file;
+    CaptureHeader m_header;
+};
+
+}
+
+#endif
@@ -0,0 +1,140 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/certificate.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <mordor/exception.h>
+#include <mordor/log.h>
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:certificate");
+
+namespace Postguard {
+
+static std::shared_ptr<EVP_PKEY> generateKey()
+{
+    std::shared_ptr<EVP_PKEY_CTX> ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL),
+        &EVP_PKEY_CTX_free);
+    EVP_PKEY *key = NULL;
+    if (!ctx || EVP_PKEY_keygen_init(ctx.get()) <= 0 ||
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(), NID_X9_62_prime256v1) <= 0 ||
+        EVP_PKEY_keygen(ctx.get(), &key) <= 0)
+        MORDOR_THROW_EXCEPTION(std::runtime_error("Unable to generate P-256 key"));
+    return std::shared_ptr<EVP_PKEY>(key, &EVP_PKEY_free);
+}
+
+static std::shared_ptr<X509> generateCertificate(EVP_PKEY *key)
+{
+    std::shared_ptr<X509> cert(X509_new(), &X509_free);
+    if (!cert)
+        MORDOR_THROW_EXCEPTION(std::runtime_error("Unable to allocate certificate"));
+
+    char hostname[256];
+    if (gethostname(hostname, sizeof(hostname)) != 0)
+        strcpy(hostname, "postguard");
+    hostname[sizeof(hostname) - 1] = '\0';
+
+    X509_set_version(cert.get(), 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), (long)time(NULL));
+    X509_gmtime_adj(X509_getm_notBefore(cert.get()), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert.get()), 10l * 365 * 24 * 60 * 60);
+    X509_set_pubkey(cert.get(), key);
+    X509_NAME *name = X509_get_subject_name(cert.get());
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+        (const unsigned char *)hostname, -1, -1, 0);
+    X509_set_issuer_name(cert.get(), name);
+    if (!X509_sign(cert.get(), key, EVP_sha256()))
+        MORDOR_THROW_EXCEPTION(std::runtime_error("Unable to sign certificate"));
+    return cert;
+}
+
+static void writePem(const std::string &path, mode_t mode,
+    const std::function<int (FILE *)> &write)
+{
+    // write to a temporary file and rename it into place, so a crash never
+    // leaves a truncated key behind
+    std::string temp = path + ".tmp";
+    unlink(temp.c_str());
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL, mode);
+    if (fd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("open");
+    FILE *file = fdopen(fd, "w");
+    if (!file) {
+        close(fd);
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fdopen");
+    }
+    bool written = write(file) && fflush(file) == 0 && fsync(fd) == 0;
+    fclose(file);
+    if (!written || rename(temp.c_str(), path.c_str()) != 0) {
+        unlink(temp.c_str());
+        MORDOR_THROW_EXCEPTION(std::runtime_error("Unable to write " + path));
+    }
+}
+
+static int writeKey(EVP_PKEY *key, FILE *file)
+{
+    return PEM_write_PrivateKey(file, key, NULL, NULL, 0, NULL, NULL);
+}
+
+static int writeCertificate(X509 *cert, FILE *file)
+{
+    return PEM_write_X509(file, cert);
+}
+
+std::shared_ptr<SSL_CTX>
+createServerContext(const std::string &certFile, const std::string &keyFile)
+{
+    std::shared_ptr<SSL_CTX> ctx(SSL_CTX_new(SSLv23_server_method()), &SSL_CTX_free);
+    if (!ctx)
+        MORDOR_THROW_EXCEPTION(std::runtime_error("Unable to create SSL context"));
+
+    if (certFile.empty() != keyFile.empty())
+        MORDOR_THROW_EXCEPTION(std::runtime_error(
+            "postguard.ssl.cert and postguard.ssl.key must be set together"));
+    bool configured = !certFile.empty();
+    struct stat stats;
+    bool certExists = configured && stat(certFile.c_str(), &stats) == 0;
+    bool keyExists = configured && stat(keyFile.c_str(), &stats) == 0;
+    // never replace half of the operator's certificate
+    if (certExists != keyExists)
+        MORDOR_THROW_EXCEPTION(std::runtime_error("Only one of " + certFile +
+            " and " + keyFile + " exists"));
+    if (certExists) {
+        MORDOR_LOG_INFO(g_log) << "loading certificate from " << certFile;
+        if (SSL_CTX_use_certificate_chain_file(ctx.get(), certFile.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx.get(), keyFile.c_str(), SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx.get()) != 1)
+            MORDOR_THROW_EXCEPTION(std::runtime_error("Unable to load " +
+                certFile + " and " + keyFile));
+        return ctx;
+    }
+
+    std::shared_ptr<EVP_PKEY> key = generateKey();
+    std::shared_ptr<X509> cert = generateCertificate(key.get());
+    if (configured) {
+        MORDOR_LOG_INFO(g_log) << "generated certificate, saving to " << certFile;
+        writePem(keyFile, 0600, std::bind(&writeKey, key.get(), std::placeholders::_1));
+        writePem(certFile, 0644, std::bind(&writeCertificate, cert.get(), std::placeholders::_1));
+    } else {
+        MORDOR_LOG_INFO(g_log) << "generated ephemeral certificate";
+    }
+    if (SSL_CTX_use_certificate(ctx.get(), cert.get()) != 1 ||
+        SSL_CTX_use_PrivateKey(ctx.get(), key.get()) != 1)
+        MORDOR_THROW_EXCEPTION(std::runtime_error("Unable to use generated certificate"));
+    return ctx;
+}
+
+}
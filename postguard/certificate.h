@@ -0,0 +1,25 @@
+#ifndef __POSTGUARD_CERTIFICATE_H__
+#define __POSTGUARD_CERTIFICATE_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <memory>
+#include <string>
+
+#include <openssl/ssl.h>
+
+namespace Postguard {
+
+/// Create the SSL context used to accept client connections
+///
+/// If certFile and keyFile exist, they are loaded.  If they are configured,
+/// but neither exists yet, a P-256 ECDSA key and self-signed certificate are
+/// generated and written there, so that the same certificate is used after
+/// a restart.  If they aren't configured at all, an ephemeral P-256
+/// certificate is generated.  Configuring (or finding) only one of them is
+/// an error.
+std::shared_ptr<SSL_CTX> createServerContext(const std::string &certFile,
+    const std::string &keyFile);
+
+}
+
+#endif
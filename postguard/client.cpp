@@ -4,20 +4,32 @@
 
 #include "postguard/client.h"
 
+#include <sys/time.h>
+
 #include <map>
 #include <regex>
 
+#include <mordor/config.h>
 #include <mordor/endian.h>
 #include <mordor/fiber.h>
+#include <mordor/fibersynchronization.h>
+#include <mordor/iomanager.h>
 #include <mordor/log.h>
 #include <mordor/parallel.h>
+#include <mordor/scheduler.h>
+#include <mordor/sleep.h>
 #include <mordor/streams/buffer.h>
 #include <mordor/streams/buffered.h>
 #include <mordor/streams/null.h>
+#include <mordor/streams/socket.h>
 #include <mordor/streams/ssl.h>
 #include <mordor/streams/stream.h>
 #include <mordor/streams/transfer.h>
+#include <mordor/timer.h>
 
+#include "postguard/allocations.h"
+#include "postguard/audit.h"
+#include "postguard/bufferpool.h"
 #include "postguard/jira.h"
 #include "postguard/postguard.h"
 #include "postguard/server.h"
@@ -26,28 +38,288 @@ using namespace Mordor;
 
 static Logger::ptr g_log = Log::lookup("postguard:client");
 
+static ConfigVar<unsigned long long>::ptr g_startupTimeout =
+    Config::lookup("postguard.timeout.startup", 60000000ull,
+        "How long a client has to complete startup, including waiting for admission and the backend connection (us, 0 to disable)");
+static ConfigVar<unsigned long long>::ptr g_goTimeout =
+    Config::lookup("postguard.timeout.go", 3600000000ull,
+        "How long a client has after startup to send GO (us, 0 to disable)");
+static ConfigVar<unsigned long long>::ptr g_jiraTimeout =
+    Config::lookup("postguard.timeout.jira", 10000000ull,
+        "How long startup waits for JIRA to confirm an issue given as a startup parameter (us, 0 for no limit other than the startup timeout)");
+static ConfigVar<bool>::ptr g_eventRelay =
+    Config::lookup("postguard.relay.evented", true,
+        "Relay plaintext sessions from IOManager callbacks instead of fibers");
+static ConfigVar<bool>::ptr g_telemetry =
+    Config::lookup("postguard.relay.telemetry", false,
+        "Track per-statement timings of relayed sessions");
+static ConfigVar<std::string>::ptr g_captureDir =
+    Config::lookup("postguard.capture.dir", std::string(),
+        "Directory to record relayed sessions to for replay (empty to disable)");
+static ConfigVar<unsigned long long>::ptr g_idleTimeout =
+    Config::lookup("postguard.timeout.idle", 0ull,
+        "How long a relayed session can go without any traffic (us, 0 to disable)");
+
 namespace Postguard {
 
+static unsigned long long firstSession()
+{
+    // unique across restarts too, as long as we start less than a million
+    // sessions per second
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000000ull + now.tv_usec;
+}
+
+static std::atomic<unsigned long long> g_nextSession(firstSession());
+
+static const std::regex g_issueKey("^[A-Z]+-[0-9]+$", std::regex::icase);
+
+/// Remove the issue key from the startup parameters, either given directly
+/// as postguard.issue, or as -c postguard.issue=KEY (or
+/// --postguard.issue=KEY) in options, like a GUC
+static std::string extractIssue(std::map<std::string, std::string> &parameters)
+{
+    static const std::string name("postguard.issue=");
+    std::string issue;
+    std::map<std::string, std::string>::iterator it;
+    if ( (it = parameters.find("postguard.issue")) != parameters.end()) {
+        issue = it->second;
+        parameters.erase(it);
+    }
+    if ( (it = parameters.find("options")) == parameters.end())
+        return issue;
+
+    std::istringstream is(it->second);
+    std::vector<std::string> options;
+    std::string option;
+    while (is >> option)
+        options.push_back(option);
+    std::ostringstream remaining;
+    for (size_t i = 0; i < options.size(); ++i) {
+        std::string setting;
+        size_t consumed = 1u;
+        if (options[i] == "-c" && i + 1 < options.size()) {
+            setting = options[i + 1];
+            consumed = 2u;
+        } else if (options[i].compare(0, 2, "-c") == 0) {
+            setting = options[i].substr(2);
+        } else if (options[i].compare(0, 2, "--") == 0) {
+            setting = options[i].substr(2);
+        }
+        if (setting.compare(0, name.length(), name) == 0) {
+            issue = setting.substr(name.length());
+            i += consumed - 1u;
+            continue;
+        }
+        if (remaining.tellp() > 0)
+            remaining << ' ';
+        remaining << options[i];
+    }
+    if (remaining.str().empty())
+        parameters.erase(it);
+    else
+        it->second = remaining.str();
+    return issue;
+}
+
+/// Replace -- and (nested) /* */ comments with a space, leaving quoted
+/// strings and identifiers alone
+static std::string stripComments(const std::string &sql)
+{
+    std::string result;
+    result.reserve(sql.size());
+    size_t i = 0;
+    while (i < sql.size()) {
+        char c = sql[i];
+        if (c == '\'' || c == '"') {
+            size_t end = sql.find(c, i + 1);
+            end = end == std::string::npos ? sql.size() : end + 1;
+            result.append(sql, i, end - i);
+            i = end;
+        } else if (c == '-' && i + 1 < sql.size() && sql[i + 1] == '-') {
+            i = sql.find('\n', i);
+            if (i == std::string::npos)
+                i = sql.size();
+            result += ' ';
+        } else if (c == '/' && i + 1 < sql.size() && sql[i + 1] == '*') {
+            int depth = 1;
+            for (i += 2; i < sql.size() && depth > 0; ++i) {
+                if (sql[i] == '/' && i + 1 < sql.size() && sql[i + 1] == '*') {
+                    ++depth;
+                    ++i;
+                } else if (sql[i] == '*' && i + 1 < sql.size() && sql[i + 1] == '/') {
+                    --depth;
+                    ++i;
+                }
+            }
+            result += ' ';
+        } else {
+            result += c;
+            ++i;
+        }
+    }
+    return result;
+}
+
+namespace {
+/// Looking up an issue given at startup, while the backend connects
+struct IssueCheck
+{
+    IssueCheck() : done(false), exists(false), failed(false), settled(false) {}
+
+    FiberEvent done;
+    bool exists, failed;
+    std::string error;
+    /// Claimed by whichever of the lookup and abandonIssueCheck finishes
+    /// first; only that one fills in the result
+    std::atomic<bool> settled;
+};
+}
+
+static void checkIssue(Jira &jira, const std::string &key,
+    std::shared_ptr<IssueCheck> check)
+{
+    bool exists = false, failed = false;
+    std::string error;
+    try {
+        exists = jira.issueExists(key);
+    } catch (...) {
+        failed = true;
+        error = boost::current_exception_diagnostic_information();
+    }
+    if (check->settled.exchange(true)) {
+        MORDOR_LOG_VERBOSE(g_log) << "lookup of " << key
+            << " finished after startup stopped waiting for it";
+        return;
+    }
+    check->exists = exists;
+    check->failed = failed;
+    check->error = error;
+    check->done.set();
+}
+
+/// The HTTP request can't be interrupted, but its result can be ignored
+static void abandonIssueCheck(std::shared_ptr<IssueCheck> check,
+    const char *reason)
+{
+    if (check->settled.exchange(true))
+        return;
+    check->failed = true;
+    check->error = reason;
+    check->done.set();
+}
+
 Client::Client(Postguard &postguard, IOManager &ioManager, Stream::ptr stream,
     const std::string &user)
     : Connection(stream),
       m_postguard(postguard),
       m_ioManager(ioManager),
-      m_user(user)
-{}
+      m_socket(std::static_pointer_cast<SocketStream>(stream)->socket()),
+      m_user(user),
+      m_session(g_nextSession++),
+      m_start(TimerManager::now()),
+      m_ssl(false),
+      m_connected(false),
+      m_bytesFromClient(0ull),
+      m_bytesFromServer(0ull),
+      m_pool(0u),
+      m_phase(NONE),
+      m_timedOut(NONE),
+      m_lastActivity(0ull),
+      m_detached(false)
+{
+    m_cancelKey.pid = m_cancelKey.secretKey = 0u;
+    Allocations::connectionOpened();
+}
 
 void
 Client::run()
 {
     try {
-        if (!startup()) {
-            return;
+        phase(STARTUP, g_startupTimeout->val());
+        if (startup()) {
+            if (m_issue.empty()) {
+                phase(WAITING_FOR_GO, g_goTimeout->val());
+                while (readyForQuery());
+            } else {
+                // already accepted during startup; no GO to wait for
+                Buffer message;
+                put(message, (char)IDLE);
+                writeV3Message(READY_FOR_QUERY, message);
+                relaySession();
+            }
         }
-        while (readyForQuery());
     } catch(OperationAbortedException &) {
+        Phase timedOut;
+        {
+            boost::mutex::scoped_lock lock(m_timeoutMutex);
+            timedOut = m_timedOut;
+        }
+        try {
+            switch (timedOut) {
+                case STARTUP:
+                    writeError("FATAL", "08006", "timeout expired during connection startup");
+                    break;
+                case WAITING_FOR_GO:
+                    writeError("FATAL", "57P05", "terminating connection due to timeout waiting for GO");
+                    break;
+                case RELAY:
+                    writeError("FATAL", "57P05", "terminating connection due to idle-session timeout");
+                    break;
+                default:
+                    break;
+            }
+        } catch (...) {
+        }
     } catch(...) {
         MORDOR_LOG_ERROR(g_log) << this << " Unexpected exception: " << boost::current_exception_diagnostic_information();
     }
+    if (!m_detached)
+        finished();
+}
+
+void
+Client::close()
+{
+    EventRelay::ptr relay;
+    {
+        boost::mutex::scoped_lock lock(m_timeoutMutex);
+        relay = m_eventRelay;
+    }
+    if (relay)
+        relay->cancel();
+    Connection::close();
+}
+
+void
+Client::finished()
+{
+    phase(NONE, 0ull);
+    if (m_connected) {
+        {
+            boost::mutex::scoped_lock lock(m_timeoutMutex);
+            if (m_eventRelay) {
+                m_bytesFromClient += m_eventRelay->bytesFromClient();
+                m_bytesFromServer += m_eventRelay->bytesFromServer();
+            }
+        }
+        Allocations::relayed(m_bytesFromClient + m_bytesFromServer);
+        audit(AuditRecord::SESSION_END);
+    }
+    if (m_cancelKey.pid != 0u || m_cancelKey.secretKey != 0u)
+        m_postguard.cancelKeys().erase(m_cancelKey);
+    {
+        boost::mutex::scoped_lock lock(m_timeoutMutex);
+        m_eventRelay.reset();
+        m_server.reset();
+    }
+    m_sampled.reset();
+    if (m_statements && m_statements->flagged())
+        m_statements->dump();
+    m_statements.reset();
+    // hand the backend slot to the next client in line
+    m_admission.reset();
     m_postguard.closed(shared_from_this());
 }
 
@@ -80,8 +352,13 @@ Client::startup()
             bufferedStream->bufferSize(16384);
 
             SSLStream::ptr sslStream(new SSLStream(m_stream, false, true, m_postguard.sslCtx()));
-            sslStream->accept();
-            sslStream->flush();
+            {
+                // keep the handshake's CPU work off the I/O threads
+                SchedulerSwitcher switcher(&m_postguard.handshakeScheduler());
+                sslStream->accept();
+                sslStream->flush();
+            }
+            m_ssl = true;
             m_stream.reset(new BufferedStream(sslStream));
         } else {
             MORDOR_LOG_VERBOSE(g_log) << this << " rejecting SSL request";
@@ -92,6 +369,11 @@ Client::startup()
         readV2Message(type, message);
     }
 
+    if (type == CANCEL_REQUEST) {
+        cancel(message);
+        return false;
+    }
+
     if (type != STARTUP_REQUEST_V3) {
         writeError("ERROR", "08P01", "Expected StartupMessage");
         m_stream->close();
@@ -130,6 +412,13 @@ Client::startup()
         return false;
     }
 
+    std::string issue = extractIssue(parameters);
+    if (!issue.empty() && !std::regex_match(issue, g_issueKey)) {
+        writeError("FATAL", "22023", "Invalid postguard.issue \"" + issue + "\"");
+        m_stream->close();
+        return false;
+    }
+
     message.clear();
     put(message, AUTHENTICATION_OK);
     writeV3Message(AUTHENTICATION, message);
@@ -145,20 +434,105 @@ Client::startup()
     }
 
     server_parameters.insert(parameters.begin(), parameters.end());
+
+    std::string dbname = user;
+    if ( (it = server_parameters.find("dbname")) != server_parameters.end())
+        dbname = it->second;
+    std::string target;
+    size_t pool = 0u;
+    std::shared_ptr<const RoutingTable::Cluster> cluster =
+        m_postguard.router().route(dbname);
+    if (cluster) {
+        // the cluster decides where to connect, not the environment
+        server_parameters.erase("host");
+        server_parameters.erase("hostaddr");
+        server_parameters.erase("port");
+        for (std::map<std::string, std::string>::const_iterator it(cluster->parameters.begin());
+            it != cluster->parameters.end();
+            ++it)
+            server_parameters[it->first] = it->second;
+        // the pool covers the whole cluster, not each of its dbnames
+        target = "cluster " + cluster->name;
+        pool = cluster->pool;
+        MORDOR_LOG_VERBOSE(g_log) << this << " routed " << dbname << " to "
+            << cluster->name;
+    } else {
+        target = Admission::target(server_parameters);
+    }
+    m_target = target;
+    m_pool = pool;
+
+    // Enforced settings go into the StartupMessage, over anything the
+    // client asked for; those that need the issue key wait for GO
+    m_policy = m_postguard.policy().settings(m_user, dbname);
+    for (PolicyTable::Settings::const_iterator it(m_policy.begin());
+        it != m_policy.end();
+        ++it) {
+        if (issue.empty() && Policy::needsIssue(it->second))
+            continue;
+        server_parameters[it->first] = Policy::expand(it->second, m_user, issue);
+    }
+
+    // The startup timeout only interrupts reads from the client; waiting
+    // for admission and the backend on its behalf gets what's left of it
+    unsigned long long deadline = g_startupTimeout->val() == 0ull ? ~0ull :
+        m_start + g_startupTimeout->val();
+    try {
+        unsigned long long now = TimerManager::now();
+        m_admission = m_postguard.admission().acquire(target, m_user, pool,
+            deadline == ~0ull ? ~0ull : deadline > now ? deadline - now : 1ull);
+    } catch (AdmissionRejectedError &e) {
+        writeError("FATAL", "53300", e.what());
+        m_stream->close();
+        return false;
+    }
+
+    // Look the issue up while the backend connection is being set up; not
+    // before admission, which can turn the client away without a lookup
+    std::shared_ptr<IssueCheck> check;
+    TimerWheel::Timeout::ptr checkTimeout;
+    if (!issue.empty()) {
+        check.reset(new IssueCheck());
+        m_ioManager.schedule(std::bind(&checkIssue,
+            std::ref(m_postguard.jira()), issue, check));
+        unsigned long long now = TimerManager::now();
+        unsigned long long wait = deadline == ~0ull ? ~0ull :
+            deadline > now ? deadline - now : 1ull;
+        if (g_jiraTimeout->val() != 0ull)
+            wait = std::min(wait, g_jiraTimeout->val());
+        if (wait != ~0ull)
+            checkTimeout = m_postguard.timerWheel().add(wait,
+                std::bind(&abandonIssueCheck, check, "timed out"));
+    }
     try {
         m_server = Server::connect(m_ioManager, server_parameters,
-            &m_postguard.pgPassFile());
+            &m_postguard.pgPassFile(), &m_postguard.resolver(),
+            &m_postguard.handshakeScheduler(), &m_postguard.health(), deadline);
     } catch (...) {
         MORDOR_LOG_ERROR(g_log) << this << " Unable to connect to server: " <<
             boost::current_exception_diagnostic_information();
         writeError("ERROR", "08000", "Unable to connect to server");
         m_stream->close();
+        if (checkTimeout)
+            checkTimeout->cancel();
+        if (check)
+            abandonIssueCheck(check, "startup failed");
         return false;
     }
 
+    if ( (it = server_parameters.find("dbname")) != server_parameters.end())
+        m_database = it->second;
+    else
+        m_database = user;
+    m_serverParameters = server_parameters;
+    m_connected = true;
+    audit(AuditRecord::CONNECT);
+
+    // Hand out our own key, so that CancelRequests come back through us
+    m_cancelKey = m_postguard.cancelKeys().insert(m_server, m_user);
     message.clear();
-    put(message, m_server->pid());
-    put(message, m_server->secretKey());
+    put(message, m_cancelKey.pid);
+    put(message, m_cancelKey.secretKey);
     writeV3Message(BACKEND_KEY_DATA, message);
 
     for (std::map<std::string, std::string>::const_iterator it(m_server->parameters().begin());
@@ -172,12 +546,64 @@ Client::startup()
         writeV3Message(PARAMETER_STATUS, message);
     }
 
+    if (check) {
+        check->done.wait();
+        if (checkTimeout) {
+            checkTimeout->cancel();
+            checkTimeout.reset();
+        }
+        if (check->failed) {
+            MORDOR_LOG_ERROR(g_log) << this << " Could not determine if " << issue
+                << " exists: " << check->error;
+            audit(AuditRecord::GO_DENIED, issue);
+            writeError("FATAL", "58030", "Unable to contact JIRA");
+            m_stream->close();
+            return false;
+        }
+        if (!check->exists) {
+            MORDOR_LOG_WARNING(g_log) << this << " " << m_user
+                << " referenced non-existent issue " << issue << " at startup";
+            audit(AuditRecord::GO_DENIED, issue);
+            writeError("FATAL", "42704", "Issue " + issue + " does not exist");
+            m_stream->close();
+            return false;
+        }
+        MORDOR_LOG_INFO(g_log) << this << " " << m_user << " referenced issue "
+            << issue << " at startup";
+        m_issue = issue;
+        audit(AuditRecord::GO_ACCEPTED, issue);
+    }
+
     return true;
 }
 
-static void transfer(Stream::ptr from, Stream::ptr to)
+void
+Client::cancel(Buffer &message)
 {
-    transferStream(from, to);
+    if (message.readAvailable() != 8u) {
+        MORDOR_LOG_WARNING(g_log) << this << " malformed CancelRequest from " << m_user;
+        m_stream->close();
+        return;
+    }
+
+    CancelKeyMap::Key key;
+    message.copyOut(&key.pid, 4u);
+    message.consume(4u);
+    message.copyOut(&key.secretKey, 4u);
+    // CancelRequests never get a response; just hang up when we're done
+    Server::ptr server = m_postguard.cancelKeys().find(key, m_user);
+    if (server) {
+        MORDOR_LOG_INFO(g_log) << this << " " << m_user << " cancelling query on " << server;
+        try {
+            server->cancel(m_ioManager);
+        } catch (...) {
+            MORDOR_LOG_ERROR(g_log) << this << " Unable to forward CancelRequest: " <<
+                boost::current_exception_diagnostic_information();
+        }
+    } else {
+        MORDOR_LOG_WARNING(g_log) << this << " " << m_user << " sent CancelRequest for unknown session";
+    }
+    m_stream->close();
 }
 
 bool
@@ -196,17 +622,21 @@ Client::readyForQuery()
         case QUERY:
         {
             static const std::regex show_set_query("^(?:SHOW|SET)[^;]+;?$", std::regex::icase);
-            static const std::regex go_query("^GO ([A-Z]+-[0-9]+);?$", std::regex::icase);
+            static const std::regex go_query("^GO ([A-Z]+-[0-9]+)( READONLY)?;?$", std::regex::icase);
             std::string query = message.getDelimited('\0', false, false);
             std::smatch what;
             if (message.readAvailable() != 0u) {
                 writeError("ERROR", "08P01", "Malformed Query message");
             } else if (std::regex_match(query, show_set_query)) {
-                proxyQuery(query);
+                std::string violation = policyViolation(query);
+                if (violation.empty())
+                    proxyQuery(query);
+                else
+                    writeError("ERROR", "42501", violation);
             } else if (std::regex_match(query, what, go_query)) {
-                return go(what[1]);
+                return go(what[1], what[2].matched);
             } else {
-                writeError("ERROR", "42601", "Postguard only understands \"GO JIRA-1\"");
+                writeError("ERROR", "42601", "Postguard only understands \"GO JIRA-1 [READONLY]\"");
             }
             break;
         }
@@ -242,8 +672,174 @@ Client::proxyQuery(const std::string &query)
     }
 }
 
+void
+Client::routeToStandby()
+{
+    if (m_server->roleKnown() && m_server->standby())
+        return;
+    // don't spend a backend connection finding out there's no standby
+    std::vector<std::string> hosts = Server::hostKeys(m_serverParameters);
+    if (hosts.size() <= 1u || !m_postguard.health().standbyPossible(hosts)) {
+        MORDOR_LOG_VERBOSE(g_log) << this << " no standby known for "
+            << m_user << "; staying on the primary";
+        return;
+    }
+
+    // A new session on a standby; anything SET before GO stays behind on
+    // the primary
+    std::map<std::string, std::string> parameters(m_serverParameters);
+    parameters["target_session_attrs"] = "prefer-standby";
+    // the standby is another backend connection, and needs a slot of its
+    // own until the primary's is handed back
+    Admission::Ticket::ptr ticket;
+    try {
+        ticket = m_postguard.admission().acquire(m_target, m_user, m_pool);
+    } catch (AdmissionRejectedError &e) {
+        MORDOR_LOG_WARNING(g_log) << this << " no backend slot for a standby for "
+            << m_user << ": " << e.what() << "; staying on the primary";
+        return;
+    }
+    Server::ptr standby;
+    try {
+        standby = Server::connect(m_ioManager, parameters,
+            &m_postguard.pgPassFile(), &m_postguard.resolver(),
+            &m_postguard.handshakeScheduler(), &m_postguard.health());
+    } catch (...) {
+        MORDOR_LOG_WARNING(g_log) << this << " Unable to connect to a standby: " <<
+            boost::current_exception_diagnostic_information();
+        return;
+    }
+    if (!standby->standby()) {
+        MORDOR_LOG_INFO(g_log) << this << " no standby available for "
+            << m_user << "; staying on the primary";
+        standby->terminate();
+        return;
+    }
+
+    std::map<std::string, std::string> before = m_server->parameters();
+    MORDOR_LOG_INFO(g_log) << this << " " << m_user << " routed to standby " << standby;
+    m_postguard.cancelKeys().replace(m_cancelKey, standby);
+    m_admission = ticket;
+    Server::ptr primary;
+    {
+        boost::mutex::scoped_lock lock(m_timeoutMutex);
+        primary = m_server;
+        m_server = standby;
+    }
+    reportParameters(before);
+    try {
+        primary->terminate();
+    } catch (...) {
+    }
+}
+
+void
+Client::applyIssueSettings()
+{
+    std::map<std::string, std::string> before = m_server->parameters();
+    for (PolicyTable::Settings::const_iterator it(m_policy.begin());
+        it != m_policy.end();
+        ++it) {
+        if (!Policy::needsIssue(it->second))
+            continue;
+        std::string value = Policy::expand(it->second, m_user, m_issue);
+        std::string quoted;
+        for (std::string::const_iterator c(value.begin()); c != value.end(); ++c) {
+            if (*c == '\'')
+                quoted += '\'';
+            quoted += *c;
+        }
+        try {
+            m_server->execute("SET " + it->first + " = '" + quoted + "'");
+        } catch (std::runtime_error &e) {
+            MORDOR_LOG_ERROR(g_log) << this << " Unable to apply policy setting "
+                << it->first << "=" << value << ": " << e.what();
+        }
+    }
+    reportParameters(before);
+}
+
+void
+Client::reportParameters(const std::map<std::string, std::string> &before)
+{
+    Buffer message;
+    for (std::map<std::string, std::string>::const_iterator it(m_server->parameters().begin());
+        it != m_server->parameters().end();
+        ++it) {
+        std::map<std::string, std::string>::const_iterator previous =
+            before.find(it->first);
+        if (previous != before.end() && previous->second == it->second)
+            continue;
+        message.clear();
+        message.copyIn(it->first);
+        message.copyIn("\0", 1u);
+        message.copyIn(it->second);
+        message.copyIn("\0", 1u);
+        writeV3Message(PARAMETER_STATUS, message);
+    }
+}
+
+std::string
+Client::policyViolation(const std::string &sql) const
+{
+    // the name has to be followed by something that ends it, so anything
+    // odd (U&"...", "a""b", ...) fails to parse rather than parsing as
+    // some other setting
+    static const std::regex set_query(
+        "^SET\\s+(?:(?:SESSION|LOCAL)\\s+)?(?:\"([^\"]+)\"|([A-Za-z0-9_.]+))(?=\\s|=|$)(\\s+ZONE\\b)?",
+        std::regex::icase);
+    static const std::regex set_keyword("^SET", std::regex::icase);
+    // SET TRANSACTION only lasts the transaction, but still overrides the
+    // enforced defaults for it
+    static const std::regex transaction_query(
+        "^SET\\s+(?:SESSION\\s+CHARACTERISTICS\\s+AS\\s+)?TRANSACTION\\s+([\\s\\S]*)$",
+        std::regex::icase);
+    static const std::regex isolation_mode("\\bISOLATION\\b", std::regex::icase);
+    static const std::regex read_mode("\\bREAD\\s+(?:ONLY|WRITE)\\b", std::regex::icase);
+    static const std::regex deferrable_mode("\\bDEFERRABLE\\b", std::regex::icase);
+    if (m_policy.empty())
+        return std::string();
+    const std::string query = stripComments(sql);
+    std::smatch what;
+    if (std::regex_search(query, what, transaction_query)) {
+        const std::string modes = what[1].str();
+        std::string name;
+        if (std::regex_search(modes, isolation_mode) &&
+            m_policy.find("default_transaction_isolation") != m_policy.end())
+            name = "default_transaction_isolation";
+        else if (std::regex_search(modes, read_mode) &&
+            m_policy.find("default_transaction_read_only") != m_policy.end())
+            name = "default_transaction_read_only";
+        else if (std::regex_search(modes, deferrable_mode) &&
+            m_policy.find("default_transaction_deferrable") != m_policy.end())
+            name = "default_transaction_deferrable";
+        return name.empty() ? name : "Postguard policy doesn't allow changing " + name;
+    }
+    if (!std::regex_search(query, what, set_query)) {
+        // can't tell what it changes, so it might be an enforced setting
+        if (std::regex_search(query, set_keyword))
+            return "Postguard policy doesn't allow a SET it can't parse";
+        return std::string();
+    }
+    std::string name = what[1].matched ? what[1].str() : what[2].str();
+    std::transform(name.begin(), name.end(), name.begin(), &tolower);
+    // the SQL spellings of a few settings
+    if (name == "time" && what[3].matched)
+        name = "timezone";
+    else if (name == "names")
+        name = "client_encoding";
+    else if (name == "schema")
+        name = "search_path";
+    else if (name == "transaction_isolation" ||
+        name == "transaction_read_only" || name == "transaction_deferrable")
+        name = "default_" + name;
+    if (m_policy.find(name) == m_policy.end())
+        return std::string();
+    return "Postguard policy doesn't allow changing " + name;
+}
+
 bool
-Client::go(const std::string &key)
+Client::go(const std::string &key, bool readOnly)
 {
     Buffer message;
     bool issueExists;
@@ -252,34 +848,28 @@ Client::go(const std::string &key)
     } catch(...) {
         MORDOR_LOG_ERROR(g_log) << this << " Could not determine if " << key << " exists: " <<
             boost::current_exception_diagnostic_information();
+        audit(AuditRecord::GO_DENIED, key);
         writeError("ERROR", "58030", "Unable to contact JIRA");
         return true;
     }
 
     if (issueExists) {
         MORDOR_LOG_INFO(g_log) << this << " " << m_user << " referenced issue " << key;
+        m_issue = key;
+        audit(AuditRecord::GO_ACCEPTED, key);
+        if (readOnly)
+            routeToStandby();
+        applyIssueSettings();
         put(message, "GO");
         writeV3Message(COMMAND_COMPLETE, message);
         message.clear();
         put(message, (char)IDLE);
         writeV3Message(READY_FOR_QUERY, message);
-        m_stream->flush();
-        m_server->stream()->flush();
-        FilterStream::ptr clientBuffered = std::static_pointer_cast<FilterStream>(m_stream);
-        FilterStream::ptr serverBuffered = std::static_pointer_cast<FilterStream>(m_server->stream());
-        Stream::ptr client = clientBuffered->parent();
-        Stream::ptr server = serverBuffered->parent();
-        clientBuffered->parent(NullStream::get_ptr());
-        serverBuffered->parent(NullStream::get_ptr());
-        transferStream(clientBuffered, server);
-        transferStream(serverBuffered, client);
-        std::vector<std::function<void ()> > dgs;
-        dgs.push_back(boost::bind(&transfer, server, client));
-        dgs.push_back(boost::bind(&transfer, client, server));
-        parallel_do(dgs);
+        relaySession();
         return false;
     } else {
         MORDOR_LOG_WARNING(g_log) << this << " " << m_user << " referenced non-existent issue " << key;
+        audit(AuditRecord::GO_DENIED, key);
         std::ostringstream os;
         os << "Issue " << key << " does not exist";
         writeError("ERROR", "42704", os.str());
@@ -287,4 +877,258 @@ Client::go(const std::string &key)
     }
 }
 
+void
+Client::relaySession()
+{
+    m_stream->flush();
+    m_server->stream()->flush();
+    FilterStream::ptr clientBuffered = std::static_pointer_cast<FilterStream>(m_stream);
+    FilterStream::ptr serverBuffered = std::static_pointer_cast<FilterStream>(m_server->stream());
+    Stream::ptr client = clientBuffered->parent();
+    Stream::ptr server = serverBuffered->parent();
+    clientBuffered->parent(NullStream::get_ptr());
+    serverBuffered->parent(NullStream::get_ptr());
+    transferStream(clientBuffered, server);
+    transferStream(serverBuffered, client);
+    m_lastActivity = TimerManager::now();
+    if (g_telemetry->val())
+        m_tracker.reset(new StatementTracker(m_user, m_issue));
+    if (!g_captureDir->val().empty())
+        capture(m_issue);
+    m_statements = StatementRing::create(m_session, m_user, m_issue);
+    m_throttle = Throttle::create(m_user);
+    m_sampled = m_postguard.socketSampler().watch(m_session, m_user, m_issue,
+        m_socket, m_server->socket());
+    if (!m_ssl && !m_server->ssl() && g_eventRelay->val()) {
+        // Nothing is left in the BufferedStreams, so the sockets can be
+        // handed over wholesale, and this fiber (and its stack) released
+        EventRelay::ptr relay;
+        {
+            Allocations::Scope scope(Allocations::CLIENT);
+            relay.reset(new EventRelay(m_ioManager, m_socket,
+                m_server->socket(), m_lastActivity,
+                std::bind(&Client::abandoned, shared_from_this()),
+                std::bind(&Client::finished, shared_from_this())));
+        }
+        // always tapped; abandoned() needs to know if a request is running
+        relay->tap(std::bind(&Client::observe, this,
+            std::placeholders::_1, std::placeholders::_2,
+            std::placeholders::_3));
+        if (m_throttle)
+            relay->throttle(m_throttle);
+        {
+            boost::mutex::scoped_lock lock(m_timeoutMutex);
+            m_eventRelay = relay;
+        }
+        m_detached = true;
+        phase(RELAY, g_idleTimeout->val());
+        relay->start();
+        return;
+    }
+    // The pumps only notice the client is gone when they next touch it;
+    // watch for the hangup directly so an orphaned query gets cancelled
+    boost::signals2::scoped_connection hangup = m_socket->onRemoteClose(
+        std::bind(&Client::hangup, shared_from_this(), client, server));
+    phase(RELAY, g_idleTimeout->val());
+    std::vector<std::function<void ()> > dgs;
+    dgs.push_back(std::bind(&Client::relay, this, server, client,
+        StatementTracker::FROM_SERVER));
+    dgs.push_back(std::bind(&Client::relay, this, client, server,
+        StatementTracker::FROM_CLIENT));
+    try {
+        parallel_do(dgs);
+    } catch (OperationAbortedException &) {
+        // give the ErrorResponse for a timeout somewhere to go
+        clientBuffered->parent(client);
+        throw;
+    }
+}
+
+void
+Client::observe(StatementTracker::Direction direction, const char *data,
+    size_t length)
+{
+    m_requests.observe(direction, data, length);
+    if (m_tracker)
+        m_tracker->observe(direction, data, length);
+    if (m_capture)
+        m_capture->write(direction == StatementTracker::FROM_CLIENT,
+            TimerManager::now(), data, length);
+    if (m_statements && direction == StatementTracker::FROM_CLIENT)
+        m_statements->observe(data, length);
+}
+
+void
+Client::capture(const std::string &issue)
+{
+    CaptureHeader header;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    header.start = now.tv_sec * 1000000ull + now.tv_usec;
+    header.user = m_user;
+    header.database = m_database;
+    header.issue = issue;
+    std::ostringstream os;
+    os << g_captureDir->val() << "/" << m_session << ".pgcap.gz";
+    try {
+        m_capture.reset(new CaptureWriter(os.str(), header, TimerManager::now()));
+        MORDOR_LOG_INFO(g_log) << this << " capturing session to " << os.str();
+    } catch (...) {
+        MORDOR_LOG_ERROR(g_log) << this << " Unable to capture session: " <<
+            boost::current_exception_diagnostic_information();
+    }
+}
+
+void
+Client::audit(AuditRecord::Type type, const std::string &issue)
+{
+    AuditRecord record(type);
+    record.session = m_session;
+    record.user = m_user;
+    record.database = m_database;
+    record.issue = issue.empty() ? m_issue : issue;
+    if (type == AuditRecord::SESSION_END) {
+        record.bytesFromClient = m_bytesFromClient;
+        record.bytesFromServer = m_bytesFromServer;
+        record.duration = TimerManager::now() - m_start;
+    }
+    m_postguard.audit().log(record);
+}
+
+void
+Client::cancelQuery()
+{
+    MORDOR_LOG_INFO(g_log) << this << " " << m_user << " hung up; cancelling backend query";
+    Server::ptr server;
+    {
+        boost::mutex::scoped_lock lock(m_timeoutMutex);
+        server = m_server;
+    }
+    if (!server)
+        return;
+    try {
+        server->cancel(m_ioManager);
+    } catch (...) {
+        MORDOR_LOG_ERROR(g_log) << this << " Unable to cancel backend query: " <<
+            boost::current_exception_diagnostic_information();
+    }
+}
+
+void
+Client::abandoned()
+{
+    // A Terminate, or nothing outstanding, means there's nothing to stop;
+    // cancelling anyway would cost a backend connection every session
+    if (m_requests.terminated() || !m_requests.busy())
+        return;
+    cancelQuery();
+}
+
+void
+Client::hangup(Stream::ptr client, Stream::ptr server)
+{
+    abandoned();
+    client->cancelRead();
+    client->cancelWrite();
+    server->cancelRead();
+    server->cancelWrite();
+}
+
+void
+Client::relay(Stream::ptr from, Stream::ptr to,
+    StatementTracker::Direction direction)
+{
+    // one segment for the whole session, so relaying never allocates
+    BufferPool::Segment segment;
+    while (true) {
+        size_t read = from->read(segment.data(), segment.size());
+        if (read == 0u)
+            return;
+        m_lastActivity = TimerManager::now();
+        if (direction == StatementTracker::FROM_CLIENT)
+            m_bytesFromClient += read;
+        else
+            m_bytesFromServer += read;
+        observe(direction, segment.data(), read);
+        for (size_t written = 0u; written < read;)
+            written += to->write(segment.data() + written, read - written);
+        to->flush();
+        if (m_throttle) {
+            unsigned long long delay = m_throttle->consume(direction, read);
+            if (delay != 0ull)
+                Mordor::sleep(m_ioManager, delay);
+        }
+    }
+}
+
+void
+Client::phase(Phase phase, unsigned long long timeout)
+{
+    boost::mutex::scoped_lock lock(m_timeoutMutex);
+    m_phase = phase;
+    if (m_timeout) {
+        m_timeout->cancel();
+        m_timeout.reset();
+    }
+    if (phase != NONE && timeout != 0ull)
+        m_timeout = m_postguard.timerWheel().add(timeout,
+            std::bind(&Client::timedOut, std::weak_ptr<Client>(shared_from_this()), phase));
+}
+
+void
+Client::timedOut(std::weak_ptr<Client> self, Phase phase)
+{
+    Client::ptr client = self.lock();
+    if (client)
+        client->timeout(phase);
+}
+
+void
+Client::timeout(Phase phase)
+{
+    Server::ptr server;
+    EventRelay::ptr relay;
+    {
+        boost::mutex::scoped_lock lock(m_timeoutMutex);
+        // raced with moving on to the next phase
+        if (m_phase != phase)
+            return;
+        if (phase == RELAY) {
+            // activity only updates a timestamp; check it now, and come back
+            // later if there was any
+            unsigned long long limit = g_idleTimeout->val();
+            unsigned long long idle = TimerManager::now() - m_lastActivity;
+            if (limit != 0ull && idle < limit) {
+                m_timeout = m_postguard.timerWheel().add(limit - idle,
+                    std::bind(&Client::timedOut, std::weak_ptr<Client>(shared_from_this()), phase));
+                return;
+            }
+        }
+        m_timedOut = phase;
+        m_timeout.reset();
+        // run() only lets go of the server after leaving this phase
+        server = m_server;
+        relay = m_eventRelay;
+    }
+
+    if (relay) {
+        MORDOR_LOG_INFO(g_log) << this << " " << m_user << " timed out while relaying";
+        // there's no fiber to write the ErrorResponse; the relay sends it
+        relay->cancel(errorResponse("FATAL", "57P05",
+            "terminating connection due to idle-session timeout"));
+        return;
+    }
+
+    MORDOR_LOG_INFO(g_log) << this << " " << m_user << " timed out in phase " << phase;
+    // the socket (unlike m_stream) is never replaced, so it's safe to poke
+    // from here; the client's fiber writes the ErrorResponse
+    m_socket->cancelReceive();
+    if (phase == RELAY && server) {
+        // the relay reads the backend's socket directly, so closing the
+        // Server's stream wouldn't wake it
+        server->socket()->cancelReceive();
+        server->socket()->cancelSend();
+    }
+}
+
 }
@@ -1,13 +1,29 @@
 // Copyright (c) 2013 - Cody Cutrer
 
+#include <atomic>
+#include <map>
 #include <string>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 
+#include "postguard/admission.h"
+#include "postguard/auditrecord.h"
+#include "postguard/cancelkeys.h"
+#include "postguard/capturefile.h"
 #include "postguard/connection.h"
+#include "postguard/eventrelay.h"
+#include "postguard/forensics.h"
+#include "postguard/policy.h"
+#include "postguard/requesttracker.h"
+#include "postguard/sockstats.h"
+#include "postguard/telemetry.h"
+#include "postguard/throttle.h"
+#include "postguard/timerwheel.h"
 
 namespace Mordor {
 class IOManager;
+class Socket;
 class Stream;
 }
 
@@ -28,18 +44,85 @@ public:
            const std::string &user);
 
     void run();
+    void close();
+
+private:
+    enum Phase
+    {
+        NONE,
+        STARTUP,
+        WAITING_FOR_GO,
+        RELAY
+    };
 
 private:
     bool startup();
+    void cancel(Mordor::Buffer &message);
     bool readyForQuery();
     void proxyQuery(const std::string &query);
-    bool go(const std::string &key);
+    bool go(const std::string &key, bool readOnly);
+    void routeToStandby();
+    void applyIssueSettings();
+    /// Send ParameterStatus for everything that changed on m_server
+    void reportParameters(const std::map<std::string, std::string> &before);
+    /// @return Why the policy doesn't allow the SET in query, or empty if
+    /// it does
+    std::string policyViolation(const std::string &query) const;
+    /// Hand the session over to the relay, once the client has been told
+    /// it's ready for queries
+    void relaySession();
+    void finished();
+    void audit(AuditRecord::Type type, const std::string &issue = std::string());
+    void cancelQuery();
+    /// The client went away; cancel what the backend is still running for
+    /// it, unless it said goodbye properly
+    void abandoned();
+    void hangup(std::shared_ptr<Mordor::Stream> client,
+        std::shared_ptr<Mordor::Stream> server);
+    void relay(std::shared_ptr<Mordor::Stream> from,
+        std::shared_ptr<Mordor::Stream> to,
+        StatementTracker::Direction direction);
+    void observe(StatementTracker::Direction direction, const char *data,
+        size_t length);
+    void capture(const std::string &issue);
+
+    void phase(Phase phase, unsigned long long timeout);
+    static void timedOut(std::weak_ptr<Client> self, Phase phase);
+    void timeout(Phase phase);
 
 private:
     Postguard &m_postguard;
     Mordor::IOManager &m_ioManager;
+    std::shared_ptr<Mordor::Socket> m_socket;
     std::string m_user;
+    const unsigned long long m_session, m_start;
+    std::string m_database, m_issue;
+    bool m_ssl, m_connected;
+    unsigned long long m_bytesFromClient, m_bytesFromServer;
+    std::map<std::string, std::string> m_serverParameters;
+    PolicyTable::Settings m_policy;
     std::shared_ptr<Server> m_server;
+    Admission::Ticket::ptr m_admission;
+    /// What m_admission was acquired for, so a move to a standby can get
+    /// a ticket of its own
+    std::string m_target;
+    size_t m_pool;
+    CancelKeyMap::Key m_cancelKey;
+
+    boost::mutex m_timeoutMutex;
+    Phase m_phase, m_timedOut;
+    TimerWheel::Timeout::ptr m_timeout;
+    std::atomic<unsigned long long> m_lastActivity;
+    /// Set once the session has been handed off to an EventRelay, and
+    /// run() must leave the cleanup to finished()
+    bool m_detached;
+    EventRelay::ptr m_eventRelay;
+    RequestTracker m_requests;
+    StatementTracker::ptr m_tracker;
+    CaptureWriter::ptr m_capture;
+    Throttle::ptr m_throttle;
+    std::shared_ptr<SocketSampler::Session> m_sampled;
+    StatementRing::ptr m_statements;
 };
 
 }
@@ -83,6 +83,28 @@ Connection::writeError(const std::string &severity, const std::string &code,
     const std::string &message)
 {
     Buffer buffer;
+    errorFields(buffer, severity, code, message);
+    writeV3Message(ERROR_RESPONSE, buffer);
+    m_stream->flush();
+}
+
+std::string
+Connection::errorResponse(const std::string &severity, const std::string &code,
+    const std::string &message)
+{
+    Buffer buffer;
+    errorFields(buffer, severity, code, message);
+    unsigned int length = byteswap((unsigned int)buffer.readAvailable() + 4);
+    std::string result(1u, (char)ERROR_RESPONSE);
+    result.append((const char *)&length, 4u);
+    result.append(buffer.toString());
+    return result;
+}
+
+void
+Connection::errorFields(Buffer &buffer, const std::string &severity,
+    const std::string &code, const std::string &message)
+{
     put(buffer, (char)SEVERITY);
     put(buffer, severity);
     put(buffer, (char)CODE);
@@ -90,8 +112,6 @@ Connection::writeError(const std::string &severity, const std::string &code,
     put(buffer, (char)MESSAGE);
     put(buffer, message);
     put(buffer, (char)0);
-    writeV3Message(ERROR_RESPONSE, buffer);
-    m_stream->flush();
 }
 
 template <>
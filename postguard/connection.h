@@ -22,6 +22,7 @@ public:
 // internal:
     enum V2MessageType
     {
+        CANCEL_REQUEST      = 80877102,
         SSL_REQUEST         = 80877103,
         STARTUP_REQUEST_V2  = 0x00020000,
         STARTUP_REQUEST_V3  = 0x00030000
@@ -32,12 +33,14 @@ public:
         AUTHENTICATION   = 'R',
         BACKEND_KEY_DATA = 'K',
         COMMAND_COMPLETE = 'C',
+        DATA_ROW         = 'D',
         ERROR_RESPONSE   = 'E',
         NOTICE_RESPONSE  = 'N',
         PARAMETER_STATUS = 'S',
         PASSWORD_MESSAGE = 'p',
         QUERY            = 'Q',
         READY_FOR_QUERY  = 'Z',
+        ROW_DESCRIPTION  = 'T',
         TERMINATE        = 'X'
     };
 
@@ -50,8 +53,11 @@ public:
 
     enum AuthenticationType
     {
-        AUTHENTICATION_OK           = 0,
-        AUTHENTICATION_MD5_PASSWORD = 5
+        AUTHENTICATION_OK            = 0,
+        AUTHENTICATION_MD5_PASSWORD  = 5,
+        AUTHENTICATION_SASL          = 10,
+        AUTHENTICATION_SASL_CONTINUE = 11,
+        AUTHENTICATION_SASL_FINAL    = 12
     };
 
     enum Status
@@ -71,6 +77,9 @@ public:
 // internal:
     void readV3Message(V3MessageType &type, Mordor::Buffer &message);
     void writeV3Message(V3MessageType type, const Mordor::Buffer &message);
+    /// A complete ErrorResponse message, for writing straight to a socket
+    static std::string errorResponse(const std::string &severity,
+        const std::string &code, const std::string &message);
 
 protected:
     Connection(std::shared_ptr<Mordor::Stream> stream);
@@ -78,6 +87,8 @@ protected:
     void readV2Message(V2MessageType &type, Mordor::Buffer &message);
 
     void writeError(const std::string &severity, const std::string &code, const std::string &message);
+    static void errorFields(Mordor::Buffer &buffer, const std::string &severity,
+        const std::string &code, const std::string &message);
 
     template <class T> static void put(Mordor::Buffer &buffer, const T &value) {
         buffer.copyIn(&value, sizeof(value));
@@ -0,0 +1,283 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/eventrelay.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+
+#include <mordor/log.h>
+#include <mordor/socket.h>
+#include <mordor/statistics.h>
+#include <mordor/timer.h>
+
+#include "postguard/bufferpool.h"
+#include "postguard/sockopts.h"
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:eventrelay");
+
+static CountStatistic<unsigned long long> &g_sessions =
+    Statistics::registerStatistic("postguard.relay.evented",
+        CountStatistic<unsigned long long>("sessions"));
+
+namespace Postguard {
+
+// How many reads a direction gets before yielding to other sessions
+static const size_t ROUNDS = 16u;
+
+EventRelay::EventRelay(IOManager &ioManager, std::shared_ptr<Socket> client,
+    std::shared_ptr<Socket> server,
+    std::atomic<unsigned long long> &lastActivity,
+    const std::function<void ()> &hangup,
+    const std::function<void ()> &closed)
+    : m_ioManager(ioManager),
+      m_client(client),
+      m_server(server),
+      m_lastActivity(lastActivity),
+      m_hangup(hangup),
+      m_closed(closed),
+      m_cancelled(false),
+      m_hangupPending(false)
+{
+    m_directions[CLIENT_TO_SERVER].from = client->socket();
+    m_directions[CLIENT_TO_SERVER].to = server->socket();
+    m_directions[SERVER_TO_CLIENT].from = server->socket();
+    m_directions[SERVER_TO_CLIENT].to = client->socket();
+    m_directions[CLIENT_TO_SERVER].cork = server->family() != AF_UNIX &&
+        corkBackendWrites();
+    g_sessions.increment();
+}
+
+EventRelay::~EventRelay()
+{
+    for (size_t i = 0; i < 2u; ++i) {
+        if (m_directions[i].segment)
+            BufferPool::release(m_directions[i].segment);
+    }
+    g_sessions.decrement();
+}
+
+void
+EventRelay::start()
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    pump(CLIENT_TO_SERVER);
+    pump(SERVER_TO_CLIENT);
+    notify();
+}
+
+void
+EventRelay::cancel(const std::string &farewell)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_cancelled)
+        return;
+    if (!farewell.empty()) {
+        // best effort; if it doesn't fit in the socket buffer, the client
+        // just sees the connection close
+        ::send(m_client->socket(), farewell.c_str(), farewell.length(),
+            MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    teardown();
+    notify();
+}
+
+void
+EventRelay::pump(size_t direction)
+{
+    Direction &d = m_directions[direction];
+    for (size_t rounds = 0; rounds < ROUNDS;) {
+        if (m_cancelled || d.done)
+            return;
+        if (d.begin < d.end) {
+            ssize_t sent = ::send(d.to, d.segment + d.begin, d.end - d.begin,
+                MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (sent < 0) {
+                int error = errno;
+                if (error == EINTR)
+                    continue;
+                if (error == EAGAIN || error == EWOULDBLOCK)
+                    wait(direction, d.to, IOManager::WRITE);
+                else
+                    fail(d.to, error);
+                return;
+            }
+            d.begin += sent;
+            if (d.begin == d.end) {
+                BufferPool::release(d.segment);
+                d.segment = NULL;
+                d.begin = d.end = 0u;
+            }
+            continue;
+        }
+
+        if (d.resume != 0ull) {
+            unsigned long long now = TimerManager::now();
+            if (d.resume > now) {
+                pause(direction, d.resume - now);
+                return;
+            }
+            d.resume = 0ull;
+        }
+
+        if (!d.segment)
+            d.segment = BufferPool::acquire();
+        ssize_t received = ::recv(d.from, d.segment, BufferPool::segmentSize(),
+            MSG_DONTWAIT);
+        int error = errno;
+        if (received <= 0) {
+            // idle sessions don't hold on to a segment
+            BufferPool::release(d.segment);
+            d.segment = NULL;
+        }
+        if (received < 0) {
+            if (error == EINTR)
+                continue;
+            if (error == EAGAIN || error == EWOULDBLOCK) {
+                // caught up; don't sit on a corked tail
+                cork(direction, false);
+                wait(direction, d.from, IOManager::READ);
+            } else {
+                fail(d.from, error);
+            }
+            return;
+        }
+        if (received == 0) {
+            MORDOR_LOG_DEBUG(g_log) << this << " EOF from "
+                << (direction == CLIENT_TO_SERVER ? "client" : "server");
+            d.done = true;
+            // pass the EOF along, so each side sees the other close
+            ::shutdown(d.to, SHUT_WR);
+            if (direction == CLIENT_TO_SERVER &&
+                !m_directions[SERVER_TO_CLIENT].done)
+                m_hangupPending = true;
+            return;
+        }
+        // a full segment means the sender is streaming, so hold back
+        // partial frames until it stops
+        cork(direction, (size_t)received == BufferPool::segmentSize());
+        d.begin = 0u;
+        d.end = (size_t)received;
+        d.bytes += d.end;
+        m_lastActivity = TimerManager::now();
+        if (m_tap)
+            m_tap(direction == CLIENT_TO_SERVER ?
+                StatementTracker::FROM_CLIENT : StatementTracker::FROM_SERVER,
+                d.segment, d.end);
+        if (m_throttle) {
+            // still send what was read; it's the next read that waits
+            unsigned long long delay = m_throttle->consume(
+                direction == CLIENT_TO_SERVER ? StatementTracker::FROM_CLIENT :
+                StatementTracker::FROM_SERVER, d.end);
+            if (delay != 0ull)
+                d.resume = TimerManager::now() + delay;
+        }
+        ++rounds;
+    }
+    // Give other sessions a turn
+    d.outstanding = true;
+    m_ioManager.schedule(std::bind(&EventRelay::ready, shared_from_this(),
+        direction));
+}
+
+void
+EventRelay::ready(size_t direction)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    Direction &d = m_directions[direction];
+    d.outstanding = false;
+    d.waiting = IOManager::NONE;
+    d.waitFd = -1;
+    d.timer.reset();
+    pump(direction);
+    notify();
+}
+
+void
+EventRelay::wait(size_t direction, int fd, IOManager::Event event)
+{
+    Direction &d = m_directions[direction];
+    d.waitFd = fd;
+    d.waiting = event;
+    d.outstanding = true;
+    m_ioManager.registerEvent(fd, event,
+        std::bind(&EventRelay::ready, shared_from_this(), direction));
+}
+
+void
+EventRelay::pause(size_t direction, unsigned long long us)
+{
+    // Not reading lets the socket buffers fill up, and TCP push back on
+    // the sender; nothing piles up here
+    Direction &d = m_directions[direction];
+    cork(direction, false);
+    d.outstanding = true;
+    d.timer = m_ioManager.registerTimer(us,
+        std::bind(&EventRelay::ready, shared_from_this(), direction));
+}
+
+void
+EventRelay::cork(size_t direction, bool cork)
+{
+    Direction &d = m_directions[direction];
+    if (!d.cork || d.corked == cork)
+        return;
+    // uncorking pushes out whatever was held back
+    corkSocket(*m_server, cork);
+    d.corked = cork;
+}
+
+void
+EventRelay::fail(int fd, int error)
+{
+    MORDOR_LOG_DEBUG(g_log) << this << " error on "
+        << (fd == m_client->socket() ? "client" : "server") << ": " << error;
+    if (fd == m_client->socket() && !m_directions[SERVER_TO_CLIENT].done)
+        m_hangupPending = true;
+    teardown();
+}
+
+void
+EventRelay::teardown()
+{
+    m_cancelled = true;
+    for (size_t i = 0; i < 2u; ++i) {
+        // the callback still runs (and clears outstanding) if the event was
+        // registered; otherwise it's already on its way
+        if (m_directions[i].waiting != IOManager::NONE)
+            m_ioManager.cancelEvent(m_directions[i].waitFd,
+                m_directions[i].waiting);
+        // a cancelled timer never calls back, unlike an event
+        if (m_directions[i].timer && m_directions[i].timer->cancel()) {
+            m_directions[i].timer.reset();
+            m_directions[i].outstanding = false;
+        }
+    }
+    ::shutdown(m_client->socket(), SHUT_RDWR);
+    ::shutdown(m_server->socket(), SHUT_RDWR);
+}
+
+void
+EventRelay::notify()
+{
+    if (m_hangupPending && m_hangup) {
+        m_ioManager.schedule(m_hangup);
+        m_hangup = NULL;
+    }
+    m_hangupPending = false;
+    if (!m_closed)
+        return;
+    for (size_t i = 0; i < 2u; ++i) {
+        if (m_directions[i].outstanding)
+            return;
+        if (!m_cancelled && !m_directions[i].done)
+            return;
+    }
+    m_ioManager.schedule(m_closed);
+    m_closed = NULL;
+}
+
+}
@@ -0,0 +1,126 @@
+#ifndef __POSTGUARD_EVENTRELAY_H__
+#define __POSTGUARD_EVENTRELAY_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <mordor/iomanager.h>
+
+#include "postguard/telemetry.h"
+#include "postguard/throttle.h"
+
+namespace Mordor {
+class Socket;
+class Timer;
+}
+
+namespace Postguard {
+
+/// Relays between two plaintext sockets directly from IOManager event
+/// callbacks
+///
+/// Unlike a pair of pumping fibers, an idle session costs nothing but this
+/// object: no fiber stacks, and no buffer (segments are only borrowed from
+/// the BufferPool while data is in flight).  The sockets must already be
+/// non-blocking (as all Mordor sockets on an IOManager are), and nothing
+/// else may read or write them once the relay has started.
+class EventRelay : public std::enable_shared_from_this<EventRelay>,
+    boost::noncopyable
+{
+public:
+    typedef std::shared_ptr<EventRelay> ptr;
+    /// Sees every chunk as it is relayed
+    typedef std::function<void (StatementTracker::Direction, const char *,
+        size_t)> Tap;
+
+public:
+    /// @param lastActivity Updated whenever data is relayed
+    /// @param hangup Called if the client closes its side first; it's up
+    ///        to the callback to decide if there's anything to cancel
+    /// @param closed Called once both directions are done, or the relay
+    ///        was cancelled
+    EventRelay(Mordor::IOManager &ioManager,
+        std::shared_ptr<Mordor::Socket> client,
+        std::shared_ptr<Mordor::Socket> server,
+        std::atomic<unsigned long long> &lastActivity,
+        const std::function<void ()> &hangup,
+        const std::function<void ()> &closed);
+    ~EventRelay();
+
+    /// Call before start()
+    void tap(const Tap &tap) { m_tap = tap; }
+    /// Call before start()
+    void throttle(Throttle::ptr throttle) { m_throttle = throttle; }
+
+    void start();
+    /// Tear the session down from elsewhere, optionally sending a final
+    /// message (i.e. an ErrorResponse) to the client first
+    void cancel(const std::string &farewell = std::string());
+
+    /// Only meaningful once the relay has closed
+    unsigned long long bytesFromClient() const
+    { return m_directions[CLIENT_TO_SERVER].bytes; }
+    unsigned long long bytesFromServer() const
+    { return m_directions[SERVER_TO_CLIENT].bytes; }
+
+private:
+    enum {
+        CLIENT_TO_SERVER,
+        SERVER_TO_CLIENT
+    };
+
+    struct Direction
+    {
+        Direction() : from(-1), to(-1), segment(NULL), begin(0u), end(0u),
+            waitFd(-1), waiting(Mordor::IOManager::NONE), outstanding(false),
+            done(false), bytes(0ull), resume(0ull), cork(false),
+            corked(false) {}
+
+        int from, to;
+        char *segment;
+        size_t begin, end;
+        /// The event registered for this direction, if any
+        int waitFd;
+        Mordor::IOManager::Event waiting;
+        /// An event or continuation will call ready()
+        bool outstanding;
+        bool done;
+        unsigned long long bytes;
+        /// Throttled; don't read again until then
+        unsigned long long resume;
+        std::shared_ptr<Mordor::Timer> timer;
+        /// Coalesce writes with TCP_CORK while reads keep filling segments
+        bool cork, corked;
+    };
+
+    void pump(size_t direction);
+    void ready(size_t direction);
+    void wait(size_t direction, int fd, Mordor::IOManager::Event event);
+    void pause(size_t direction, unsigned long long us);
+    void cork(size_t direction, bool cork);
+    void fail(int fd, int error);
+    void teardown();
+    /// Schedule the hangup and closed callbacks, if it's time
+    void notify();
+
+private:
+    Mordor::IOManager &m_ioManager;
+    std::shared_ptr<Mordor::Socket> m_client, m_server;
+    std::atomic<unsigned long long> &m_lastActivity;
+    std::function<void ()> m_hangup, m_closed;
+    Tap m_tap;
+    Throttle::ptr m_throttle;
+    boost::mutex m_mutex;
+    Direction m_directions[2];
+    bool m_cancelled, m_hangupPending;
+};
+
+}
+
+#endif
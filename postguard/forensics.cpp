@@ -0,0 +1,231 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/forensics.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <algorithm>
+#include <functional>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+#include <mordor/config.h>
+#include <mordor/log.h>
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:forensics");
+
+static ConfigVar<size_t>::ptr g_statements =
+    Config::lookup("postguard.forensics.statements", (size_t)0u,
+        "Number of recent statements to keep for each relayed session (0 to disable)");
+static ConfigVar<size_t>::ptr g_length =
+    Config::lookup("postguard.forensics.length", (size_t)256u,
+        "Bytes of each statement's text to keep");
+static ConfigVar<std::string>::ptr g_users =
+    Config::lookup("postguard.forensics.users", std::string(),
+        "Comma separated Unix users (or * for everyone) whose recent statements are logged when their sessions end");
+
+namespace Postguard {
+
+static boost::mutex g_ringsMutex;
+static std::vector<std::weak_ptr<StatementRing> > g_rings;
+
+static bool flagged(const std::string &user)
+{
+    std::istringstream is(g_users->val());
+    std::string flagged;
+    while (std::getline(is, flagged, ',')) {
+        if (flagged == "*" || flagged == user)
+            return true;
+    }
+    return false;
+}
+
+StatementRing::StatementRing(unsigned long long session,
+    const std::string &user, const std::string &issue, size_t slots,
+    size_t length)
+    : m_session(session),
+      m_user(user),
+      m_issue(issue),
+      m_flagged(Postguard::flagged(user)),
+      m_slotCount(slots),
+      m_length(length),
+      m_slots(new Slot[slots]),
+      m_text(new char[slots * length]),
+      m_next(0ull),
+      m_type(0),
+      m_field(SKIP),
+      m_pending(new char[length]),
+      m_pendingLength(0u),
+      m_textLength(0ull),
+      m_lost(false)
+{}
+
+StatementRing::ptr
+StatementRing::create(unsigned long long session, const std::string &user,
+    const std::string &issue)
+{
+    size_t slots = g_statements->val();
+    if (slots == 0u)
+        return ptr();
+    ptr ring(new StatementRing(session, user, issue, slots,
+        std::max(g_length->val(), (size_t)1u)));
+    boost::mutex::scoped_lock lock(g_ringsMutex);
+    g_rings.erase(std::remove_if(g_rings.begin(), g_rings.end(),
+        std::bind(&std::weak_ptr<StatementRing>::expired, std::placeholders::_1)),
+        g_rings.end());
+    g_rings.push_back(ring);
+    return ring;
+}
+
+void
+StatementRing::observe(const char *data, size_t length)
+{
+    if (m_lost)
+        return;
+    while (true) {
+        switch (m_framing.next(data, length)) {
+            case V3Framing::DONE:
+                return;
+            case V3Framing::LOST:
+                MORDOR_LOG_WARNING(g_log) << "session " << m_session
+                    << " lost protocol framing; no more statements will be kept";
+                m_lost = true;
+                return;
+            case V3Framing::MESSAGE:
+                m_type = m_framing.type();
+                m_pendingLength = 0u;
+                m_textLength = 0ull;
+                // Parse starts with the (possibly empty) statement name
+                m_field = m_type == 'Q' ? TEXT : m_type == 'P' ? NAME : SKIP;
+                if (m_framing.remaining() == 0ull)
+                    finish();
+                break;
+            case V3Framing::PAYLOAD:
+                payload(m_framing.payload(), m_framing.payloadLength());
+                if (m_framing.remaining() == 0ull && m_field == TEXT)
+                    finish();
+                break;
+        }
+    }
+}
+
+void
+StatementRing::payload(const char *data, size_t length)
+{
+    if (m_field == NAME) {
+        const char *end = (const char *)memchr(data, '\0', length);
+        if (!end)
+            return;
+        length -= end - data + 1u;
+        data = end + 1;
+        m_field = TEXT;
+    }
+    if (m_field != TEXT)
+        return;
+    const char *end = (const char *)memchr(data, '\0', length);
+    size_t text = end ? end - data : length;
+    size_t copied = std::min(text, m_length - m_pendingLength);
+    memcpy(m_pending.get() + m_pendingLength, data, copied);
+    m_pendingLength += copied;
+    m_textLength += text;
+    // the rest (Parse's parameter types) isn't interesting
+    if (end)
+        finish();
+}
+
+void
+StatementRing::finish()
+{
+    char type = m_type;
+    if (type != 'Q' && type != 'P')
+        return;
+    // so a NUL terminator and the end of the message don't record it twice
+    m_type = 0;
+    m_field = SKIP;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    unsigned long long index = m_next.load(std::memory_order_relaxed);
+    Slot &slot = m_slots[index % m_slotCount];
+    unsigned int sequence = slot.sequence.load(std::memory_order_relaxed);
+    slot.sequence.store(sequence + 1u, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.index.store(index, std::memory_order_relaxed);
+    slot.time.store(now.tv_sec * 1000000ull + now.tv_usec, std::memory_order_relaxed);
+    slot.length.store(m_textLength, std::memory_order_relaxed);
+    slot.type.store(type, std::memory_order_relaxed);
+    memcpy(m_text.get() + (index % m_slotCount) * m_length, m_pending.get(),
+        m_pendingLength);
+    slot.sequence.store(sequence + 2u, std::memory_order_release);
+    m_next.store(index + 1u, std::memory_order_release);
+}
+
+void
+StatementRing::dump() const
+{
+    unsigned long long next = m_next.load(std::memory_order_acquire);
+    unsigned long long first = next > m_slotCount ? next - m_slotCount : 0ull;
+    std::ostringstream os;
+    os << "session " << m_session << " (" << m_user << " " << m_issue
+        << "), last " << next - first << " of " << next << " statements:";
+    std::vector<char> text(m_length);
+    for (unsigned long long index = first; index < next; ++index) {
+        const Slot &slot = m_slots[index % m_slotCount];
+        unsigned int sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence & 1u)
+            continue;
+        unsigned long long time = slot.time.load(std::memory_order_relaxed);
+        unsigned long long length = slot.length.load(std::memory_order_relaxed);
+        char type = slot.type.load(std::memory_order_relaxed);
+        bool current = slot.index.load(std::memory_order_relaxed) == index;
+        size_t copied = (size_t)std::min<unsigned long long>(length, m_length);
+        memcpy(&text[0], m_text.get() + (index % m_slotCount) * m_length, copied);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // overwritten by a newer statement while we were looking
+        if (!current || slot.sequence.load(std::memory_order_relaxed) != sequence)
+            continue;
+
+        time_t seconds = (time_t)(time / 1000000ull);
+        struct tm tm;
+        gmtime_r(&seconds, &tm);
+        char timestamp[32];
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        os << std::endl << "  " << timestamp << "." << std::setfill('0')
+            << std::setw(6) << time % 1000000ull << "Z " << type << " ";
+        for (size_t i = 0; i < copied; ++i)
+            os << (iscntrl((unsigned char)text[i]) ? ' ' : text[i]);
+        if (length > copied)
+            os << "... (" << length << " bytes)";
+    }
+    MORDOR_LOG_INFO(g_log) << os.str();
+}
+
+void
+StatementRing::dumpSessions(unsigned int session)
+{
+    std::vector<ptr> rings;
+    {
+        boost::mutex::scoped_lock lock(g_ringsMutex);
+        for (size_t i = 0; i < g_rings.size(); ++i) {
+            ptr ring = g_rings[i].lock();
+            if (ring && (session == 0u || (unsigned int)ring->m_session == session))
+                rings.push_back(ring);
+        }
+    }
+    if (rings.empty())
+        MORDOR_LOG_INFO(g_log) << "no sessions to dump statements for";
+    for (size_t i = 0; i < rings.size(); ++i)
+        rings[i]->dump();
+}
+
+}
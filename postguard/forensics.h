@@ -0,0 +1,100 @@
+#ifndef __POSTGUARD_FORENSICS_H__
+#define __POSTGUARD_FORENSICS_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+
+#include "postguard/framing.h"
+
+namespace Postguard {
+
+/// The last few statements a relayed session sent, for working out after
+/// the fact what a session did
+///
+/// The client to server pump feeds it everything it relays; Query and
+/// Parse texts are picked out of the v3 framing, truncated, and written
+/// into a fixed number of preallocated slots, so memory use doesn't grow
+/// with the session, and the pump never waits for anything.  Each slot is
+/// a seqlock: a dump running concurrently skips a slot that is being
+/// overwritten rather than blocking the pump.
+///
+/// Rings are dumped to the log for every live session (or one session) on
+/// SIGUSR2, and when sessions of the users in postguard.forensics.users
+/// end.
+class StatementRing : boost::noncopyable
+{
+public:
+    typedef std::shared_ptr<StatementRing> ptr;
+
+private:
+    StatementRing(unsigned long long session, const std::string &user,
+        const std::string &issue, size_t slots, size_t length);
+
+public:
+    /// @return NULL if postguard.forensics.statements is 0
+    static ptr create(unsigned long long session, const std::string &user,
+        const std::string &issue);
+
+    /// Bytes the client just sent; only one pump may call this at a time
+    void observe(const char *data, size_t length);
+
+    /// If the statements should be dumped when the session ends
+    bool flagged() const { return m_flagged; }
+    void dump() const;
+
+    /// Dump the rings of all live sessions
+    /// @param session If not 0, only sessions whose id has the same low 32
+    /// bits (which is all sigqueue can be relied on to carry)
+    static void dumpSessions(unsigned int session = 0u);
+
+private:
+    /// A piece of the current message's payload
+    void payload(const char *data, size_t length);
+    void finish();
+
+private:
+    struct Slot
+    {
+        Slot() : sequence(0u), index(0ull), time(0ull), length(0ull),
+            type(0) {}
+
+        /// Odd while being written
+        std::atomic<unsigned int> sequence;
+        std::atomic<unsigned long long> index, time, length;
+        std::atomic<char> type;
+    };
+
+    enum Field
+    {
+        SKIP,
+        NAME,
+        TEXT
+    };
+
+    const unsigned long long m_session;
+    const std::string m_user, m_issue;
+    const bool m_flagged;
+    const size_t m_slotCount, m_length;
+    std::unique_ptr<Slot[]> m_slots;
+    std::unique_ptr<char[]> m_text;
+    /// How many statements have been written
+    std::atomic<unsigned long long> m_next;
+
+    // Framing state; only touched by the pump
+    V3Framing m_framing;
+    /// Of the current message; cleared once its text is recorded
+    char m_type;
+    Field m_field;
+    std::unique_ptr<char[]> m_pending;
+    size_t m_pendingLength;
+    unsigned long long m_textLength;
+    bool m_lost;
+};
+
+}
+
+#endif
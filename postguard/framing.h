@@ -0,0 +1,107 @@
+#ifndef __POSTGUARD_FRAMING_H__
+#define __POSTGUARD_FRAMING_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <stddef.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace Postguard {
+
+/// Splits a v3 protocol byte stream into messages as it is relayed, without
+/// copying anything but the 5 byte headers
+///
+/// Feed whatever was just relayed to next() until it returns DONE; the
+/// stream can be split anywhere.  Only regular messages are understood, so
+/// the startup packet (which has no type byte) must not be fed.
+class V3Framing
+{
+public:
+    /// Anything claiming to be bigger than this means the framing is lost
+    static const unsigned long long MAX_MESSAGE = 0x40000000ull;
+
+    enum Event
+    {
+        /// All of the data has been consumed
+        DONE,
+        /// A header was just completed; type() and length() describe the
+        /// message, and its payload follows
+        MESSAGE,
+        /// payload() is the next piece of the current message's payload
+        PAYLOAD,
+        /// The header was implausible; nothing more can be made of the
+        /// stream
+        LOST
+    };
+
+public:
+    V3Framing()
+        : m_headerBytes(0u),
+          m_length(0ull),
+          m_remaining(0ull),
+          m_payload(NULL),
+          m_payloadLength(0u),
+          m_lost(false)
+    {}
+
+    /// Consume data up to the next event
+    Event next(const char *&data, size_t &length)
+    {
+        if (m_lost)
+            return LOST;
+        if (length == 0u)
+            return DONE;
+        if (m_remaining > 0ull) {
+            m_payload = data;
+            m_payloadLength = (size_t)std::min<unsigned long long>(m_remaining, length);
+            m_remaining -= m_payloadLength;
+            data += m_payloadLength;
+            length -= m_payloadLength;
+            return PAYLOAD;
+        }
+        size_t copied = std::min(length, sizeof(m_header) - m_headerBytes);
+        memcpy(m_header + m_headerBytes, data, copied);
+        m_headerBytes += copied;
+        data += copied;
+        length -= copied;
+        if (m_headerBytes < sizeof(m_header))
+            return DONE;
+        m_headerBytes = 0u;
+        unsigned long long messageLength =
+            ((unsigned long long)(unsigned char)m_header[1] << 24) |
+            ((unsigned long long)(unsigned char)m_header[2] << 16) |
+            ((unsigned long long)(unsigned char)m_header[3] << 8) |
+            (unsigned long long)(unsigned char)m_header[4];
+        if (messageLength < 4u || messageLength > MAX_MESSAGE) {
+            m_lost = true;
+            return LOST;
+        }
+        m_length = messageLength;
+        m_remaining = messageLength - 4u;
+        return MESSAGE;
+    }
+
+    /// The type byte of the current message
+    char type() const { return m_header[0]; }
+    /// The length of the current message, as on the wire: excluding the
+    /// type byte, including the length itself
+    unsigned long long length() const { return m_length; }
+    /// How much of the current message's payload is still to come
+    unsigned long long remaining() const { return m_remaining; }
+    const char *payload() const { return m_payload; }
+    size_t payloadLength() const { return m_payloadLength; }
+    bool lost() const { return m_lost; }
+
+private:
+    char m_header[5];
+    size_t m_headerBytes;
+    unsigned long long m_length, m_remaining;
+    const char *m_payload;
+    size_t m_payloadLength;
+    bool m_lost;
+};
+
+}
+
+#endif
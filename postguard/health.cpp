@@ -0,0 +1,357 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/health.h"
+
+#include <algorithm>
+
+#include <boost/lexical_cast.hpp>
+
+#include <mordor/config.h>
+#include <mordor/exception.h>
+#include <mordor/iomanager.h>
+#include <mordor/log.h>
+#include <mordor/statistics.h>
+#include <mordor/timer.h>
+
+#include "postguard/server.h"
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:health");
+
+static ConfigVar<unsigned long long>::ptr g_interval =
+    Config::lookup("postguard.health.interval", 10000000ull,
+        "How often to check every known backend host (us, 0 to disable)");
+static ConfigVar<int>::ptr g_timeout =
+    Config::lookup("postguard.health.timeout", 2,
+        "connect_timeout for background health checks (s)");
+static ConfigVar<std::string>::ptr g_user =
+    Config::lookup("postguard.health.user", std::string("postgres"),
+        "User background health checks connect as (a host that refuses it still counts as up)");
+static ConfigVar<std::string>::ptr g_dbname =
+    Config::lookup("postguard.health.dbname", std::string("postgres"),
+        "Database background health checks connect to");
+static ConfigVar<unsigned long long>::ptr g_expire =
+    Config::lookup("postguard.health.expire", 3600000000ull,
+        "How long to keep checking a host no session has connected to (us)");
+static ConfigVar<std::string>::ptr g_balance =
+    Config::lookup("postguard.health.balance", std::string("connections"),
+        "How to balance sessions across replicas (connections or latency)");
+
+static CountStatistic<unsigned long long> &g_failures =
+    Statistics::registerStatistic("postguard.health.failures",
+        CountStatistic<unsigned long long>("connections"));
+
+namespace Postguard {
+
+HealthChecker::SessionAttrs
+HealthChecker::parseAttrs(const std::string &value)
+{
+    if (value == "any")
+        return ANY;
+    if (value == "read-write")
+        return READ_WRITE;
+    if (value == "read-only")
+        return READ_ONLY;
+    if (value == "primary")
+        return PRIMARY;
+    if (value == "standby")
+        return STANDBY;
+    if (value == "prefer-standby")
+        return PREFER_STANDBY;
+    MORDOR_THROW_EXCEPTION(std::runtime_error(
+        "invalid target_session_attrs value: " + value));
+}
+
+bool
+HealthChecker::acceptable(SessionAttrs attrs, bool standby, bool readOnly)
+{
+    switch (attrs) {
+        case READ_WRITE:
+            return !readOnly;
+        case READ_ONLY:
+            return readOnly;
+        case PRIMARY:
+            return !standby;
+        case STANDBY:
+        case PREFER_STANDBY:
+            return standby;
+        default:
+            return true;
+    }
+}
+
+HealthChecker::HealthChecker(IOManager &ioManager, const PgPassFile *pgpass,
+    Resolver *resolver, Scheduler *handshakeScheduler)
+    : m_ioManager(ioManager),
+      m_pgpass(pgpass),
+      m_resolver(resolver),
+      m_handshakeScheduler(handshakeScheduler)
+{
+    if (g_interval->val() != 0ull)
+        m_timer = ioManager.registerTimer(g_interval->val(),
+            std::bind(&HealthChecker::checkAll, this), true);
+}
+
+HealthChecker::~HealthChecker()
+{
+    stop();
+}
+
+void
+HealthChecker::stop()
+{
+    if (m_timer)
+        m_timer->cancel();
+}
+
+namespace {
+struct Candidate
+{
+    size_t index;
+    // 0: satisfies attrs, 1: role unknown, 2: fallback or wrong role, 3: dead
+    int rank;
+    size_t connections;
+    unsigned long long latency;
+};
+
+struct CandidateOrder
+{
+    CandidateOrder(bool balance, bool byLatency)
+        : balance(balance),
+          byLatency(byLatency)
+    {}
+
+    bool operator()(const Candidate &lhs, const Candidate &rhs) const
+    {
+        if (lhs.rank != rhs.rank)
+            return lhs.rank < rhs.rank;
+        if (balance && lhs.rank == 0) {
+            if (byLatency && lhs.latency != rhs.latency)
+                return lhs.latency < rhs.latency;
+            if (lhs.connections != rhs.connections)
+                return lhs.connections < rhs.connections;
+        }
+        // otherwise keep connection string order, like libpq
+        return lhs.index < rhs.index;
+    }
+
+    bool balance, byLatency;
+};
+}
+
+std::vector<size_t>
+HealthChecker::order(const std::vector<std::string> &keys, SessionAttrs attrs)
+{
+    std::vector<Candidate> candidates;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            Candidate candidate;
+            candidate.index = i;
+            candidate.rank = 1;
+            candidate.connections = 0u;
+            candidate.latency = 0ull;
+            std::map<std::string, Host>::iterator it = m_hosts.find(keys[i]);
+            if (it != m_hosts.end()) {
+                Host &host = it->second;
+                host.lastUsed = TimerManager::now();
+                candidate.connections = host.connections;
+                candidate.latency = host.latency;
+                if (!host.alive)
+                    candidate.rank = 3;
+                else if (attrs == ANY)
+                    candidate.rank = 0;
+                else if (host.known)
+                    candidate.rank = acceptable(attrs, host.standby, host.readOnly) ? 0 : 2;
+            } else if (attrs == ANY) {
+                candidate.rank = 0;
+            }
+            candidates.push_back(candidate);
+        }
+    }
+
+    // Only spread load across hosts that are interchangeable; read-write
+    // and primary targets keep libpq's first-that-works semantics
+    bool balance = attrs == READ_ONLY || attrs == STANDBY ||
+        attrs == PREFER_STANDBY;
+    std::sort(candidates.begin(), candidates.end(),
+        CandidateOrder(balance, g_balance->val() == "latency"));
+
+    std::vector<size_t> result;
+    for (std::vector<Candidate>::const_iterator it(candidates.begin());
+        it != candidates.end();
+        ++it) {
+        // Dead hosts are only worth waiting on if there's nothing else
+        if (it->rank == 3 && !result.empty())
+            break;
+        result.push_back(it->index);
+    }
+    return result;
+}
+
+bool
+HealthChecker::standbyPossible(const std::vector<std::string> &keys)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        std::map<std::string, Host>::const_iterator it = m_hosts.find(keys[i]);
+        if (it == m_hosts.end())
+            return true;
+        if (it->second.alive && (!it->second.known || it->second.standby))
+            return true;
+    }
+    return false;
+}
+
+void
+HealthChecker::succeeded(const std::string &key,
+    const std::map<std::string, std::string> &parameters,
+    unsigned long long latency, bool known, bool standby, bool readOnly)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    Host &host = m_hosts[key];
+    if (!host.alive)
+        MORDOR_LOG_INFO(g_log) << key << " is back up";
+    host.alive = true;
+    if (known) {
+        if (host.known && host.standby != standby)
+            MORDOR_LOG_INFO(g_log) << key << " is now a "
+                << (standby ? "standby" : "primary");
+        host.known = true;
+        host.standby = standby;
+        host.readOnly = readOnly;
+    }
+    // exponentially weighted, so one slow handshake doesn't dominate
+    host.latency = host.latency == 0ull ? latency :
+        (host.latency * 7ull + latency) / 8ull;
+    used(host, parameters);
+    MORDOR_LOG_DEBUG(g_log) << key << " connected in " << latency << "us";
+}
+
+void
+HealthChecker::failed(const std::string &key,
+    const std::map<std::string, std::string> &parameters)
+{
+    g_failures.increment();
+    boost::mutex::scoped_lock lock(m_mutex);
+    Host &host = m_hosts[key];
+    if (host.alive)
+        MORDOR_LOG_WARNING(g_log) << key << " is down";
+    host.alive = false;
+    host.known = false;
+    used(host, parameters);
+}
+
+void
+HealthChecker::used(Host &host,
+    const std::map<std::string, std::string> &parameters)
+{
+    // never the session's user, password or database
+    host.parameters.clear();
+    for (std::map<std::string, std::string>::const_iterator it(parameters.begin());
+        it != parameters.end();
+        ++it) {
+        if (it->first == "host" || it->first == "hostaddr" ||
+            it->first == "port" || it->first.compare(0, 3, "ssl") == 0)
+            host.parameters.insert(*it);
+    }
+    if (host.lastUsed == 0ull)
+        host.lastUsed = TimerManager::now();
+}
+
+void
+HealthChecker::opened(const std::string &key)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    ++m_hosts[key].connections;
+}
+
+void
+HealthChecker::closed(const std::string &key)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    std::map<std::string, Host>::iterator it = m_hosts.find(key);
+    if (it != m_hosts.end() && it->second.connections > 0u)
+        --it->second.connections;
+}
+
+void
+HealthChecker::checkAll()
+{
+    unsigned long long now = TimerManager::now();
+    boost::mutex::scoped_lock lock(m_mutex);
+    for (std::map<std::string, Host>::iterator it(m_hosts.begin());
+        it != m_hosts.end();) {
+        // a check against an unresponsive host can outlast the interval
+        if (it->second.checking) {
+            ++it;
+            continue;
+        }
+        // clients can name any host they like; don't probe it forever
+        if (it->second.connections == 0u &&
+            now - it->second.lastUsed > g_expire->val()) {
+            MORDOR_LOG_VERBOSE(g_log) << "forgetting " << it->first;
+            m_hosts.erase(it++);
+            continue;
+        }
+        it->second.checking = true;
+        m_ioManager.schedule(std::bind(&HealthChecker::check, this, it->first));
+        ++it;
+    }
+}
+
+void
+HealthChecker::check(const std::string &key)
+{
+    std::map<std::string, std::string> parameters;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        parameters = m_hosts[key].parameters;
+    }
+    std::map<std::string, std::string> checkParameters(parameters);
+    checkParameters["user"] = g_user->val();
+    checkParameters["dbname"] = g_dbname->val();
+    checkParameters["connect_timeout"] =
+        boost::lexical_cast<std::string>(g_timeout->val());
+    checkParameters["application_name"] = "postguard health check";
+
+    unsigned long long start = TimerManager::now();
+    Server::ptr server;
+    bool alive = false, known = false, standby = false, readOnly = false;
+    try {
+        server = Server::connect(m_ioManager, checkParameters, m_pgpass,
+            m_resolver, m_handshakeScheduler);
+        alive = true;
+        server->checkRole();
+        known = true;
+        standby = server->standby();
+        readOnly = server->readOnly();
+    } catch (ServerError &e) {
+        // it answered, even if it won't let the check in
+        alive = !e.unavailable();
+        MORDOR_LOG_VERBOSE(g_log) << "check of " << key << " refused: "
+            << boost::current_exception_diagnostic_information();
+    } catch (...) {
+        MORDOR_LOG_VERBOSE(g_log) << "check of " << key << " failed: "
+            << boost::current_exception_diagnostic_information();
+    }
+    if (alive)
+        succeeded(key, parameters, TimerManager::now() - start, known, standby,
+            readOnly);
+    else
+        failed(key, parameters);
+    if (server) {
+        try {
+            server->terminate();
+        } catch (...) {
+        }
+    }
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_hosts[key].checking = false;
+}
+
+}
@@ -0,0 +1,126 @@
+#ifndef __POSTGUARD_HEALTH_H__
+#define __POSTGUARD_HEALTH_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace Mordor {
+class IOManager;
+class Scheduler;
+class Timer;
+}
+
+namespace Postguard {
+
+class PgPassFile;
+class Resolver;
+
+/// Tracks the liveness, replication role and connect latency of every
+/// backend host that has been connected to
+///
+/// Server::connect reports the outcome of each attempt, and asks for the
+/// order to try the hosts of a multi-host connection string in.  Known
+/// dead hosts are skipped (unless nothing else is left), and hosts that
+/// satisfy target_session_attrs are tried first; for read-only targets the
+/// healthy replicas are balanced by least connections or lowest latency.
+/// Only failing to reach a host marks it dead; a host that answers with an
+/// ErrorResponse (other than that it isn't accepting connections at all) is
+/// up.  In the background every host is periodically connected to as
+/// postguard.health.user, so a host that comes back is noticed without a
+/// session having to pay for finding out; only how to reach the host is
+/// kept from the sessions' parameters.  Hosts no session has asked for in
+/// postguard.health.expire are forgotten.
+class HealthChecker : boost::noncopyable
+{
+public:
+    enum SessionAttrs
+    {
+        ANY,
+        READ_WRITE,
+        READ_ONLY,
+        PRIMARY,
+        STANDBY,
+        PREFER_STANDBY
+    };
+
+    /// Parse a libpq target_session_attrs value
+    static SessionAttrs parseAttrs(const std::string &value);
+    /// @return If a host with this role can be used for attrs (a primary is
+    /// only a fallback for PREFER_STANDBY)
+    static bool acceptable(SessionAttrs attrs, bool standby, bool readOnly);
+
+public:
+    /// @param handshakeScheduler If not NULL, where to run CPU heavy SSL
+    /// handshakes and password hashing for checks
+    HealthChecker(Mordor::IOManager &ioManager, const PgPassFile *pgpass = NULL,
+        Resolver *resolver = NULL, Mordor::Scheduler *handshakeScheduler = NULL);
+    ~HealthChecker();
+
+    void stop();
+
+    /// @param keys One "host:port" per host, in connection string order
+    /// @return Indices into keys, in the order to try them
+    std::vector<size_t> order(const std::vector<std::string> &keys,
+        SessionAttrs attrs);
+
+    /// @return If any of the hosts might be a live standby: one is known to
+    /// be, or its role hasn't been determined yet
+    bool standbyPossible(const std::vector<std::string> &keys);
+
+    /// @param parameters Single host connection parameters; the host, port
+    /// and SSL settings are used for background checks
+    /// @param known If the role of the host was determined
+    void succeeded(const std::string &key,
+        const std::map<std::string, std::string> &parameters,
+        unsigned long long latency, bool known, bool standby, bool readOnly);
+    void failed(const std::string &key,
+        const std::map<std::string, std::string> &parameters);
+
+    /// A session is (no longer) connected to the host
+    void opened(const std::string &key);
+    void closed(const std::string &key);
+
+private:
+    struct Host
+    {
+        Host()
+            : alive(true),
+              known(false),
+              standby(false),
+              readOnly(false),
+              checking(false),
+              latency(0ull),
+              lastUsed(0ull),
+              connections(0u)
+        {}
+
+        bool alive, known, standby, readOnly, checking;
+        unsigned long long latency, lastUsed;
+        size_t connections;
+        std::map<std::string, std::string> parameters;
+    };
+
+    /// Remember how to reach the host, and that a session wanted it
+    void used(Host &host, const std::map<std::string, std::string> &parameters);
+    void checkAll();
+    void check(const std::string &key);
+
+private:
+    Mordor::IOManager &m_ioManager;
+    const PgPassFile *m_pgpass;
+    Resolver *m_resolver;
+    Mordor::Scheduler *m_handshakeScheduler;
+    std::shared_ptr<Mordor::Timer> m_timer;
+    boost::mutex m_mutex;
+    std::map<std::string, Host> m_hosts;
+};
+
+}
+
+#endif
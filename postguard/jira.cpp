@@ -6,6 +6,8 @@
 #include "mordor/http/broker.h"
 #include "mordor/http/client.h"
 
+#include "postguard/allocations.h"
+
 using namespace Mordor;
 using namespace Postguard;
 
@@ -15,6 +17,7 @@ Jira::Jira(IOManager &ioManager, const URI& baseUri, const std::string &username
     m_username(username),
     m_password(password)
 {
+    Allocations::Scope scope(Allocations::JIRA);
     HTTP::RequestBrokerOptions options;
     options.ioManager = &ioManager;
     m_requestBroker = HTTP::createRequestBroker(options).first;
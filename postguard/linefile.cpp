@@ -0,0 +1,81 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/linefile.h"
+
+#include <ctype.h>
+
+#include <stdexcept>
+
+#include <boost/lexical_cast.hpp>
+
+#include <mordor/exception.h>
+#include <mordor/streams/buffered.h>
+#include <mordor/streams/file.h>
+
+using namespace Mordor;
+
+namespace Postguard {
+
+static std::vector<std::string> tokenize(const std::string &line)
+{
+    std::vector<std::string> tokens;
+    size_t i = 0;
+    while (true) {
+        while (i < line.length() && isspace((unsigned char)line[i]))
+            ++i;
+        if (i == line.length() || line[i] == '#')
+            return tokens;
+        std::string token;
+        bool quoted = false;
+        for (; i < line.length(); ++i) {
+            char c = line[i];
+            if (c == '"') {
+                if (quoted && i + 1 < line.length() && line[i + 1] == '"') {
+                    token += '"';
+                    ++i;
+                } else {
+                    quoted = !quoted;
+                }
+            } else if (!quoted && isspace((unsigned char)c)) {
+                break;
+            } else {
+                token += c;
+            }
+        }
+        if (quoted)
+            MORDOR_THROW_EXCEPTION(std::runtime_error("unterminated quote"));
+        tokens.push_back(token);
+    }
+}
+
+void
+readLineFile(const std::string &path,
+    const std::function<void (const std::vector<std::string> &)> &parse)
+{
+    Stream::ptr file(new FileStream(path, FileStream::READ));
+    file.reset(new BufferedStream(file));
+    size_t lineNumber = 0u;
+    while (true) {
+        std::string line = file->getDelimited('\n', true);
+        if (line.empty())
+            break;
+        ++lineNumber;
+        bool eof = (line.back() != '\n');
+        if (!eof)
+            line = line.substr(0, line.length() - 1);
+        try {
+            std::vector<std::string> tokens = tokenize(line);
+            if (!tokens.empty())
+                parse(tokens);
+        } catch (std::runtime_error &e) {
+            MORDOR_THROW_EXCEPTION(std::runtime_error(path + ":" +
+                boost::lexical_cast<std::string>(lineNumber) + ": " + e.what()));
+        }
+        if (eof)
+            break;
+    }
+}
+
+}
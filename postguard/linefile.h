@@ -0,0 +1,92 @@
+#ifndef __POSTGUARD_LINEFILE_H__
+#define __POSTGUARD_LINEFILE_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/exception/diagnostic_information.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <mordor/config.h>
+#include <mordor/log.h>
+
+namespace Postguard {
+
+/// Read a line oriented configuration file
+///
+/// Each line is split into whitespace separated tokens, and a token
+/// starting with # starts a comment that runs to the end of the line.
+/// Double quotes keep whitespace and # in a token (name="a, b" is the
+/// token name=a, b), and "" inside quotes is a literal quote.
+/// @param parse Called with the tokens of every line that has any
+/// @throws std::runtime_error if the file can't be read, or a line doesn't
+/// tokenize or parse; the message names the file and line
+void readLineFile(const std::string &path,
+    const std::function<void (const std::vector<std::string> &)> &parse);
+
+/// Holds the current table loaded from the file a config var names, and
+/// swaps in a new one on reload
+///
+/// Lookups take their own reference to the table, so a reload never blocks
+/// or invalidates a lookup in progress.  Table needs a static load(path)
+/// returning a std::shared_ptr<const Table>, and a size() for the log.
+template <class Table>
+class ReloadableTable : boost::noncopyable
+{
+public:
+    typedef std::shared_ptr<const Table> ptr;
+
+public:
+    /// Loads the file, if configured; a broken file at startup is fatal,
+    /// rather than silently ignored
+    /// @param what What Table::size() counts
+    ReloadableTable(Mordor::ConfigVar<std::string>::ptr path,
+        Mordor::Logger::ptr log, const char *what)
+        : m_path(path),
+          m_log(log),
+          m_what(what)
+    {
+        std::string file = m_path->val();
+        if (!file.empty()) {
+            m_table = Table::load(file);
+            MORDOR_LOG_INFO(m_log) << "loaded " << m_table->size() << " "
+                << m_what << " from " << file;
+        }
+    }
+
+    /// Reread the file; the current table is kept if that fails
+    void reload()
+    {
+        std::string file = m_path->val();
+        if (file.empty()) {
+            std::atomic_store(&m_table, ptr());
+            return;
+        }
+        try {
+            ptr table = Table::load(file);
+            std::atomic_store(&m_table, table);
+            MORDOR_LOG_INFO(m_log) << "reloaded " << table->size() << " "
+                << m_what << " from " << file;
+        } catch (...) {
+            MORDOR_LOG_ERROR(m_log) << "Unable to reload " << file
+                << ", keeping the old one: "
+                << boost::current_exception_diagnostic_information();
+        }
+    }
+
+    /// @return NULL if no file is configured
+    ptr get() const { return std::atomic_load(&m_table); }
+
+private:
+    Mordor::ConfigVar<std::string>::ptr m_path;
+    Mordor::Logger::ptr m_log;
+    const char *m_what;
+    ptr m_table;
+};
+
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef __POSTGUARD_LITTLEENDIAN_H__
+#define __POSTGUARD_LITTLEENDIAN_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <string>
+
+namespace Postguard {
+
+// The little endian encodings shared by the audit log and captures
+
+/// Append the low bytes of value
+inline void putInteger(std::string &out, unsigned long long value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; ++i)
+        out.push_back((char)((value >> (i * 8)) & 0xff));
+}
+
+/// Append a uint16 length and the bytes, truncated to 65535
+inline void putString(std::string &out, const std::string &value)
+{
+    size_t length = std::min<size_t>(value.length(), 0xffffu);
+    putInteger(out, length, 2u);
+    out.append(value, 0u, length);
+}
+
+inline unsigned long long getInteger(const void *data, size_t bytes)
+{
+    const unsigned char *in = (const unsigned char *)data;
+    unsigned long long value = 0ull;
+    for (size_t i = 0; i < bytes; ++i)
+        value |= (unsigned long long)in[i] << (i * 8);
+    return value;
+}
+
+}
+
+#endif
@@ -0,0 +1,355 @@
+// Copyright (c) 2014 - Cody Cutrer
+//
+// Opens a large number of relayed sessions through postguard and leaves
+// them idle, reporting postguard's RSS as they pile up; optionally runs
+// some statements on each first, to drive the allocation statistics
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static unsigned long long now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000ull;
+}
+
+/// @return VmRSS of pid (kB), or 0 if it can't be read
+static unsigned long long rss(pid_t pid)
+{
+    std::ostringstream path;
+    path << "/proc/" << pid << "/status";
+    std::ifstream status(path.str().c_str());
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0)
+            return strtoull(line.c_str() + 6, NULL, 10);
+    }
+    return 0ull;
+}
+
+/// @return How long ago pid started (s, to the clock tick), or -1 if it
+/// can't be read
+static double age(pid_t pid)
+{
+    std::ostringstream path;
+    path << "/proc/" << pid << "/stat";
+    std::ifstream stat(path.str().c_str());
+    std::string line;
+    if (!std::getline(stat, line))
+        return -1.0;
+    // the command name can contain anything, so count from its end;
+    // starttime is the 20th field after it
+    size_t end = line.rfind(')');
+    if (end == std::string::npos)
+        return -1.0;
+    std::istringstream fields(line.substr(end + 1u));
+    std::string field;
+    for (int i = 0; i < 20 && fields >> field; ++i);
+    if (!fields)
+        return -1.0;
+    double started = strtoull(field.c_str(), NULL, 10) /
+        (double)sysconf(_SC_CLK_TCK);
+    double uptime;
+    std::ifstream proc("/proc/uptime");
+    if (!(proc >> uptime))
+        return -1.0;
+    return uptime - started;
+}
+
+namespace {
+/// One relayed session, speaking just enough of the protocol to get past
+/// startup
+class Session
+{
+public:
+    Session(const std::string &path)
+        : m_fd(socket(AF_UNIX, SOCK_STREAM, 0))
+    {
+        if (m_fd < 0)
+            throw std::runtime_error(std::string("socket: ") + strerror(errno));
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        if (connect(m_fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+            int error = errno;
+            close(m_fd);
+            throw std::runtime_error("Unable to connect to " + path + ": " +
+                strerror(error));
+        }
+    }
+
+    ~Session()
+    {
+        if (m_fd < 0)
+            return;
+        // say goodbye properly, so postguard doesn't cancel anything
+        static const char terminate[] = { 'X', 0, 0, 0, 4 };
+        ::send(m_fd, terminate, sizeof(terminate), MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(m_fd);
+    }
+
+    /// Gives the issue key as a startup parameter, so the session is
+    /// relayed without a GO
+    void startup(const std::string &user, const std::string &database,
+        const std::string &issue)
+    {
+        std::string message(8u, '\0');
+        message.append("user").push_back('\0');
+        message.append(user).push_back('\0');
+        message.append("database").push_back('\0');
+        message.append(database).push_back('\0');
+        message.append("postguard.issue").push_back('\0');
+        message.append(issue).push_back('\0');
+        message.push_back('\0');
+        unsigned int length = htonl(message.size());
+        unsigned int version = htonl(196608u);
+        memcpy(&message[0], &length, 4u);
+        memcpy(&message[4], &version, 4u);
+        send(message);
+        waitForReady();
+    }
+
+    void query(const std::string &statement)
+    {
+        std::string message(5u, 'Q');
+        message.append(statement).push_back('\0');
+        unsigned int length = htonl(message.size() - 1u);
+        memcpy(&message[1], &length, 4u);
+        send(message);
+        waitForReady();
+    }
+
+    void send(const std::string &data)
+    {
+        const char *bytes = data.c_str();
+        size_t length = data.size();
+        while (length > 0u) {
+            ssize_t sent = ::send(m_fd, bytes, length, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error(std::string("send: ") + strerror(errno));
+            }
+            bytes += sent;
+            length -= sent;
+        }
+    }
+
+    void waitForReady()
+    {
+        while (true) {
+            char type;
+            std::string body = readMessage(type);
+            if (type == 'E')
+                throw std::runtime_error("postguard refused the session: " +
+                    errorMessage(body));
+            if (type == 'R') {
+                unsigned int code;
+                memcpy(&code, body.c_str(), 4u);
+                if (ntohl(code) != 0u)
+                    throw std::runtime_error("postguard asked for a password");
+            }
+            if (type == 'Z')
+                return;
+        }
+    }
+
+private:
+    static std::string errorMessage(const std::string &body)
+    {
+        for (size_t i = 0; i < body.size() && body[i] != '\0';) {
+            size_t end = body.find('\0', i + 1);
+            if (end == std::string::npos)
+                break;
+            if (body[i] == 'M')
+                return body.substr(i + 1, end - i - 1);
+            i = end + 1;
+        }
+        return "(no message)";
+    }
+
+    std::string readMessage(char &type)
+    {
+        char header[5];
+        readFully(header, 5u);
+        type = header[0];
+        unsigned int length;
+        memcpy(&length, header + 1, 4u);
+        length = ntohl(length);
+        if (length < 4u)
+            throw std::runtime_error("malformed message from postguard");
+        std::string body(length - 4u, '\0');
+        if (!body.empty())
+            readFully(&body[0], body.size());
+        return body;
+    }
+
+    void readFully(char *data, size_t length)
+    {
+        while (length > 0u) {
+            ssize_t received = recv(m_fd, data, length, 0);
+            if (received < 0 && errno == EINTR)
+                continue;
+            if (received <= 0)
+                throw std::runtime_error("postguard closed the connection");
+            data += received;
+            length -= received;
+        }
+    }
+
+private:
+    int m_fd;
+};
+}
+
+static void usage(const char *argv0)
+{
+    std::cerr << "usage: " << argv0 << " [-S socket] [-U user] [-d database]"
+        << " [-n sessions,...] [-q count] [-s statement]"
+        << " [-w seconds] [-a] -i issue -P pid" << std::endl
+        << "  -a  wait for pid to start accepting, and report how long after it"
+        << " started that was" << std::endl
+        << "  -n  report RSS after opening this many sessions (default"
+        << " 1000,10000,50000)" << std::endl
+        << "  -q  run this many statements (-s, default SELECT 1) on each"
+        << " session once it's open" << std::endl
+        << "  -w  keep the sessions open this long after the last report"
+        << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string path = "/tmp/.s.PGSQL.5432", user, database, issue;
+    std::string checkpointList = "1000,10000,50000";
+    std::string statement = "SELECT 1";
+    pid_t pid = 0;
+    unsigned int hold = 0u, queries = 0u;
+    bool accepting = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "S:U:d:i:n:P:q:s:w:a")) != -1) {
+        switch (opt) {
+            case 'a': accepting = true; break;
+            case 'S': path = optarg; break;
+            case 'U': user = optarg; break;
+            case 'd': database = optarg; break;
+            case 'i': issue = optarg; break;
+            case 'n': checkpointList = optarg; break;
+            case 'P': pid = atoi(optarg); break;
+            case 'q': queries = atoi(optarg); break;
+            case 's': statement = optarg; break;
+            case 'w': hold = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    std::vector<size_t> checkpoints;
+    std::istringstream is(checkpointList);
+    std::string checkpoint;
+    while (std::getline(is, checkpoint, ','))
+        checkpoints.push_back(strtoul(checkpoint.c_str(), NULL, 10));
+    std::sort(checkpoints.begin(), checkpoints.end());
+    if (optind != argc || issue.empty() || pid <= 0 || checkpoints.empty() ||
+        checkpoints.front() == 0u) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (user.empty()) {
+        const char *login = getenv("USER");
+        user = login ? login : "postgres";
+    }
+    if (database.empty())
+        database = user;
+
+    // every session is a descriptor, here and twice in postguard
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < checkpoints.back() + 16u)
+        std::cerr << "warning: only " << limit.rlim_cur
+            << " descriptors available" << std::endl;
+
+    std::vector<Session *> sessions;
+    int status = 0;
+    try {
+        if (accepting) {
+            // a restarted postguard can be connected to before it accepts,
+            // so only a session that gets all the way to ReadyForQuery counts
+            unsigned long long deadline = now() + 60000000ull;
+            while (true) {
+                try {
+                    std::unique_ptr<Session> session(new Session(path));
+                    session->startup(user, database, issue);
+                    sessions.push_back(session.release());
+                    break;
+                } catch (std::exception &) {
+                    if (now() > deadline)
+                        throw;
+                    usleep(1000);
+                }
+            }
+            double seconds = age(pid);
+            if (seconds < 0.0)
+                throw std::runtime_error("Unable to read the start time of the postguard process");
+            std::cout.precision(2);
+            std::cout << std::fixed << "accepting " << seconds
+                << "s after start" << std::endl;
+        }
+        unsigned long long baseline = rss(pid);
+        if (baseline == 0ull)
+            throw std::runtime_error("Unable to read the RSS of the postguard process");
+        std::cout << std::setw(10) << "sessions" << std::setw(14) << "rss (kB)"
+            << std::setw(16) << "per session (B)" << std::setw(14)
+            << "open (s)" << std::endl;
+        std::cout << std::setw(10) << sessions.size() << std::setw(14) << baseline << std::endl;
+        unsigned long long start = now();
+        for (size_t i = 0; i < checkpoints.size(); ++i) {
+            while (sessions.size() < checkpoints[i]) {
+                std::unique_ptr<Session> session(new Session(path));
+                session->startup(user, database, issue);
+                for (unsigned int j = 0; j < queries; ++j)
+                    session->query(statement);
+                sessions.push_back(session.release());
+            }
+            unsigned long long elapsed = now() - start;
+            // let postguard finish handing the last ones to the relay
+            sleep(1);
+            unsigned long long current = rss(pid);
+            std::cout.precision(1);
+            std::cout << std::fixed << std::setw(10) << sessions.size()
+                << std::setw(14) << current << std::setw(16)
+                << (current > baseline ? (current - baseline) * 1024ull /
+                    sessions.size() : 0ull)
+                << std::setw(14) << elapsed / 1000000.0 << std::endl;
+        }
+        if (hold != 0u)
+            sleep(hold);
+    } catch (std::exception &e) {
+        std::cerr << "after " << sessions.size() << " sessions: " << e.what()
+            << std::endl;
+        status = 1;
+    }
+    for (size_t i = 0; i < sessions.size(); ++i)
+        delete sessions[i];
+    return status;
+}
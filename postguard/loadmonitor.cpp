@@ -0,0 +1,108 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/loadmonitor.h"
+
+#include <sstream>
+
+#include <mordor/config.h>
+#include <mordor/iomanager.h>
+#include <mordor/log.h>
+#include <mordor/timer.h>
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:loadmonitor");
+
+static ConfigVar<unsigned long long>::ptr g_interval =
+    Config::lookup("postguard.load.interval", 100000ull,
+        "How often to measure scheduling lag (us)");
+static ConfigVar<unsigned long long>::ptr g_shedLag =
+    Config::lookup("postguard.load.shedlag", 500000ull,
+        "Scheduling lag above which new connections are refused (us, 0 to never refuse)");
+
+static AverageMinMaxStatistic<unsigned long long> &g_lag =
+    Statistics::registerStatistic("postguard.load.lag",
+        AverageMinMaxStatistic<unsigned long long>("us"));
+
+namespace Postguard {
+
+LoadMonitor::LoadMonitor(IOManager &ioManager)
+    : m_ioManager(ioManager),
+      m_round(0ull),
+      m_roundStart(0ull),
+      m_roundLag(0ull),
+      m_outstanding(0u),
+      m_lag(0ull)
+{
+    m_timer = ioManager.registerTimer(std::max(g_interval->val(), 1000ull),
+        std::bind(&LoadMonitor::probe, this), true);
+}
+
+LoadMonitor::~LoadMonitor()
+{
+    stop();
+}
+
+void
+LoadMonitor::stop()
+{
+    m_timer->cancel();
+}
+
+bool
+LoadMonitor::overloaded() const
+{
+    unsigned long long threshold = g_shedLag->val();
+    return threshold != 0ull && m_lag > threshold;
+}
+
+void
+LoadMonitor::probe()
+{
+    unsigned long long now = TimerManager::now();
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_outstanding != 0u) {
+        // don't pile more probes onto a scheduler that's already behind
+        m_lag = std::max(m_roundLag, now - m_roundStart);
+        MORDOR_LOG_DEBUG(g_log) << "round " << m_round << " still outstanding after "
+            << now - m_roundStart << "us";
+        return;
+    }
+    ++m_round;
+    m_roundStart = now;
+    m_roundLag = 0ull;
+    m_outstanding = m_threads.size() + 1u;
+    for (std::map<tid_t, AverageMinMaxStatistic<unsigned long long> *>::const_iterator it(m_threads.begin());
+        it != m_threads.end();
+        ++it)
+        m_ioManager.schedule(std::bind(&LoadMonitor::measure, this, m_round, now),
+            it->first);
+    m_ioManager.schedule(std::bind(&LoadMonitor::measure, this, m_round, now));
+}
+
+void
+LoadMonitor::measure(unsigned long long round, unsigned long long scheduled)
+{
+    unsigned long long lag = TimerManager::now() - scheduled;
+    tid_t thread = Mordor::gettid();
+    g_lag.add(lag);
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    AverageMinMaxStatistic<unsigned long long> *&stat = m_threads[thread];
+    if (!stat) {
+        std::ostringstream os;
+        os << "postguard.load.lag." << thread;
+        stat = &Statistics::registerStatistic(os.str(),
+            AverageMinMaxStatistic<unsigned long long>("us"));
+    }
+    stat->add(lag);
+    if (round != m_round)
+        return;
+    m_roundLag = std::max(m_roundLag, lag);
+    if (--m_outstanding == 0u)
+        m_lag = m_roundLag;
+}
+
+}
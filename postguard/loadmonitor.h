@@ -0,0 +1,58 @@
+#ifndef __POSTGUARD_LOADMONITOR_H__
+#define __POSTGUARD_LOADMONITOR_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <atomic>
+#include <map>
+#include <memory>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <mordor/statistics.h>
+#include <mordor/thread.h>
+
+namespace Mordor {
+class IOManager;
+class Timer;
+}
+
+namespace Postguard {
+
+/// Measures how far behind the IOManager is running
+///
+/// Every interval a probe is scheduled on each IOManager thread (plus one
+/// unpinned, to discover the threads), and the time from schedule() until
+/// it runs is recorded as that thread's lag.  A round that still hasn't
+/// finished when the next one is due counts as lagging by its age, so a
+/// completely wedged scheduler still reports (and sheds) correctly.
+class LoadMonitor : boost::noncopyable
+{
+public:
+    LoadMonitor(Mordor::IOManager &ioManager);
+    ~LoadMonitor();
+
+    void stop();
+
+    /// Worst scheduling lag across all threads in the last round (us)
+    unsigned long long lag() const { return m_lag; }
+    /// New connections should be turned away
+    bool overloaded() const;
+
+private:
+    void probe();
+    void measure(unsigned long long round, unsigned long long scheduled);
+
+private:
+    Mordor::IOManager &m_ioManager;
+    std::shared_ptr<Mordor::Timer> m_timer;
+    boost::mutex m_mutex;
+    std::map<Mordor::tid_t, Mordor::AverageMinMaxStatistic<unsigned long long> *> m_threads;
+    unsigned long long m_round, m_roundStart, m_roundLag;
+    size_t m_outstanding;
+    std::atomic<unsigned long long> m_lag;
+};
+
+}
+
+#endif
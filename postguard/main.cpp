@@ -2,16 +2,29 @@
 
 #include "mordor/predef.h"
 
+#include <signal.h>
+
+#include <atomic>
 #include <iostream>
+#include <sstream>
+
+#include <boost/thread/thread.hpp>
 
 #include <mordor/config.h>
 #include <mordor/daemon.h>
 #include <mordor/iomanager.h>
+#include <mordor/log.h>
 #include <mordor/main.h>
-#include <mordor/streams/ssl.h>
+#include <mordor/statistics.h>
+#include <mordor/timer.h>
 
+#include "postguard/allocations.h"
+#include "postguard/certificate.h"
+#include "postguard/forensics.h"
 #include "postguard/jira.h"
 #include "postguard/postguard.h"
+#include "postguard/sockstats.h"
+#include "postguard/telemetry.h"
 
 using namespace Mordor;
 
@@ -27,18 +40,111 @@ static ConfigVar<std::string>::ptr g_listenPath =
         std::string("/tmp/.s.PGSQL.5432"),
         "Listen socket");
 
+static ConfigVar<std::string>::ptr g_sslCert =
+    Config::lookup("postguard.ssl.cert", std::string(),
+        "SSL certificate file (generated on first run if it doesn't exist)");
+static ConfigVar<std::string>::ptr g_sslKey =
+    Config::lookup("postguard.ssl.key", std::string(),
+        "SSL private key file (generated on first run if it doesn't exist)");
+
+static ConfigVar<unsigned long long>::ptr g_statsInterval =
+    Config::lookup("postguard.stats.interval", 60000000ull,
+        "How often to log statistics (us, 0 to disable)");
+
+static Logger::ptr g_log = Log::lookup("postguard:main");
+static Logger::ptr g_statsLog = Log::lookup("postguard:stats");
+
 namespace Postguard {
 
+static void dumpStatistics()
+{
+    std::ostringstream os;
+    Statistics::dump(os);
+    Telemetry::get().dump(os);
+    Allocations::dump(os);
+    SocketSampler::dump(os);
+    MORDOR_LOG_INFO(g_statsLog) << os.str();
+}
+
+static void dumpHeapProfile()
+{
+    try {
+        MORDOR_LOG_INFO(g_log) << "wrote heap profile " << Allocations::dumpProfile();
+    } catch (...) {
+        MORDOR_LOG_ERROR(g_log) << "Unable to write heap profile: "
+            << boost::current_exception_diagnostic_information();
+    }
+}
+
+// Blocked in MORDOR_MAIN before Daemon::run starts any threads (including
+// Mordor's own signal thread), so every thread inherits the mask and only
+// watchSignals ever sees them; handling them isn't restricted to what's
+// async-signal-safe
+static sigset_t userSignals()
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    return signals;
+}
+
+static void watchSignals(const std::atomic<bool> &stopping)
+{
+    sigset_t signals = userSignals();
+    while (true) {
+        siginfo_t info;
+        int signal = sigwaitinfo(&signals, &info);
+        if (signal < 0)
+            continue;
+        if (stopping)
+            return;
+        switch (signal) {
+            case SIGUSR1:
+                dumpHeapProfile();
+                break;
+            case SIGUSR2:
+                // kill -s USR2 -q <session> dumps just that session
+                StatementRing::dumpSessions(info.si_code == SI_QUEUE ?
+                    (unsigned int)info.si_value.sival_int : 0u);
+                break;
+        }
+    }
+}
+
 static int daemonMain(int argc, char *argv[])
 {
     try {
+        unsigned long long start = TimerManager::now();
         IOManager ioManager(8);
-        std::shared_ptr<SSL_CTX> sslCtx(SSLStream::generateSelfSignedCertificate());
+        std::shared_ptr<SSL_CTX> sslCtx = createServerContext(g_sslCert->val(),
+            g_sslKey->val());
         Jira jira(ioManager, g_jiraUri->val(), g_jiraUser->val(), g_jiraPassword->val());
         Postguard postguard(ioManager, g_listenPath->val(), jira, sslCtx.get());
+        MORDOR_LOG_INFO(g_log) << "accepting connections "
+            << (TimerManager::now() - start) / 1000ull << "ms after start";
         Daemon::onTerminate.connect(std::bind(&Postguard::stop, &postguard));
+        Daemon::onReload.connect(std::bind(&Postguard::reload, &postguard));
+        if (g_statsInterval->val() != 0ull) {
+            Timer::ptr statsTimer = ioManager.registerTimer(g_statsInterval->val(),
+                &dumpStatistics, true);
+            Daemon::onTerminate.connect(std::bind(&Timer::cancel, statsTimer));
+        }
+        // Daemon::run must not have undone MORDOR_MAIN's mask, or a SIGUSR2
+        // meant to dump statements would take the default action and kill
+        // postguard
+        sigset_t blocked;
+        pthread_sigmask(SIG_BLOCK, NULL, &blocked);
+        if (!sigismember(&blocked, SIGUSR1) || !sigismember(&blocked, SIGUSR2))
+            MORDOR_LOG_WARNING(g_log) << "SIGUSR1 and SIGUSR2 aren't blocked;"
+                " sending them may terminate postguard";
+        std::atomic<bool> stopping(false);
+        boost::thread signalThread(std::bind(&watchSignals, std::cref(stopping)));
 
         ioManager.stop();
+        stopping = true;
+        pthread_kill(signalThread.native_handle(), SIGUSR1);
+        signalThread.join();
         return 0;
     } catch (...) {
         std::cerr << boost::current_exception_diagnostic_information() << std::endl;
@@ -52,6 +158,9 @@ MORDOR_MAIN(int argc, char *argv[])
 {
     try {
         Config::loadFromEnvironment();
+        Postguard::Allocations::configure();
+        sigset_t signals = Postguard::userSignals();
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
         return Daemon::run(argc, argv, &Postguard::daemonMain);
     } catch (...) {
         std::cerr << boost::current_exception_diagnostic_information() << std::endl;
@@ -0,0 +1,82 @@
+#ifndef __POSTGUARD_MPSCQUEUE_H__
+#define __POSTGUARD_MPSCQUEUE_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <stddef.h>
+
+#include <atomic>
+
+#include <boost/noncopyable.hpp>
+
+namespace Postguard {
+
+struct MpscQueueNode
+{
+    std::atomic<MpscQueueNode *> next;
+};
+
+/// Intrusive multi-producer, single-consumer queue (Vyukov's, with a stub
+/// node)
+///
+/// push() is wait-free and can be called from any thread; pop() must only
+/// be called from one thread at a time.  Node must derive from
+/// MpscQueueNode; the queue never allocates or frees nodes itself.
+template <class Node>
+class MpscQueue : boost::noncopyable
+{
+public:
+    MpscQueue()
+        : m_head(&m_stub),
+          m_tail(&m_stub)
+    {
+        m_stub.next = NULL;
+    }
+
+    void push(Node *node) { push(static_cast<MpscQueueNode *>(node)); }
+
+    /// @return The oldest node, or NULL if the queue is empty (or the only
+    /// node is still being pushed)
+    Node *pop()
+    {
+        MpscQueueNode *tail = m_tail;
+        MpscQueueNode *next = tail->next.load(std::memory_order_acquire);
+        if (tail == &m_stub) {
+            if (!next)
+                return NULL;
+            m_tail = tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            m_tail = next;
+            return static_cast<Node *>(tail);
+        }
+        // a producer is between the exchange and linking its node in; pick
+        // it up next time
+        if (tail != m_head.load(std::memory_order_acquire))
+            return NULL;
+        push(&m_stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next) {
+            m_tail = next;
+            return static_cast<Node *>(tail);
+        }
+        return NULL;
+    }
+
+private:
+    void push(MpscQueueNode *node)
+    {
+        node->next.store(NULL, std::memory_order_relaxed);
+        MpscQueueNode *previous = m_head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+private:
+    std::atomic<MpscQueueNode *> m_head;
+    MpscQueueNode *m_tail;
+    MpscQueueNode m_stub;
+};
+
+}
+
+#endif
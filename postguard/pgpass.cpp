@@ -12,6 +12,8 @@
 #include <mordor/string.h>
 #include <mordor/util.h>
 
+#include "postguard/allocations.h"
+
 using namespace Mordor;
 
 namespace Postguard {
@@ -73,6 +75,7 @@ PgPassEntry::matches(const std::string &host, unsigned short port,
 void
 PgPassFile::load(const std::string &filename)
 {
+    Allocations::Scope scope(Allocations::PGPASS);
     std::string filename2 = filename, home;
     std::map<std::string, std::string>::const_iterator it;
     if (filename2.empty()) {
@@ -0,0 +1,141 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/policy.h"
+
+#include <algorithm>
+
+#include <mordor/config.h>
+#include <mordor/exception.h>
+#include <mordor/log.h>
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:policy");
+
+static ConfigVar<std::string>::ptr g_policyFile =
+    Config::lookup("postguard.policy.file", std::string(),
+        "Backend settings to enforce by Unix user and dbname (empty for none)");
+
+namespace Postguard {
+
+PolicyTable::ptr
+PolicyTable::load(const std::string &path)
+{
+    std::shared_ptr<PolicyTable> table(new PolicyTable());
+    readLineFile(path, std::bind(&PolicyTable::parse, table.get(),
+        std::placeholders::_1));
+    return table;
+}
+
+void
+PolicyTable::parse(const std::vector<std::string> &tokens)
+{
+    if (tokens.size() < 3u)
+        MORDOR_THROW_EXCEPTION(std::runtime_error(
+            "expected <user> <dbname> <setting>=<value> ..."));
+
+    Settings &settings = m_rules[std::make_pair(tokens[0], tokens[1])];
+    for (size_t i = 2; i < tokens.size(); ++i) {
+        size_t equals = tokens[i].find('=');
+        if (equals == std::string::npos || equals == 0u)
+            MORDOR_THROW_EXCEPTION(std::runtime_error("expected setting=value, got " + tokens[i]));
+        std::string name = tokens[i].substr(0, equals);
+        // these go straight into a SET statement
+        if (name.find_first_not_of("abcdefghijklmnopqrstuvwxyz"
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.") != std::string::npos)
+            MORDOR_THROW_EXCEPTION(std::runtime_error("invalid setting name " + name));
+        std::transform(name.begin(), name.end(), name.begin(), &tolower);
+        settings[name] = tokens[i].substr(equals + 1);
+    }
+}
+
+void
+PolicyTable::merge(Settings &settings, const std::string &user,
+    const std::string &dbname) const
+{
+    std::map<std::pair<std::string, std::string>, Settings>::const_iterator it =
+        m_rules.find(std::make_pair(user, dbname));
+    if (it == m_rules.end())
+        return;
+    for (Settings::const_iterator setting(it->second.begin());
+        setting != it->second.end();
+        ++setting)
+        settings[setting->first] = setting->second;
+}
+
+PolicyTable::Settings
+PolicyTable::settings(const std::string &user, const std::string &dbname) const
+{
+    // least specific first, so more specific rules overwrite
+    Settings result;
+    merge(result, "*", "*");
+    merge(result, "*", dbname);
+    merge(result, user, "*");
+    merge(result, user, dbname);
+    return result;
+}
+
+Policy::Policy()
+    : m_table(g_policyFile, g_log, "rules")
+{}
+
+void
+Policy::reload()
+{
+    m_table.reload();
+}
+
+PolicyTable::Settings
+Policy::settings(const std::string &user, const std::string &dbname) const
+{
+    PolicyTable::ptr table = m_table.get();
+    if (!table)
+        return PolicyTable::Settings();
+    return table->settings(user, dbname);
+}
+
+bool
+Policy::needsIssue(const std::string &value)
+{
+    for (size_t i = 0; i + 1 < value.length(); ++i) {
+        if (value[i] != '%')
+            continue;
+        if (value[i + 1] == 'i')
+            return true;
+        ++i;
+    }
+    return false;
+}
+
+std::string
+Policy::expand(const std::string &value, const std::string &user,
+    const std::string &issue)
+{
+    std::string result;
+    for (size_t i = 0; i < value.length(); ++i) {
+        if (value[i] != '%' || i + 1 == value.length()) {
+            result += value[i];
+            continue;
+        }
+        switch (value[++i]) {
+            case 'i':
+                result += issue;
+                break;
+            case 'u':
+                result += user;
+                break;
+            case '%':
+                result += '%';
+                break;
+            default:
+                result += '%';
+                result += value[i];
+                break;
+        }
+    }
+    return result;
+}
+
+}
@@ -0,0 +1,78 @@
+#ifndef __POSTGUARD_POLICY_H__
+#define __POSTGUARD_POLICY_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "postguard/linefile.h"
+
+namespace Postguard {
+
+/// Backend settings enforced on sessions, by Unix user and dbname
+///
+/// The file is line oriented (see readLineFile), so a value with spaces is
+/// quoted, as in search_path="a, b":
+///
+///     <user|*> <dbname|*> <setting>=<value> [<setting>=<value> ...]
+///
+/// Every matching line applies, with user and dbname specific lines taking
+/// precedence over user specific lines, over dbname specific lines, over
+/// lines for everyone.  In values, %i is replaced with the issue key, %u
+/// with the Unix user, and %% with a %.
+class PolicyTable : boost::noncopyable
+{
+public:
+    typedef std::shared_ptr<const PolicyTable> ptr;
+    typedef std::map<std::string, std::string> Settings;
+
+public:
+    /// @throws std::runtime_error if the file can't be read or parsed
+    static ptr load(const std::string &path);
+
+    /// The merged settings for a session (still with placeholders)
+    Settings settings(const std::string &user, const std::string &dbname) const;
+
+    /// The number of rules
+    size_t size() const { return m_rules.size(); }
+
+private:
+    PolicyTable() {}
+
+    void parse(const std::vector<std::string> &tokens);
+    void merge(Settings &settings, const std::string &user,
+        const std::string &dbname) const;
+
+private:
+    std::map<std::pair<std::string, std::string>, Settings> m_rules;
+};
+
+/// Holds the current PolicyTable, and swaps in a new one on reload
+class Policy : boost::noncopyable
+{
+public:
+    /// Loads postguard.policy.file, if configured
+    Policy();
+
+    /// Reread postguard.policy.file; the current table is kept if it fails
+    void reload();
+
+    PolicyTable::Settings settings(const std::string &user,
+        const std::string &dbname) const;
+
+    /// @return If value uses the issue key, which isn't known until GO
+    static bool needsIssue(const std::string &value);
+    static std::string expand(const std::string &value,
+        const std::string &user, const std::string &issue);
+
+private:
+    ReloadableTable<PolicyTable> m_table;
+};
+
+}
+
+#endif
@@ -7,23 +7,60 @@
 #include <pwd.h>
 
 #include <mordor/assert.h>
+#include <mordor/config.h>
 #include <mordor/iomanager.h>
+#include <mordor/log.h>
 #include <mordor/socket.h>
+#include <mordor/statistics.h>
 #include <mordor/streams/socket.h>
 
+#include "postguard/allocations.h"
 #include "postguard/client.h"
+#include "postguard/sslsessions.h"
 
 using namespace Mordor;
 
+static Logger::ptr g_log = Log::lookup("postguard:postguard");
+
+static ConfigVar<int>::ptr g_handshakeThreads =
+    Config::lookup("postguard.handshake.threads", 2,
+        "Number of threads for SSL handshakes and password hashing");
+static ConfigVar<unsigned long long>::ptr g_timeoutTick =
+    Config::lookup("postguard.timeout.tick", 1000000ull,
+        "Resolution of client timeouts (us)");
+
+static ConfigVar<std::string>::ptr g_auditFile =
+    Config::lookup("postguard.audit.file", std::string(),
+        "Audit log of client sessions (empty to disable)");
+
+static CountStatistic<unsigned long long> &g_pending =
+    Statistics::registerStatistic("postguard.clients.pending",
+        CountStatistic<unsigned long long>("clients"));
+static CountStatistic<unsigned long long> &g_shed =
+    Statistics::registerStatistic("postguard.clients.shed",
+        CountStatistic<unsigned long long>("clients"));
+
 namespace Postguard {
 
 Postguard::Postguard(IOManager &ioManager, const std::string &path,
     Jira &jira, SSL_CTX *sslCtx)
     : m_ioManager(ioManager),
       m_jira(jira),
+      m_timerWheel(ioManager, g_timeoutTick->val()),
+      m_admission(m_timerWheel),
+      m_loadMonitor(ioManager),
+      m_overloadedResponse(Connection::errorResponse("FATAL", "53300",
+          "sorry, postguard is overloaded; try again later")),
+      m_audit(g_auditFile->val()),
+      m_resolver(ioManager),
+      m_handshakePool(std::max(g_handshakeThreads->val(), 1), false),
+      m_health(ioManager, &m_pg_pass_file, &m_resolver, &m_handshakePool),
+      m_socketSampler(ioManager),
       m_sslCtx(sslCtx)
 {
     m_pg_pass_file.load();
+    if (m_sslCtx)
+        configureServerSessionCache(m_sslCtx);
 
     UnixAddress address(path);
     m_listen = address.createSocket(ioManager, SOCK_STREAM);
@@ -37,6 +74,10 @@ void
 Postguard::stop()
 {
     m_listen->cancelAccept();
+    m_loadMonitor.stop();
+    m_health.stop();
+    m_socketSampler.stop();
+    m_timerWheel.stop();
     unlink(std::static_pointer_cast<UnixAddress>(m_listen->localAddress())->path().c_str());
     for (std::set<Client::ptr>::const_iterator it(m_clients.begin());
         it != m_clients.end();
@@ -45,6 +86,13 @@ Postguard::stop()
     }
 }
 
+void
+Postguard::reload()
+{
+    m_router.reload();
+    m_policy.reload();
+}
+
 void
 Postguard::closed(Client::ptr client)
 {
@@ -62,6 +110,20 @@ Postguard::listen()
         } catch (OperationAbortedException &) {
             return;
        }
+       if (m_loadMonitor.overloaded()) {
+           // Refuse before spending anything (NSS, SSL, a fiber) on the
+           // client; the response is tiny enough to never block
+           MORDOR_LOG_WARNING(g_log) << "shedding connection, scheduling lag is "
+               << m_loadMonitor.lag() << "us";
+           g_shed.increment();
+           try {
+               socket->send(m_overloadedResponse.c_str(),
+                   m_overloadedResponse.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+           } catch (...) {
+           }
+           // dropping the socket closes it
+           continue;
+       }
        Stream::ptr stream(new SocketStream(socket));
 
        struct ucred creds;
@@ -79,12 +141,24 @@ Postguard::listen()
        if (result)
            user = passwd.pw_name;
 
-       Client::ptr client(new Client(*this, m_ioManager, stream, user));
+       Client::ptr client;
+       {
+           Allocations::Scope scope(Allocations::CLIENT);
+           client.reset(new Client(*this, m_ioManager, stream, user));
+       }
        m_clients.insert(client);
-       m_ioManager.schedule(std::bind(&Client::run, client));
+       g_pending.increment();
+       m_ioManager.schedule(std::bind(&Postguard::start, this, client));
     }
 }
 
+void
+Postguard::start(Client::ptr client)
+{
+    g_pending.decrement();
+    client->run();
+}
+
 SSL_CTX *
 Postguard::sslCtx()
 {
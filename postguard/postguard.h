@@ -5,7 +5,19 @@
 
 #include <openssl/ssl.h>
 
+#include <mordor/workerpool.h>
+
+#include "admission.h"
+#include "audit.h"
+#include "cancelkeys.h"
+#include "health.h"
+#include "loadmonitor.h"
 #include "pgpass.h"
+#include "policy.h"
+#include "resolver.h"
+#include "routes.h"
+#include "sockstats.h"
+#include "timerwheel.h"
 
 namespace Mordor {
 class IOManager;
@@ -25,6 +37,8 @@ public:
       SSL_CTX *sslCtx = NULL);
 
     void stop();
+    /// Reload the routing table and policy
+    void reload();
 
     SSL_CTX *sslCtx();
 
@@ -33,16 +47,39 @@ public:
 // internal:
     void closed(std::shared_ptr<Client> client);
     Jira &jira() { return m_jira; }
+    CancelKeyMap &cancelKeys() { return m_cancelKeys; }
+    Resolver &resolver() { return m_resolver; }
+    Mordor::Scheduler &handshakeScheduler() { return m_handshakePool; }
+    HealthChecker &health() { return m_health; }
+    const Router &router() const { return m_router; }
+    const Policy &policy() const { return m_policy; }
+    TimerWheel &timerWheel() { return m_timerWheel; }
+    Admission &admission() { return m_admission; }
+    Audit &audit() { return m_audit; }
+    SocketSampler &socketSampler() { return m_socketSampler; }
 
 private:
     void listen();
+    void start(std::shared_ptr<Client> client);
 
 private:
     Mordor::IOManager &m_ioManager;
     Jira &m_jira;
+    TimerWheel m_timerWheel;
+    Admission m_admission;
+    LoadMonitor m_loadMonitor;
+    const std::string m_overloadedResponse;
+    Audit m_audit;
     std::shared_ptr<Mordor::Socket> m_listen;
     std::set<std::shared_ptr<Client> > m_clients;
     PgPassFile m_pg_pass_file;
+    CancelKeyMap m_cancelKeys;
+    Resolver m_resolver;
+    Mordor::WorkerPool m_handshakePool;
+    HealthChecker m_health;
+    Router m_router;
+    Policy m_policy;
+    SocketSampler m_socketSampler;
     SSL_CTX *m_sslCtx;
 };
 
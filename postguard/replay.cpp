@@ -0,0 +1,403 @@
+// Copyright (c) 2014 - Cody Cutrer
+//
+// Replays the client side of a postguard capture against a backend, and
+// compares statement latency and throughput with the original session
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "postguard/capturefile.h"
+#include "postguard/framing.h"
+
+using namespace Postguard;
+
+// Give up on a backend that stops answering for this long (us)
+static const unsigned long long IDLE_TIMEOUT = 30000000ull;
+
+static unsigned long long now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000ull;
+}
+
+namespace {
+/// Follows the v3 framing in both directions, timing each statement from
+/// its first Query/Parse/Bind/Execute until its ReadyForQuery
+class Statements
+{
+public:
+    Statements() : ready(0u), serverBytes(0ull), m_inBatch(false),
+        m_batchStart(0ull) {}
+
+    void feed(bool fromClient, const char *data, size_t length,
+        unsigned long long now)
+    {
+        V3Framing &framing = m_framing[fromClient ? 0 : 1];
+        if (!fromClient)
+            serverBytes += length;
+        while (true) {
+            switch (framing.next(data, length)) {
+                case V3Framing::DONE:
+                    return;
+                case V3Framing::MESSAGE:
+                    message(fromClient, framing.type(), now);
+                    break;
+                case V3Framing::PAYLOAD:
+                    break;
+                case V3Framing::LOST:
+                    throw std::runtime_error("lost protocol framing");
+            }
+        }
+    }
+
+    size_t ready;
+    unsigned long long serverBytes;
+    std::vector<unsigned long long> latencies;
+
+private:
+    void message(bool fromClient, char type, unsigned long long now)
+    {
+        if (fromClient) {
+            switch (type) {
+                case 'Q':
+                case 'P':
+                case 'B':
+                case 'D':
+                case 'E':
+                    if (!m_inBatch) {
+                        m_inBatch = true;
+                        m_batchStart = now;
+                    }
+                    if (type != 'Q')
+                        break;
+                    // fall through
+                case 'S':
+                    if (m_inBatch)
+                        m_pending.push_back(m_batchStart);
+                    m_inBatch = false;
+                    break;
+            }
+        } else if (type == 'Z') {
+            ++ready;
+            if (!m_pending.empty()) {
+                latencies.push_back(now - m_pending.front());
+                m_pending.pop_front();
+            }
+        }
+    }
+
+private:
+    V3Framing m_framing[2];
+    std::deque<unsigned long long> m_pending;
+    bool m_inBatch;
+    unsigned long long m_batchStart;
+};
+
+class Backend
+{
+public:
+    Backend(const std::string &host, const std::string &port)
+        : m_fd(-1)
+    {
+        if (!host.empty() && host[0] == '/') {
+            struct sockaddr_un address;
+            memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            std::string path = host + "/.s.PGSQL." + port;
+            strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+            m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (m_fd < 0 || connect(m_fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+                throw std::runtime_error("Unable to connect to " + path);
+            return;
+        }
+        struct addrinfo hints, *results;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &results) != 0)
+            throw std::runtime_error("Unable to resolve " + host);
+        for (struct addrinfo *it = results; it; it = it->ai_next) {
+            m_fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+            if (m_fd >= 0 && connect(m_fd, it->ai_addr, it->ai_addrlen) == 0)
+                break;
+            if (m_fd >= 0)
+                close(m_fd);
+            m_fd = -1;
+        }
+        freeaddrinfo(results);
+        if (m_fd < 0)
+            throw std::runtime_error("Unable to connect to " + host + ":" + port);
+    }
+
+    ~Backend()
+    {
+        if (m_fd >= 0)
+            close(m_fd);
+    }
+
+    /// Trust authentication only; anything else needs a password we don't
+    /// have
+    void startup(const std::string &user, const std::string &database)
+    {
+        std::string message(8u, '\0');
+        message.append("user").push_back('\0');
+        message.append(user).push_back('\0');
+        message.append("database").push_back('\0');
+        message.append(database).push_back('\0');
+        message.push_back('\0');
+        unsigned int length = htonl(message.size());
+        unsigned int version = htonl(196608u);
+        memcpy(&message[0], &length, 4u);
+        memcpy(&message[4], &version, 4u);
+        send(message.c_str(), message.size());
+
+        while (true) {
+            char type;
+            std::string body = readMessage(type);
+            if (type == 'E')
+                throw std::runtime_error("backend refused the connection");
+            if (type == 'R') {
+                unsigned int code;
+                memcpy(&code, body.c_str(), 4u);
+                if (ntohl(code) != 0u)
+                    throw std::runtime_error("only trust authentication is supported");
+            }
+            if (type == 'Z')
+                return;
+        }
+    }
+
+    void send(const char *data, size_t length)
+    {
+        while (length > 0u) {
+            ssize_t sent = ::send(m_fd, data, length, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error("send failed");
+            }
+            data += sent;
+            length -= sent;
+        }
+    }
+
+    /// Wait up to timeout (us) for data
+    /// @return false once the backend has closed the connection
+    bool receive(Statements &statements, unsigned long long timeout)
+    {
+        struct pollfd pfd;
+        pfd.fd = m_fd;
+        pfd.events = POLLIN;
+        int rc = poll(&pfd, 1, (int)std::min<unsigned long long>(timeout / 1000ull, 1000000ull));
+        if (rc <= 0)
+            return true;
+        char buffer[65536];
+        ssize_t received = recv(m_fd, buffer, sizeof(buffer), 0);
+        if (received <= 0)
+            return false;
+        statements.feed(false, buffer, received, now());
+        return true;
+    }
+
+    int fd() const { return m_fd; }
+
+private:
+    std::string readMessage(char &type)
+    {
+        char header[5];
+        readFully(header, 5u);
+        type = header[0];
+        unsigned int length;
+        memcpy(&length, header + 1, 4u);
+        length = ntohl(length);
+        if (length < 4u)
+            throw std::runtime_error("malformed message from backend");
+        std::string body(length - 4u, '\0');
+        if (!body.empty())
+            readFully(&body[0], body.size());
+        return body;
+    }
+
+    void readFully(char *data, size_t length)
+    {
+        while (length > 0u) {
+            ssize_t received = recv(m_fd, data, length, 0);
+            if (received <= 0)
+                throw std::runtime_error("backend closed the connection");
+            data += received;
+            length -= received;
+        }
+    }
+
+private:
+    int m_fd;
+};
+
+struct Summary
+{
+    Summary(std::vector<unsigned long long> latencies) : mean(0.0)
+    {
+        std::sort(latencies.begin(), latencies.end());
+        if (latencies.empty()) {
+            p50 = p95 = p99 = 0ull;
+            return;
+        }
+        unsigned long long total = 0ull;
+        for (size_t i = 0; i < latencies.size(); ++i)
+            total += latencies[i];
+        mean = (double)total / latencies.size();
+        p50 = latencies[(latencies.size() - 1) * 50 / 100];
+        p95 = latencies[(latencies.size() - 1) * 95 / 100];
+        p99 = latencies[(latencies.size() - 1) * 99 / 100];
+    }
+
+    double mean;
+    unsigned long long p50, p95, p99;
+};
+}
+
+static std::string difference(double captured, double replayed)
+{
+    if (captured == 0.0)
+        return "n/a";
+    std::ostringstream os;
+    double percent = (replayed - captured) * 100.0 / captured;
+    os.precision(1);
+    os << std::fixed << (percent >= 0.0 ? "+" : "") << percent << "%";
+    return os.str();
+}
+
+template <class T, class U>
+static void row(const char *label, const T &captured, const U &replayed,
+    const std::string &difference)
+{
+    std::cout.precision(1);
+    std::cout << std::fixed << std::left << std::setw(14) << label
+        << std::right << std::setw(14) << captured << std::setw(14) << replayed
+        << std::setw(12) << difference << std::endl;
+}
+
+static void usage(const char *argv0)
+{
+    std::cerr << "usage: " << argv0 << " [-h host] [-p port] [-U user] [-d database]"
+        << " [-s speed] capture.pgcap.gz" << std::endl
+        << "  -s  1 replays at the original pace, 2 twice as fast, 0 as fast"
+        << " as the backend answers" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string host = "/tmp", port = "5432", user, database;
+    double speed = 1.0;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:U:d:s:")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'U': user = optarg; break;
+            case 'd': database = optarg; break;
+            case 's': speed = atof(optarg); break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (optind != argc - 1 || speed < 0.0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    try {
+        CaptureReader reader(argv[optind]);
+        if (user.empty())
+            user = reader.header().user;
+        if (database.empty())
+            database = reader.header().database;
+
+        // Time the original session, and note how many ReadyForQuerys the
+        // client had seen before sending each chunk, so the replay never
+        // runs ahead of the backend where the original didn't
+        std::vector<CaptureChunk> chunks;
+        std::vector<size_t> readyBefore;
+        Statements captured;
+        unsigned long long capturedElapsed = 0ull;
+        CaptureChunk chunk;
+        while (reader.next(chunk)) {
+            captured.feed(chunk.fromClient, chunk.data.c_str(),
+                chunk.data.size(), chunk.timestamp);
+            capturedElapsed = chunk.timestamp;
+            if (chunk.fromClient) {
+                readyBefore.push_back(captured.ready);
+                chunks.push_back(chunk);
+            }
+        }
+
+        Backend backend(host, port);
+        backend.startup(user, database);
+        Statements replayed;
+        unsigned long long start = now();
+        bool open = true;
+        for (size_t i = 0; i < chunks.size() && open; ++i) {
+            unsigned long long idleSince = now();
+            while (open && replayed.ready < readyBefore[i]) {
+                open = backend.receive(replayed, 100000ull);
+                if (now() - idleSince > IDLE_TIMEOUT)
+                    throw std::runtime_error("backend stopped answering");
+            }
+            if (speed > 0.0) {
+                unsigned long long due = start + (unsigned long long)(chunks[i].timestamp / speed);
+                for (unsigned long long t = now(); open && t < due; t = now())
+                    open = backend.receive(replayed, due - t);
+            }
+            replayed.feed(true, chunks[i].data.c_str(), chunks[i].data.size(), now());
+            backend.send(chunks[i].data.c_str(), chunks[i].data.size());
+        }
+        unsigned long long idleSince = now();
+        while (open && replayed.ready < captured.ready &&
+            now() - idleSince < IDLE_TIMEOUT)
+            open = backend.receive(replayed, 100000ull);
+        unsigned long long replayedElapsed = now() - start;
+
+        Summary before(captured.latencies), after(replayed.latencies);
+        double capturedRate = capturedElapsed ?
+            captured.latencies.size() * 1000000.0 / capturedElapsed : 0.0;
+        double replayedRate = replayedElapsed ?
+            replayed.latencies.size() * 1000000.0 / replayedElapsed : 0.0;
+        std::cout << "session: " << reader.header().user << " "
+            << reader.header().issue << " (" << database << ")" << std::endl;
+        row("", "captured", "replayed", "difference");
+        row("statements", captured.latencies.size(), replayed.latencies.size(), "");
+        row("elapsed (ms)", capturedElapsed / 1000.0, replayedElapsed / 1000.0,
+            difference(capturedElapsed, replayedElapsed));
+        row("statements/s", capturedRate, replayedRate,
+            difference(capturedRate, replayedRate));
+        row("server bytes", captured.serverBytes, replayed.serverBytes, "");
+        row("mean (us)", before.mean, after.mean, difference(before.mean, after.mean));
+        row("p50 (us)", before.p50, after.p50, difference(before.p50, after.p50));
+        row("p95 (us)", before.p95, after.p95, difference(before.p95, after.p95));
+        row("p99 (us)", before.p99, after.p99, difference(before.p99, after.p99));
+        if (replayed.latencies.size() != captured.latencies.size())
+            return 1;
+        return 0;
+    } catch (std::exception &ex) {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+}
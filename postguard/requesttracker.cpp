@@ -0,0 +1,69 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/requesttracker.h"
+
+namespace Postguard {
+
+RequestTracker::RequestTracker()
+    : m_requests(0ull),
+      m_answered(0ull),
+      m_unsynced(false),
+      m_terminated(false),
+      m_lost(false)
+{}
+
+void
+RequestTracker::observe(StatementTracker::Direction direction,
+    const char *data, size_t length)
+{
+    V3Framing &framing = m_framing[direction];
+    while (true) {
+        switch (framing.next(data, length)) {
+            case V3Framing::DONE:
+                return;
+            case V3Framing::LOST:
+                m_lost = true;
+                return;
+            case V3Framing::PAYLOAD:
+                continue;
+            case V3Framing::MESSAGE:
+                break;
+        }
+        // each of Query, Sync and FunctionCall is answered by exactly one
+        // ReadyForQuery; an Execute only is once a Sync follows it
+        if (direction == StatementTracker::FROM_CLIENT) {
+            switch (framing.type()) {
+                case 'E':
+                    m_unsynced = true;
+                    break;
+                case 'Q':
+                case 'S':
+                case 'F':
+                    ++m_requests;
+                    m_unsynced = false;
+                    break;
+                case 'X':
+                    m_terminated = true;
+                    break;
+            }
+        } else if (framing.type() == 'Z') {
+            ++m_answered;
+        }
+    }
+}
+
+bool
+RequestTracker::busy() const
+{
+    // answers never overtake requests, so reading answered first can't
+    // see more of them than requests; and a Sync is counted before it
+    // clears m_unsynced, so reading that next can't miss both
+    unsigned long long answered = m_answered.load();
+    if (m_lost || m_unsynced)
+        return true;
+    return m_requests.load() > answered;
+}
+
+}
@@ -0,0 +1,46 @@
+#ifndef __POSTGUARD_REQUESTTRACKER_H__
+#define __POSTGUARD_REQUESTTRACKER_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <stddef.h>
+
+#include <atomic>
+
+#include <boost/noncopyable.hpp>
+
+#include "postguard/framing.h"
+#include "postguard/telemetry.h"
+
+namespace Postguard {
+
+/// Follows just enough of a relayed session's framing to tell whether the
+/// backend is still working on something the client sent, and whether the
+/// client said goodbye with a Terminate
+///
+/// Each direction only keeps its own state, so the two pumps can feed it
+/// at the same time without a lock.
+class RequestTracker : boost::noncopyable
+{
+public:
+    RequestTracker();
+
+    /// Bytes that were just relayed in direction
+    void observe(StatementTracker::Direction direction, const char *data,
+        size_t length);
+
+    /// If a Query, Sync or FunctionCall hasn't been answered with
+    /// ReadyForQuery yet, an Execute hasn't been followed by a Sync (the
+    /// backend may still be running it), or the framing was lost and it
+    /// can't be told
+    bool busy() const;
+    bool terminated() const { return m_terminated; }
+
+private:
+    V3Framing m_framing[2];
+    std::atomic<unsigned long long> m_requests, m_answered;
+    std::atomic<bool> m_unsynced, m_terminated, m_lost;
+};
+
+}
+
+#endif
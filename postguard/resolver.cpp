@@ -0,0 +1,151 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/resolver.h"
+
+#include <mordor/config.h>
+#include <mordor/iomanager.h>
+#include <mordor/log.h>
+#include <mordor/socket.h>
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:resolver");
+
+static ConfigVar<int>::ptr g_threads =
+    Config::lookup("postguard.dns.threads", 2,
+        "Number of threads to resolve backend hostnames on");
+static ConfigVar<unsigned long long>::ptr g_ttl =
+    Config::lookup("postguard.dns.ttl", 60000000ull,
+        "How long to cache resolved backend hostnames (us)");
+static ConfigVar<unsigned long long>::ptr g_negativeTtl =
+    Config::lookup("postguard.dns.negativettl", 5000000ull,
+        "How long to cache failures to resolve backend hostnames (us)");
+static ConfigVar<unsigned long long>::ptr g_stale =
+    Config::lookup("postguard.dns.stale", 300000000ull,
+        "How long past its TTL to keep using a cached hostname while it is "
+        "refreshed in the background (us)");
+
+namespace Postguard {
+
+Resolver::Resolver(IOManager &ioManager)
+    : m_ioManager(ioManager),
+      m_pool(std::max(g_threads->val(), 1), false)
+{}
+
+Resolver::~Resolver()
+{
+    m_pool.stop();
+}
+
+std::vector<Address::ptr>
+Resolver::lookup(const std::string &host)
+{
+    unsigned long long now = TimerManager::now();
+    std::shared_ptr<FiberEvent> pending;
+    bool resolve = false;
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        Entry &entry = m_entries[host];
+        if (entry.resolved) {
+            if (now < entry.expires)
+                return result(entry);
+            if (!entry.error && now < entry.stale) {
+                if (!entry.refreshing && !entry.pending) {
+                    MORDOR_LOG_VERBOSE(g_log) << this << " refreshing " << host;
+                    entry.refreshing = true;
+                    m_ioManager.schedule(std::bind(&Resolver::refresh, this, host));
+                }
+                return result(entry);
+            }
+        }
+        if (!entry.pending) {
+            entry.pending.reset(new FiberEvent(false));
+            resolve = true;
+        }
+        pending = entry.pending;
+    }
+
+    if (resolve)
+        refresh(host);
+    else
+        pending->wait();
+
+    FiberMutex::ScopedLock lock(m_mutex);
+    return result(m_entries[host]);
+}
+
+void
+Resolver::refresh(const std::string &host)
+{
+    std::vector<Address::ptr> addresses;
+    boost::exception_ptr error;
+    {
+        // Hop onto the resolver pool for the blocking getaddrinfo call
+        SchedulerSwitcher switcher(&m_pool);
+        try {
+            addresses = Address::lookup(host, AF_UNSPEC, SOCK_STREAM, 0);
+        } catch (...) {
+            error = boost::current_exception();
+        }
+    }
+
+    unsigned long long now = TimerManager::now();
+    FiberMutex::ScopedLock lock(m_mutex);
+    Entry &entry = m_entries[host];
+    if (error && entry.refreshing && !entry.error) {
+        // keep serving the stale answer until the grace period runs out,
+        // but don't retry any sooner than a failure would be
+        MORDOR_LOG_WARNING(g_log) << this << " unable to refresh " << host;
+        entry.expires = std::min(now + g_negativeTtl->val(), entry.stale);
+    } else {
+        if (error)
+            MORDOR_LOG_WARNING(g_log) << this << " unable to resolve " << host;
+        else
+            MORDOR_LOG_DEBUG(g_log) << this << " resolved " << host << " to "
+                << addresses.size() << " addresses";
+        entry.addresses.swap(addresses);
+        entry.error = error;
+        entry.resolved = true;
+        entry.expires = now + (error ? g_negativeTtl->val() : g_ttl->val());
+        entry.stale = error ? entry.expires : entry.expires + g_stale->val();
+    }
+    entry.refreshing = false;
+    if (entry.pending) {
+        entry.pending->set();
+        entry.pending.reset();
+    }
+    prune(now);
+}
+
+std::vector<Address::ptr>
+Resolver::result(const Entry &entry)
+{
+    if (entry.error)
+        boost::rethrow_exception(entry.error);
+    std::vector<Address::ptr> result;
+    for (std::vector<Address::ptr>::const_iterator it(entry.addresses.begin());
+        it != entry.addresses.end();
+        ++it)
+        result.push_back((*it)->clone());
+    return result;
+}
+
+void
+Resolver::prune(unsigned long long now)
+{
+    if (m_entries.size() < 1024u)
+        return;
+    for (std::map<std::string, Entry>::iterator it(m_entries.begin());
+        it != m_entries.end();) {
+        if (it->second.resolved && !it->second.pending &&
+            !it->second.refreshing &&
+            it->second.stale < now)
+            m_entries.erase(it++);
+        else
+            ++it;
+    }
+}
+
+}
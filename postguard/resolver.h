@@ -0,0 +1,67 @@
+#ifndef __POSTGUARD_RESOLVER_H__
+#define __POSTGUARD_RESOLVER_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/exception_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <mordor/fibersynchronization.h>
+#include <mordor/workerpool.h>
+
+namespace Mordor {
+class Address;
+class IOManager;
+}
+
+namespace Postguard {
+
+/// Caching front end to Address::lookup
+///
+/// getaddrinfo blocks, so resolution happens on a small dedicated pool
+/// instead of the IOManager threads.  Answers are cached for a configurable
+/// TTL (getaddrinfo doesn't expose the record's TTL), failures are cached
+/// for a shorter negative TTL, and an expired answer is still served for a
+/// grace period while it is refreshed in the background.  Concurrent
+/// lookups of the same host share a single resolution.
+class Resolver : boost::noncopyable
+{
+public:
+    Resolver(Mordor::IOManager &ioManager);
+    ~Resolver();
+
+    /// @return copies of the cached addresses, safe for the caller to modify
+    std::vector<std::shared_ptr<Mordor::Address> > lookup(const std::string &host);
+
+private:
+    struct Entry
+    {
+        Entry() : resolved(false), refreshing(false), expires(0ull), stale(0ull) {}
+
+        std::vector<std::shared_ptr<Mordor::Address> > addresses;
+        boost::exception_ptr error;
+        bool resolved, refreshing;
+        /// Until when to serve the answer as is, and until when to keep
+        /// serving it while it's refreshed
+        unsigned long long expires, stale;
+        std::shared_ptr<Mordor::FiberEvent> pending;
+    };
+
+    void refresh(const std::string &host);
+    static std::vector<std::shared_ptr<Mordor::Address> > result(const Entry &entry);
+    void prune(unsigned long long now);
+
+private:
+    Mordor::IOManager &m_ioManager;
+    Mordor::WorkerPool m_pool;
+    Mordor::FiberMutex m_mutex;
+    std::map<std::string, Entry> m_entries;
+};
+
+}
+
+#endif
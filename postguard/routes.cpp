@@ -0,0 +1,188 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/routes.h"
+
+#include <algorithm>
+
+#include <boost/lexical_cast.hpp>
+
+#include <mordor/config.h>
+#include <mordor/exception.h>
+#include <mordor/log.h>
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:routes");
+
+static ConfigVar<std::string>::ptr g_routesFile =
+    Config::lookup("postguard.routes.file", std::string(),
+        "Routing table of dbnames to backend clusters (empty to connect as the environment says)");
+
+namespace Postguard {
+
+// Points per unit of weight; enough to keep shards within a few percent of
+// an even split
+static const unsigned int VIRTUAL_NODES = 160u;
+
+RoutingTable::ptr
+RoutingTable::load(const std::string &path)
+{
+    std::shared_ptr<RoutingTable> table(new RoutingTable());
+    readLineFile(path, std::bind(&RoutingTable::parse, table.get(),
+        std::placeholders::_1));
+
+    for (std::vector<Ring>::iterator it(table->m_rings.begin());
+        it != table->m_rings.end();
+        ++it)
+        std::sort(it->begin(), it->end());
+    return table;
+}
+
+void
+RoutingTable::parse(const std::vector<std::string> &tokens)
+{
+    const std::string &kind = tokens[0];
+    if (kind == "cluster") {
+        if (tokens.size() < 2u)
+            MORDOR_THROW_EXCEPTION(std::runtime_error("cluster needs a name"));
+        if (m_clusterIndex.find(tokens[1]) != m_clusterIndex.end())
+            MORDOR_THROW_EXCEPTION(std::runtime_error("duplicate cluster " + tokens[1]));
+        Cluster cluster;
+        cluster.name = tokens[1];
+        for (size_t i = 2; i < tokens.size(); ++i) {
+            size_t equals = tokens[i].find('=');
+            if (equals == std::string::npos || equals == 0u)
+                MORDOR_THROW_EXCEPTION(std::runtime_error("expected name=value, got " + tokens[i]));
+            std::string name = tokens[i].substr(0, equals);
+            std::string value = tokens[i].substr(equals + 1);
+            try {
+                if (name == "pool")
+                    cluster.pool = boost::lexical_cast<size_t>(value);
+                else if (name == "weight")
+                    cluster.weight = boost::lexical_cast<unsigned int>(value);
+                else
+                    cluster.parameters[name] = value;
+            } catch (boost::bad_lexical_cast &) {
+                MORDOR_THROW_EXCEPTION(std::runtime_error("invalid " + name + " " + value));
+            }
+        }
+        m_clusterIndex[cluster.name] = m_clusters.size();
+        m_clusters.push_back(cluster);
+    } else if (kind == "exact") {
+        if (tokens.size() != 3u)
+            MORDOR_THROW_EXCEPTION(std::runtime_error("expected exact <dbname> <cluster>"));
+        m_exact[tokens[1]] = cluster(tokens[2]);
+    } else if (kind == "prefix" || kind == "ring") {
+        if (tokens.size() < 3u || (kind == "prefix" && tokens.size() != 3u))
+            MORDOR_THROW_EXCEPTION(std::runtime_error("expected " + kind +
+                " <prefix> <cluster>" + (kind == "ring" ? " ..." : "")));
+        std::string prefix = tokens[1] == "*" ? std::string() : tokens[1];
+        Destination destination;
+        if (kind == "prefix") {
+            destination.cluster = cluster(tokens[2]);
+        } else {
+            destination.hashed = true;
+            destination.ring = m_rings.size();
+            m_rings.push_back(Ring());
+            Ring &ring = m_rings.back();
+            for (size_t i = 2; i < tokens.size(); ++i) {
+                size_t index = cluster(tokens[i]);
+                unsigned int points = m_clusters[index].weight * VIRTUAL_NODES;
+                for (unsigned int point = 0; point < points; ++point)
+                    ring.push_back(std::make_pair(hash(tokens[i] + "#" +
+                        boost::lexical_cast<std::string>(point)), index));
+            }
+            if (ring.empty())
+                MORDOR_THROW_EXCEPTION(std::runtime_error("ring has no weight"));
+        }
+        m_prefixes[prefix] = destination;
+        m_longestPrefix = std::max(m_longestPrefix, prefix.length());
+    } else {
+        MORDOR_THROW_EXCEPTION(std::runtime_error("unknown rule " + kind));
+    }
+}
+
+size_t
+RoutingTable::cluster(const std::string &name) const
+{
+    std::unordered_map<std::string, size_t>::const_iterator it =
+        m_clusterIndex.find(name);
+    if (it == m_clusterIndex.end())
+        MORDOR_THROW_EXCEPTION(std::runtime_error("unknown cluster " + name));
+    return it->second;
+}
+
+unsigned long long
+RoutingTable::hash(const std::string &value)
+{
+    // FNV-1a; stable across builds and hosts, unlike std::hash, so every
+    // postguard agrees on where a shard lives
+    unsigned long long result = 14695981039346656037ull;
+    for (std::string::const_iterator it(value.begin()); it != value.end(); ++it) {
+        result ^= (unsigned char)*it;
+        result *= 1099511628211ull;
+    }
+    // FNV mixes the last bytes poorly, and shard names tend to differ only
+    // in their trailing digits
+    result ^= result >> 33;
+    result *= 0xff51afd7ed558ccdull;
+    result ^= result >> 33;
+    return result;
+}
+
+const RoutingTable::Cluster *
+RoutingTable::route(const std::string &dbname) const
+{
+    std::unordered_map<std::string, size_t>::const_iterator exact =
+        m_exact.find(dbname);
+    if (exact != m_exact.end())
+        return &m_clusters[exact->second];
+
+    // Probe each possible prefix length, longest first; bounded by the
+    // longest prefix in the table, not by the number of rules
+    size_t length = std::min(dbname.length(), m_longestPrefix);
+    while (true) {
+        std::unordered_map<std::string, Destination>::const_iterator it =
+            m_prefixes.find(dbname.substr(0, length));
+        if (it != m_prefixes.end()) {
+            if (!it->second.hashed)
+                return &m_clusters[it->second.cluster];
+            const Ring &ring = m_rings[it->second.ring];
+            Ring::const_iterator point = std::lower_bound(ring.begin(), ring.end(),
+                std::make_pair(hash(dbname), (size_t)0u));
+            if (point == ring.end())
+                point = ring.begin();
+            return &m_clusters[point->second];
+        }
+        if (length == 0u)
+            return NULL;
+        --length;
+    }
+}
+
+Router::Router()
+    : m_table(g_routesFile, g_log, "clusters")
+{}
+
+void
+Router::reload()
+{
+    m_table.reload();
+}
+
+std::shared_ptr<const RoutingTable::Cluster>
+Router::route(const std::string &dbname) const
+{
+    RoutingTable::ptr table = m_table.get();
+    if (!table)
+        return std::shared_ptr<const RoutingTable::Cluster>();
+    const RoutingTable::Cluster *cluster = table->route(dbname);
+    if (!cluster)
+        return std::shared_ptr<const RoutingTable::Cluster>();
+    // shares ownership of the whole table
+    return std::shared_ptr<const RoutingTable::Cluster>(table, cluster);
+}
+
+}
@@ -0,0 +1,107 @@
+#ifndef __POSTGUARD_ROUTES_H__
+#define __POSTGUARD_ROUTES_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "postguard/linefile.h"
+
+namespace Postguard {
+
+/// An immutable mapping of dbnames to backend clusters
+///
+/// The file is line oriented (see readLineFile):
+///
+///     cluster <name> [pool=<n>] [weight=<n>] [<parameter>=<value> ...]
+///     exact <dbname> <cluster>
+///     prefix <prefix> <cluster>
+///     ring <prefix> <cluster> [<cluster> ...]
+///
+/// Connection parameters (host, port, sslmode, target_session_attrs, ...)
+/// of a cluster override those from the environment and the client.  pool
+/// caps the backend connections to the whole cluster.  A dbname matching an
+/// exact rule goes to that cluster; otherwise the longest matching prefix
+/// (* matches everything) wins, either naming a cluster directly, or a
+/// consistent hash ring of clusters that the dbname is hashed onto.  Adding
+/// a cluster to a ring only moves the shards that land on it.
+class RoutingTable : boost::noncopyable
+{
+public:
+    typedef std::shared_ptr<const RoutingTable> ptr;
+
+    struct Cluster
+    {
+        Cluster() : pool(0u), weight(1u) {}
+
+        std::string name;
+        std::map<std::string, std::string> parameters;
+        size_t pool;
+        unsigned int weight;
+    };
+
+public:
+    /// @throws std::runtime_error if the file can't be read or parsed
+    static ptr load(const std::string &path);
+
+    /// @return NULL if no rule matches
+    const Cluster *route(const std::string &dbname) const;
+
+    /// The number of clusters
+    size_t size() const { return m_clusters.size(); }
+
+private:
+    RoutingTable() : m_longestPrefix(0u) {}
+
+    void parse(const std::vector<std::string> &tokens);
+    size_t cluster(const std::string &name) const;
+    static unsigned long long hash(const std::string &value);
+
+private:
+    struct Destination
+    {
+        Destination() : cluster(0u), ring(0u), hashed(false) {}
+
+        size_t cluster;
+        /// Index into m_rings, if hashed
+        size_t ring;
+        bool hashed;
+    };
+
+    /// Sorted points on the ring, and the cluster owning each
+    typedef std::vector<std::pair<unsigned long long, size_t> > Ring;
+
+    std::vector<Cluster> m_clusters;
+    std::unordered_map<std::string, size_t> m_clusterIndex;
+    std::unordered_map<std::string, size_t> m_exact;
+    std::unordered_map<std::string, Destination> m_prefixes;
+    std::vector<Ring> m_rings;
+    size_t m_longestPrefix;
+};
+
+/// Holds the current RoutingTable, and swaps in a new one on reload
+class Router : boost::noncopyable
+{
+public:
+    /// Loads postguard.routes.file, if configured
+    Router();
+
+    /// Reread postguard.routes.file; the current table is kept if it fails
+    void reload();
+
+    /// @return NULL if no rule matches (or there is no routing table); the
+    /// cluster stays valid across reloads for as long as it is held
+    std::shared_ptr<const RoutingTable::Cluster> route(const std::string &dbname) const;
+
+private:
+    ReloadableTable<RoutingTable> m_table;
+};
+
+}
+
+#endif
@@ -0,0 +1,202 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/scram.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include <boost/lexical_cast.hpp>
+
+#include <mordor/config.h>
+#include <mordor/exception.h>
+#include <mordor/log.h>
+#include <mordor/scheduler.h>
+#include <mordor/string.h>
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:scram");
+
+static ConfigVar<size_t>::ptr g_cacheSize =
+    Config::lookup("postguard.scram.cachesize", (size_t)1024u,
+        "Number of SCRAM salted password derivations to cache (0 to disable)");
+
+namespace Postguard {
+
+static std::string hmac(const std::string &key, const std::string &data)
+{
+    unsigned char result[EVP_MAX_MD_SIZE];
+    unsigned int length = sizeof(result);
+    if (!HMAC(EVP_sha256(), key.c_str(), (int)key.length(),
+        (const unsigned char *)data.c_str(), data.length(), result, &length))
+        MORDOR_THROW_EXCEPTION(std::runtime_error("HMAC failed"));
+    return std::string((const char *)result, length);
+}
+
+static std::string sha256(const std::string &data)
+{
+    unsigned char result[EVP_MAX_MD_SIZE];
+    unsigned int length = sizeof(result);
+    if (!EVP_Digest(data.c_str(), data.length(), result, &length,
+        EVP_sha256(), NULL))
+        MORDOR_THROW_EXCEPTION(std::runtime_error("SHA-256 failed"));
+    return std::string((const char *)result, length);
+}
+
+static std::string xorStrings(const std::string &lhs, const std::string &rhs)
+{
+    std::string result(lhs);
+    for (size_t i = 0; i < result.length() && i < rhs.length(); ++i)
+        result[i] ^= rhs[i];
+    return result;
+}
+
+ScramSha256::ScramSha256(const std::string &user, const std::string &password,
+    Scheduler *offload)
+    : m_user(user),
+      m_password(password),
+      m_offload(offload),
+      m_complete(false)
+{
+    // PostgreSQL applies SASLprep to the password; like libpq, we fall back
+    // to the raw password, which is identical for plain ASCII passwords
+    unsigned char nonce[18];
+    if (RAND_bytes(nonce, sizeof(nonce)) != 1)
+        MORDOR_THROW_EXCEPTION(std::runtime_error("Unable to generate SCRAM nonce"));
+    m_nonce = base64encode(std::string((const char *)nonce, sizeof(nonce)));
+}
+
+std::string
+ScramSha256::clientFirstMessage()
+{
+    // The server ignores the SCRAM username in favor of the startup user
+    m_clientFirstMessageBare = "n=,r=" + m_nonce;
+    return "n,," + m_clientFirstMessageBare;
+}
+
+std::string
+ScramSha256::clientFinalMessage(const std::string &serverFirstMessage)
+{
+    std::string nonce, salt;
+    unsigned int iterations = 0;
+    std::vector<std::string> attributes = split(serverFirstMessage, ',');
+    for (std::vector<std::string>::const_iterator it(attributes.begin());
+        it != attributes.end();
+        ++it) {
+        if (it->length() < 2u || (*it)[1] != '=')
+            MORDOR_THROW_EXCEPTION(std::runtime_error("malformed SCRAM server-first-message"));
+        switch ((*it)[0]) {
+            case 'r':
+                nonce = it->substr(2);
+                break;
+            case 's':
+                salt = base64decode(it->substr(2));
+                break;
+            case 'i':
+                iterations = boost::lexical_cast<unsigned int>(it->substr(2));
+                break;
+            case 'm':
+                MORDOR_THROW_EXCEPTION(std::runtime_error("unsupported SCRAM extension"));
+            default:
+                break;
+        }
+    }
+
+    if (nonce.length() <= m_nonce.length() ||
+        !std::equal(m_nonce.begin(), m_nonce.end(), nonce.begin()))
+        MORDOR_THROW_EXCEPTION(std::runtime_error("invalid SCRAM server nonce"));
+    if (salt.empty() || iterations == 0u)
+        MORDOR_THROW_EXCEPTION(std::runtime_error("malformed SCRAM server-first-message"));
+
+    m_keys = ScramKeyCache::get().derive(m_user, m_password, salt, iterations,
+        m_offload);
+
+    // "biws" is base64("n,,"), the GS2 header without channel binding
+    std::string clientFinalMessageWithoutProof = "c=biws,r=" + nonce;
+    m_authMessage = m_clientFirstMessageBare + "," + serverFirstMessage +
+        "," + clientFinalMessageWithoutProof;
+    std::string clientSignature = hmac(m_keys.storedKey, m_authMessage);
+    std::string proof = xorStrings(m_keys.clientKey, clientSignature);
+    return clientFinalMessageWithoutProof + ",p=" + base64encode(proof);
+}
+
+void
+ScramSha256::verifyServerFinalMessage(const std::string &serverFinalMessage)
+{
+    if (serverFinalMessage.compare(0, 2, "e=") == 0)
+        MORDOR_THROW_EXCEPTION(std::runtime_error("SCRAM authentication failed: " +
+            serverFinalMessage.substr(2)));
+    if (serverFinalMessage.compare(0, 2, "v=") != 0)
+        MORDOR_THROW_EXCEPTION(std::runtime_error("malformed SCRAM server-final-message"));
+    std::string serverSignature = base64decode(split(serverFinalMessage.substr(2), ',').front());
+    if (serverSignature != hmac(m_keys.serverKey, m_authMessage))
+        MORDOR_THROW_EXCEPTION(std::runtime_error("invalid SCRAM server signature"));
+    m_complete = true;
+}
+
+ScramSha256::Keys
+ScramKeyCache::derive(const std::string &user, const std::string &password,
+    const std::string &salt, unsigned int iterations, Scheduler *offload)
+{
+    // Hash the key material, so that plaintext passwords aren't kept around
+    // as map keys
+    std::string key;
+    key.append(user).append(1, '\0').append(password).append(1, '\0')
+        .append(salt).append(1, '\0')
+        .append(boost::lexical_cast<std::string>(iterations));
+    key = sha256(key);
+
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        std::unordered_map<std::string, Entries::iterator>::iterator it =
+            m_index.find(key);
+        if (it != m_index.end()) {
+            m_entries.splice(m_entries.begin(), m_entries, it->second);
+            MORDOR_LOG_DEBUG(g_log) << this << " reusing SCRAM keys for " << user;
+            return it->second->second;
+        }
+    }
+
+    MORDOR_LOG_DEBUG(g_log) << this << " deriving SCRAM keys for " << user
+        << " with " << iterations << " iterations";
+    ScramSha256::Keys keys;
+    {
+        // thousands of HMAC rounds; keep them off the I/O threads
+        SchedulerSwitcher switcher(offload);
+        std::string saltedPassword;
+        saltedPassword.resize(32u);
+        if (!PKCS5_PBKDF2_HMAC(password.c_str(), (int)password.length(),
+            (const unsigned char *)salt.c_str(), (int)salt.length(),
+            (int)iterations, EVP_sha256(), (int)saltedPassword.length(),
+            (unsigned char *)&saltedPassword[0]))
+            MORDOR_THROW_EXCEPTION(std::runtime_error("PBKDF2 failed"));
+
+        keys.clientKey = hmac(saltedPassword, "Client Key");
+        keys.storedKey = sha256(keys.clientKey);
+        keys.serverKey = hmac(saltedPassword, "Server Key");
+    }
+
+    size_t capacity = g_cacheSize->val();
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (capacity == 0u || m_index.find(key) != m_index.end())
+        return keys;
+    m_entries.push_front(std::make_pair(key, keys));
+    m_index[key] = m_entries.begin();
+    while (m_entries.size() > capacity) {
+        m_index.erase(m_entries.back().first);
+        m_entries.pop_back();
+    }
+    return keys;
+}
+
+ScramKeyCache &
+ScramKeyCache::get()
+{
+    static ScramKeyCache cache;
+    return cache;
+}
+
+}
@@ -0,0 +1,77 @@
+#ifndef __POSTGUARD_SCRAM_H__
+#define __POSTGUARD_SCRAM_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace Mordor {
+class Scheduler;
+}
+
+namespace Postguard {
+
+/// Client side of a SCRAM-SHA-256 exchange (RFC 5802 / RFC 7677), as used
+/// by PostgreSQL's SASL authentication
+class ScramSha256 : boost::noncopyable
+{
+public:
+    struct Keys
+    {
+        std::string clientKey, storedKey, serverKey;
+    };
+
+public:
+    /// @param offload If not NULL, run the PBKDF2 derivation on this
+    /// scheduler when it isn't cached
+    ScramSha256(const std::string &user, const std::string &password,
+        Mordor::Scheduler *offload = NULL);
+
+    static const char *mechanism() { return "SCRAM-SHA-256"; }
+
+    /// The client-first-message to send in SASLInitialResponse
+    std::string clientFirstMessage();
+    /// Process the server-first-message from SASLContinue, and return the
+    /// client-final-message to send in SASLResponse
+    std::string clientFinalMessage(const std::string &serverFirstMessage);
+    /// Verify the server's signature from SASLFinal
+    void verifyServerFinalMessage(const std::string &serverFinalMessage);
+    /// If the server has proven that it knows the password
+    bool complete() const { return m_complete; }
+
+private:
+    std::string m_user, m_password, m_nonce, m_clientFirstMessageBare,
+        m_authMessage;
+    Keys m_keys;
+    Mordor::Scheduler *m_offload;
+    bool m_complete;
+};
+
+/// Bounded LRU cache of the PBKDF2 derivation for SCRAM, keyed by
+/// (user, password, salt, iterations)
+class ScramKeyCache : boost::noncopyable
+{
+public:
+    ScramKeyCache() {}
+
+    ScramSha256::Keys derive(const std::string &user,
+        const std::string &password, const std::string &salt,
+        unsigned int iterations, Mordor::Scheduler *offload = NULL);
+
+    static ScramKeyCache &get();
+
+private:
+    typedef std::list<std::pair<std::string, ScramSha256::Keys> > Entries;
+
+    boost::mutex m_mutex;
+    Entries m_entries;
+    std::unordered_map<std::string, Entries::iterator> m_index;
+};
+
+}
+
+#endif
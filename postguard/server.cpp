@@ -8,7 +8,11 @@
 
 #include <boost/lexical_cast.hpp>
 
+#include <mordor/assert.h>
+#include <mordor/config.h>
 #include <mordor/endian.h>
+#include <mordor/fibersynchronization.h>
+#include <mordor/iomanager.h>
 #include <mordor/log.h>
 #include <mordor/streams/buffer.h>
 #include <mordor/streams/buffered.h>
@@ -19,24 +23,213 @@
 #include <mordor/uri.h>
 #include <mordor/util.h>
 
+#include "postguard/allocations.h"
+#include "postguard/health.h"
 #include "postguard/postguard.h"
+#include "postguard/resolver.h"
+#include "postguard/scram.h"
+#include "postguard/sockopts.h"
+#include "postguard/sslsessions.h"
 
 using namespace Mordor;
 
 static Logger::ptr g_log = Log::lookup("postguard:server");
 
+static ConfigVar<unsigned long long>::ptr g_connectStagger =
+    Config::lookup("postguard.connect.stagger", 250000ull,
+        "Delay before also trying the next backend address (us)");
+
 namespace Postguard {
 
 Server::Server(Stream::ptr stream)
-    : Connection(stream)
+    : Connection(stream),
+      m_ssl(false),
+      m_roleKnown(false),
+      m_standby(false),
+      m_readOnly(false),
+      m_handshakeScheduler(NULL),
+      m_health(NULL)
 {}
 
+Server::~Server()
+{
+    if (m_health)
+        m_health->closed(m_healthKey);
+}
+
 Server::ptr
 Server::connect(IOManager &ioManager, const std::map<std::string, std::string> &parameters,
-    const PgPassFile *pgpass)
+    const PgPassFile *pgpass, Resolver *resolver, Scheduler *handshakeScheduler,
+    HealthChecker *health, unsigned long long deadline)
+{
+    HealthChecker::SessionAttrs attrs = HealthChecker::ANY;
+    std::map<std::string, std::string>::const_iterator it;
+    if ( (it = parameters.find("target_session_attrs")) != parameters.end())
+        attrs = HealthChecker::parseAttrs(it->second);
+
+    std::vector<std::map<std::string, std::string> > hosts = splitHosts(parameters);
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < hosts.size(); ++i)
+        keys.push_back(hostKey(hosts[i]));
+    std::vector<size_t> order;
+    if (health) {
+        order = health->order(keys, attrs);
+    } else {
+        for (size_t i = 0; i < hosts.size(); ++i)
+            order.push_back(i);
+    }
+
+    Server::ptr fallback;
+    size_t fallbackIndex = 0u;
+    boost::exception_ptr error;
+    for (std::vector<size_t>::const_iterator candidate(order.begin());
+        candidate != order.end();
+        ++candidate) {
+        unsigned long long start = TimerManager::now();
+        // out of time; that's no fault of the hosts not tried yet
+        if (start >= deadline) {
+            if (!fallback)
+                MORDOR_THROW_EXCEPTION(std::runtime_error("timeout expired"));
+            break;
+        }
+        Server::ptr server;
+        try {
+            server = connectHost(ioManager, hosts[*candidate], pgpass, resolver,
+                handshakeScheduler, deadline);
+            if (attrs != HealthChecker::ANY)
+                server->checkRole();
+        } catch (ServerError &e) {
+            MORDOR_LOG_VERBOSE(g_log) << "connect to " << keys[*candidate] << " refused: "
+                << boost::current_exception_diagnostic_information();
+            error = boost::current_exception();
+            // a bad password or dbname says nothing about the host, except
+            // that it's up
+            if (health && e.unavailable())
+                health->failed(keys[*candidate], hosts[*candidate]);
+            else if (health)
+                health->succeeded(keys[*candidate], hosts[*candidate],
+                    TimerManager::now() - start, false, false, false);
+            continue;
+        } catch (...) {
+            MORDOR_LOG_VERBOSE(g_log) << "connect to " << keys[*candidate] << " failed: "
+                << boost::current_exception_diagnostic_information();
+            error = boost::current_exception();
+            // running into the caller's deadline isn't the host's fault
+            if (health && TimerManager::now() < deadline)
+                health->failed(keys[*candidate], hosts[*candidate]);
+            continue;
+        }
+        if (health)
+            health->succeeded(keys[*candidate], hosts[*candidate], TimerManager::now() - start,
+                server->m_roleKnown, server->m_standby, server->m_readOnly);
+
+        if (HealthChecker::acceptable(attrs, server->m_standby, server->m_readOnly)) {
+            if (fallback)
+                fallback->terminate();
+            fallback = server;
+            fallbackIndex = *candidate;
+            break;
+        }
+        MORDOR_LOG_VERBOSE(g_log) << keys[*candidate] << " is a "
+            << (server->m_standby ? "standby" : "primary")
+            << ", which doesn't satisfy target_session_attrs";
+        if (attrs == HealthChecker::PREFER_STANDBY && !fallback) {
+            // keep it, in case there's no standby to be found
+            fallback = server;
+            fallbackIndex = *candidate;
+        } else {
+            server->terminate();
+        }
+    }
+
+    if (fallback) {
+        if (health) {
+            fallback->m_health = health;
+            fallback->m_healthKey = keys[fallbackIndex];
+            health->opened(fallback->m_healthKey);
+        }
+        return fallback;
+    }
+    if (error)
+        boost::rethrow_exception(error);
+    MORDOR_THROW_EXCEPTION(std::runtime_error(
+        "no host satisfies target_session_attrs"));
+}
+
+std::vector<std::map<std::string, std::string> >
+Server::splitHosts(const std::map<std::string, std::string> &parameters)
+{
+    std::vector<std::string> hosts, hostaddrs, ports;
+    std::map<std::string, std::string>::const_iterator it;
+    if ( (it = parameters.find("host")) != parameters.end())
+        hosts = split(it->second, ',');
+    if ( (it = parameters.find("hostaddr")) != parameters.end())
+        hostaddrs = split(it->second, ',');
+    if ( (it = parameters.find("port")) != parameters.end())
+        ports = split(it->second, ',');
+
+    size_t count = std::max<size_t>(std::max(hosts.size(), hostaddrs.size()), 1u);
+    if ((!hosts.empty() && hosts.size() != count) ||
+        (!hostaddrs.empty() && hostaddrs.size() != count))
+        MORDOR_THROW_EXCEPTION(std::runtime_error(
+            "could not match host names to hostaddr values"));
+    if (ports.size() > 1u && ports.size() != count)
+        MORDOR_THROW_EXCEPTION(std::runtime_error(
+            "could not match port numbers to host names"));
+
+    // Same as libpq: an empty entry in a list means the default
+    std::vector<std::map<std::string, std::string> > result(count, parameters);
+    for (size_t i = 0; i < count; ++i) {
+        std::map<std::string, std::string> &host = result[i];
+        host.erase("host");
+        host.erase("hostaddr");
+        host.erase("port");
+        host.erase("target_session_attrs");
+        if (!hosts.empty() && !hosts[i].empty())
+            host["host"] = hosts[i];
+        if (!hostaddrs.empty() && !hostaddrs[i].empty())
+            host["hostaddr"] = hostaddrs[i];
+        if (!ports.empty()) {
+            const std::string &port = ports.size() == 1u ? ports.front() : ports[i];
+            if (!port.empty())
+                host["port"] = port;
+        }
+    }
+    return result;
+}
+
+std::vector<std::string>
+Server::hostKeys(const std::map<std::string, std::string> &parameters)
+{
+    std::vector<std::map<std::string, std::string> > hosts = splitHosts(parameters);
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < hosts.size(); ++i)
+        keys.push_back(hostKey(hosts[i]));
+    return keys;
+}
+
+std::string
+Server::hostKey(const std::map<std::string, std::string> &parameters)
+{
+    std::map<std::string, std::string>::const_iterator it;
+    std::string host = "/tmp", port = "5432";
+    if ( (it = parameters.find("hostaddr")) != parameters.end())
+        host = it->second;
+    else if ( (it = parameters.find("host")) != parameters.end())
+        host = it->second;
+    if ( (it = parameters.find("port")) != parameters.end())
+        port = it->second;
+    return host + ":" + port;
+}
+
+Server::ptr
+Server::connectHost(IOManager &ioManager, const std::map<std::string, std::string> &parameters,
+    const PgPassFile *pgpass, Resolver *resolver, Scheduler *handshakeScheduler,
+    unsigned long long deadline)
 {
     std::string host, hostaddr, sslmode, hostforpgpass;
     unsigned short port;
+    unsigned long long timeout = ~0ull;
     std::map<std::string, std::string>::const_iterator it;
 
     if ( (it = parameters.find("port")) != parameters.end()) {
@@ -61,6 +254,15 @@ Server::connect(IOManager &ioManager, const std::map<std::string, std::string> &
         sslmode = "prefer";
     }
 
+    if ( (it = parameters.find("connect_timeout")) != parameters.end()) {
+        int seconds = boost::lexical_cast<int>(it->second);
+        // Same as libpq: anything positive but less than 2 seconds means 2
+        if (seconds > 0)
+            timeout = std::max(seconds, 2) * 1000000ull;
+    }
+    if (timeout != ~0ull)
+        deadline = std::min(deadline, TimerManager::now() + timeout);
+
     std::vector<Address::ptr> addresses;
     if (!hostaddr.empty()) {
        addresses.push_back(IPAddress::create(hostaddr.c_str(), port));
@@ -73,7 +275,10 @@ Server::connect(IOManager &ioManager, const std::map<std::string, std::string> &
        addresses.push_back(address);
        sslmode = "disable";
     } else {
-        addresses = Address::lookup(host, AF_UNSPEC, SOCK_STREAM, 0);
+        if (resolver)
+            addresses = interleaveFamilies(resolver->lookup(host));
+        else
+            addresses = interleaveFamilies(Address::lookup(host, AF_UNSPEC, SOCK_STREAM, 0));
         for (std::vector<Address::ptr>::const_iterator it(addresses.begin());
             it != addresses.end();
             ++it) {
@@ -81,26 +286,185 @@ Server::connect(IOManager &ioManager, const std::map<std::string, std::string> &
         }
     }
 
-    Stream::ptr stream;
-    for (std::vector<Address::ptr>::const_iterator it(addresses.begin());
-        it != addresses.end();) {
-        Socket::ptr socket = (*it)->createSocket(ioManager, SOCK_STREAM);
-        try {
-            socket->connect(*it);
-            stream.reset(new SocketStream(socket));
-            break;
-        } catch (...) {
-            if (++it == addresses.end())
-                throw;
-            continue;
-        }
+    // the lookup may have used up some of it already
+    if (deadline != ~0ull) {
+        unsigned long long now = TimerManager::now();
+        timeout = deadline > now ? deadline - now : 1ull;
     }
+    std::pair<Socket::ptr, Address::ptr> connected =
+        connectAny(ioManager, addresses, timeout);
 
-    Server::ptr server(new Server(stream));
+    Server::ptr server;
+    {
+        Allocations::Scope scope(Allocations::SERVER);
+        server.reset(new Server(Stream::ptr(new SocketStream(connected.first))));
+    }
+    server->m_socket = connected.first;
+    server->m_address = connected.second;
+    server->m_handshakeScheduler = handshakeScheduler;
+    // connect_timeout covers the whole attempt, including SSL and
+    // authentication
+    if (deadline != ~0ull) {
+        unsigned long long now = TimerManager::now();
+        unsigned long long remaining = deadline > now ? deadline - now : 1ull;
+        connected.first->receiveTimeout(remaining);
+        connected.first->sendTimeout(remaining);
+    }
     server->connect(hostforpgpass, port, sslmode, parameters, pgpass);
+    connected.first->receiveTimeout(~0ull);
+    connected.first->sendTimeout(~0ull);
     return server;
 }
 
+namespace {
+struct ConnectAttempts
+{
+    ConnectAttempts()
+        : condition(mutex),
+          outstanding(0u),
+          staggered(false),
+          timedOut(false)
+    {}
+
+    FiberMutex mutex;
+    FiberCondition condition;
+    std::vector<Socket::ptr> sockets;
+    Socket::ptr winner;
+    Address::ptr winnerAddress;
+    size_t outstanding;
+    bool staggered, timedOut;
+    boost::exception_ptr error;
+};
+}
+
+static void attemptConnect(std::shared_ptr<ConnectAttempts> attempts,
+    Socket::ptr socket, Address::ptr address)
+{
+    boost::exception_ptr error;
+    try {
+        socket->connect(address);
+    } catch (...) {
+        error = boost::current_exception();
+    }
+    FiberMutex::ScopedLock lock(attempts->mutex);
+    if (!attempts->winner) {
+        if (error) {
+            MORDOR_LOG_VERBOSE(g_log) << "connect to " << *address << " failed";
+            attempts->error = error;
+        } else {
+            attempts->winner = socket;
+            attempts->winnerAddress = address;
+        }
+    }
+    --attempts->outstanding;
+    attempts->condition.signal();
+}
+
+static void staggerExpired(std::shared_ptr<ConnectAttempts> attempts,
+    size_t launched)
+{
+    FiberMutex::ScopedLock lock(attempts->mutex);
+    // ignore a stale timer from a previous attempt
+    if (attempts->sockets.size() != launched)
+        return;
+    attempts->staggered = true;
+    attempts->condition.signal();
+}
+
+static void connectTimedOut(std::shared_ptr<ConnectAttempts> attempts)
+{
+    FiberMutex::ScopedLock lock(attempts->mutex);
+    attempts->timedOut = true;
+    for (std::vector<Socket::ptr>::const_iterator it(attempts->sockets.begin());
+        it != attempts->sockets.end();
+        ++it)
+        (*it)->cancelConnect();
+    attempts->condition.signal();
+}
+
+std::pair<Socket::ptr, Address::ptr>
+Server::connectAny(IOManager &ioManager, const std::vector<Address::ptr> &addresses,
+    unsigned long long timeout)
+{
+    if (addresses.empty())
+        MORDOR_THROW_EXCEPTION(std::runtime_error("no addresses to connect to"));
+
+    // Happy Eyeballs: start the next address whenever the previous attempt
+    // fails, or hasn't succeeded after the stagger delay; first one wins
+    std::shared_ptr<ConnectAttempts> attempts(new ConnectAttempts());
+    Timer::ptr timeoutTimer, staggerTimer;
+    if (timeout != ~0ull)
+        timeoutTimer = ioManager.registerTimer(timeout,
+            std::bind(&connectTimedOut, attempts));
+
+    FiberMutex::ScopedLock lock(attempts->mutex);
+    size_t next = 0u;
+    while (!attempts->winner && !attempts->timedOut) {
+        if (next < addresses.size() &&
+            (attempts->outstanding == 0u || attempts->staggered)) {
+            Socket::ptr socket = addresses[next]->createSocket(ioManager, SOCK_STREAM);
+            if (addresses[next]->family() != AF_UNIX)
+                configureBackendSocket(*socket);
+            attempts->sockets.push_back(socket);
+            attempts->staggered = false;
+            ++attempts->outstanding;
+            ioManager.schedule(std::bind(&attemptConnect, attempts, socket,
+                addresses[next]));
+            ++next;
+            if (staggerTimer)
+                staggerTimer->cancel();
+            if (next < addresses.size())
+                staggerTimer = ioManager.registerTimer(g_connectStagger->val(),
+                    std::bind(&staggerExpired, attempts, attempts->sockets.size()));
+            continue;
+        }
+        if (attempts->outstanding == 0u)
+            break;
+        attempts->condition.wait();
+    }
+
+    if (staggerTimer)
+        staggerTimer->cancel();
+    if (timeoutTimer)
+        timeoutTimer->cancel();
+    for (std::vector<Socket::ptr>::const_iterator it(attempts->sockets.begin());
+        it != attempts->sockets.end();
+        ++it) {
+        if (*it != attempts->winner)
+            (*it)->cancelConnect();
+    }
+
+    if (attempts->winner)
+        return std::make_pair(attempts->winner, attempts->winnerAddress);
+    if (attempts->timedOut)
+        MORDOR_THROW_EXCEPTION(TimedOutException());
+    boost::rethrow_exception(attempts->error);
+}
+
+std::vector<Address::ptr>
+Server::interleaveFamilies(const std::vector<Address::ptr> &addresses)
+{
+    // Alternate address families (RFC 8305), so that a broken IPv6 (or IPv4)
+    // path doesn't have to be waited out address by address
+    std::vector<Address::ptr> first, second;
+    for (std::vector<Address::ptr>::const_iterator it(addresses.begin());
+        it != addresses.end();
+        ++it) {
+        if ((*it)->family() == addresses.front()->family())
+            first.push_back(*it);
+        else
+            second.push_back(*it);
+    }
+    std::vector<Address::ptr> result;
+    for (size_t i = 0; i < first.size() || i < second.size(); ++i) {
+        if (i < first.size())
+            result.push_back(first[i]);
+        if (i < second.size())
+            result.push_back(second[i]);
+    }
+    return result;
+}
+
 std::map<std::string, std::string>
 Server::parseURI(const Mordor::URI &uri)
 {
@@ -190,8 +554,11 @@ Server::connect(const std::string &host, unsigned short port,
     const std::string &sslmode,
     const std::map<std::string, std::string> &parameters, const PgPassFile *pgpass)
 {
+    m_host = host;
+    m_port = port;
+    m_sslMode = sslmode;
     if (sslmode == "prefer" || sslmode == "require" || sslmode == "verify-ca" || sslmode == "verify-full") {
-        startSSL(host, sslmode);
+        startSSL(host, port, sslmode);
     }
 
     Buffer message;
@@ -220,6 +587,7 @@ Server::connect(const std::string &host, unsigned short port,
     V3MessageType type;
     bool more = true;
     AuthenticationType authenticationType;
+    std::unique_ptr<ScramSha256> scram;
     while (more) {
         message.clear();
         readV3Message(type, message);
@@ -235,29 +603,19 @@ Server::connect(const std::string &host, unsigned short port,
                     case AUTHENTICATION_OK:
                         if (message.readAvailable() != 0u)
                             MORDOR_THROW_EXCEPTION(std::runtime_error("malformed Authentication message"));
+                        if (scram && !scram->complete())
+                            MORDOR_THROW_EXCEPTION(std::runtime_error("server skipped SCRAM verification"));
                         more = false;
                         break;
                     case AUTHENTICATION_MD5_PASSWORD:
                     {
                         if (message.readAvailable() != 4u)
                             MORDOR_THROW_EXCEPTION(std::runtime_error("malformed Authentication message"));
-                        std::string user, password;
+                        std::string user;
                         std::map<std::string, std::string>::const_iterator it(parameters.find("user"));
                         if (it != parameters.end())
                             user = it->second;
-
-                        if ( (it = parameters.find("password")) != parameters.end()) {
-                            password = it->second;
-                        } else if (pgpass) {
-                            std::string database;
-                            if ( (it = parameters.find("dbname")) != parameters.end())
-                                database = it->second;
-                            else
-                                database = user;
-                            PgPassFile::const_iterator pgpassit = pgpass->find(host, port, database, user);
-                            if (pgpassit != pgpass->end())
-                                password = pgpassit->password();
-                        }
+                        std::string password = Server::password(host, port, parameters, pgpass);
                         if (password.length() != 35 || std::equal(password.begin(), password.begin() + 3, "md5")) {
                             password = md5(password + user);
                         } else {
@@ -273,12 +631,67 @@ Server::connect(const std::string &host, unsigned short port,
                         m_stream->flush();
                         break;
                     }
+                    case AUTHENTICATION_SASL:
+                    {
+                        bool supported = false;
+                        while (true) {
+                            std::string mechanism = message.getDelimited('\0', false, false);
+                            if (mechanism.empty())
+                                break;
+                            if (mechanism == ScramSha256::mechanism())
+                                supported = true;
+                        }
+                        if (!supported)
+                            MORDOR_THROW_EXCEPTION(std::runtime_error("Unsupported SASL mechanism required"));
+                        std::string user;
+                        std::map<std::string, std::string>::const_iterator it(parameters.find("user"));
+                        if (it != parameters.end())
+                            user = it->second;
+                        scram.reset(new ScramSha256(user,
+                            Server::password(host, port, parameters, pgpass),
+                            m_handshakeScheduler));
+                        std::string clientFirstMessage = scram->clientFirstMessage();
+                        message.clear();
+                        put(message, std::string(ScramSha256::mechanism()));
+                        put(message, byteswap((int)clientFirstMessage.length()));
+                        message.copyIn(clientFirstMessage);
+                        writeV3Message(PASSWORD_MESSAGE, message);
+                        m_stream->flush();
+                        break;
+                    }
+                    case AUTHENTICATION_SASL_CONTINUE:
+                    {
+                        if (!scram)
+                            MORDOR_THROW_EXCEPTION(std::runtime_error("unexpected SASLContinue message"));
+                        std::string serverFirstMessage;
+                        serverFirstMessage.resize(message.readAvailable());
+                        message.copyOut(&serverFirstMessage[0], serverFirstMessage.length());
+                        std::string clientFinalMessage = scram->clientFinalMessage(serverFirstMessage);
+                        message.clear();
+                        message.copyIn(clientFinalMessage);
+                        writeV3Message(PASSWORD_MESSAGE, message);
+                        m_stream->flush();
+                        break;
+                    }
+                    case AUTHENTICATION_SASL_FINAL:
+                    {
+                        if (!scram)
+                            MORDOR_THROW_EXCEPTION(std::runtime_error("unexpected SASLFinal message"));
+                        std::string serverFinalMessage;
+                        serverFinalMessage.resize(message.readAvailable());
+                        message.copyOut(&serverFinalMessage[0], serverFinalMessage.length());
+                        scram->verifyServerFinalMessage(serverFinalMessage);
+                        break;
+                    }
                     default:
                         MORDOR_THROW_EXCEPTION(std::runtime_error("Unsupported authentication type required"));
                 }
                 break;
             case ERROR_RESPONSE:
-                MORDOR_THROW_EXCEPTION(std::runtime_error("got an error"));
+            {
+                std::map<ErrorCode, std::string> messages = readErrorMessages(message);
+                MORDOR_THROW_EXCEPTION(ServerError(messages[MESSAGE], messages[CODE]));
+            }
             default:
                 MORDOR_THROW_EXCEPTION(std::runtime_error("unknown response from server"));
         }
@@ -293,6 +706,7 @@ Server::connect(const std::string &host, unsigned short port,
                 if (message.readAvailable() != 8u)
                     MORDOR_THROW_EXCEPTION(std::runtime_error("malformed BackendKeyData message"));
                 message.copyOut(&m_pid, 4u);
+                message.consume(4u);
                 message.copyOut(&m_secretKey, 4u);
                 break;
             case PARAMETER_STATUS:
@@ -315,11 +729,20 @@ Server::connect(const std::string &host, unsigned short port,
                 char status;
                 message.copyOut(&status, 1u);
                 m_status = (Status)status;
+                // Reported by PostgreSQL 14 and later, saving a query for
+                // target_session_attrs and health checks
+                if (m_parameters.find("in_hot_standby") != m_parameters.end() &&
+                    m_parameters.find("default_transaction_read_only") != m_parameters.end()) {
+                    m_standby = m_parameters["in_hot_standby"] == "on";
+                    m_readOnly = m_standby ||
+                        m_parameters["default_transaction_read_only"] == "on";
+                    m_roleKnown = true;
+                }
                 return;
             case ERROR_RESPONSE:
             {
                 std::map<ErrorCode, std::string> messages = readErrorMessages(message);
-                MORDOR_THROW_EXCEPTION(std::runtime_error(messages[MESSAGE]));
+                MORDOR_THROW_EXCEPTION(ServerError(messages[MESSAGE], messages[CODE]));
             }
             default:
                 MORDOR_THROW_EXCEPTION(std::runtime_error("unknown response from server"));
@@ -328,12 +751,13 @@ Server::connect(const std::string &host, unsigned short port,
 }
 
 void
-Server::startSSL(const std::string &host, const std::string &sslmode)
+Server::startSSL(const std::string &host, unsigned short port,
+    const std::string &sslmode)
 {
     unsigned int length = 8;
     length = byteswap(length);
     m_stream->write(&length, 4);
-    V2MessageType type = SSL_REQUEST;
+    V2MessageType type = byteswap(SSL_REQUEST);
     m_stream->write(&type, 4);
     m_stream->flush();
 
@@ -346,16 +770,21 @@ Server::startSSL(const std::string &host, const std::string &sslmode)
         bufferedStream->flushMultiplesOfBuffer(true);
         bufferedStream->bufferSize(16384);
 
-        SSLStream::ptr sslStream(new SSLStream(m_stream));
+        // The shared context resumes the last session to this backend, and
+        // verifies the certificate during the handshake for verify-ca and
+        // verify-full (so a resumed session reuses the original result)
+        std::shared_ptr<SSL_CTX> ctx = SSLSessionCache::get().clientContext(
+            host, port, host, sslmode);
+        SSLStream::ptr sslStream(new SSLStream(m_stream, true, true, ctx.get()));
         if (!host.empty())
             sslStream->serverNameIndication(host);
-        sslStream->connect();
-        sslStream->flush();
-        if (sslmode == "verify-ca")
-            sslStream->verifyPeerCertificate();
-        else if (sslmode == "verify-full")
-            sslStream->verifyPeerCertificate(host);
+        {
+            SchedulerSwitcher switcher(m_handshakeScheduler);
+            sslStream->connect();
+            sslStream->flush();
+        }
         m_stream.reset(new BufferedStream(sslStream));
+        m_ssl = true;
     } else if (response == 'N') {
         if (sslmode == "prefer")
             return;
@@ -365,6 +794,195 @@ Server::startSSL(const std::string &host, const std::string &sslmode)
     }
 }
 
+void
+Server::cancel(IOManager &ioManager)
+{
+    MORDOR_ASSERT(m_address);
+    Socket::ptr socket = m_address->createSocket(ioManager, SOCK_STREAM);
+    socket->connect(m_address);
+    Server connection(Stream::ptr(new SocketStream(socket)));
+    connection.m_handshakeScheduler = m_handshakeScheduler;
+    if (m_ssl)
+        connection.startSSL(m_host, m_port, m_sslMode);
+
+    MORDOR_LOG_VERBOSE(g_log) << this << " sending CancelRequest to " << *m_address;
+    unsigned int length = 16;
+    length = byteswap(length);
+    connection.m_stream->write(&length, 4);
+    V2MessageType type = byteswap(CANCEL_REQUEST);
+    connection.m_stream->write(&type, 4);
+    connection.m_stream->write(&m_pid, 4);
+    connection.m_stream->write(&m_secretKey, 4);
+    connection.m_stream->flush();
+    connection.m_stream->close();
+}
+
+void
+Server::terminate()
+{
+    Buffer message;
+    writeV3Message(TERMINATE, message);
+    m_stream->flush();
+    m_stream->close();
+}
+
+void
+Server::checkRole()
+{
+    if (m_roleKnown)
+        return;
+
+    Buffer message;
+    put(message, std::string("SELECT pg_catalog.pg_is_in_recovery(), "
+        "pg_catalog.current_setting('transaction_read_only')"));
+    writeV3Message(QUERY, message);
+    m_stream->flush();
+
+    std::vector<std::string> row;
+    V3MessageType type;
+    while (true) {
+        message.clear();
+        readV3Message(type, message);
+
+        switch (type) {
+            case DATA_ROW:
+            {
+                short columns;
+                if (message.readAvailable() < 2u)
+                    MORDOR_THROW_EXCEPTION(std::runtime_error("malformed DataRow message"));
+                message.copyOut(&columns, 2u);
+                message.consume(2u);
+                columns = byteswap(columns);
+                row.clear();
+                for (short i = 0; i < columns; ++i) {
+                    int length;
+                    if (message.readAvailable() < 4u)
+                        MORDOR_THROW_EXCEPTION(std::runtime_error("malformed DataRow message"));
+                    message.copyOut(&length, 4u);
+                    message.consume(4u);
+                    length = byteswap(length);
+                    std::string value;
+                    if (length > 0) {
+                        if (message.readAvailable() < (size_t)length)
+                            MORDOR_THROW_EXCEPTION(std::runtime_error("malformed DataRow message"));
+                        value.resize(length);
+                        message.copyOut(&value[0], length);
+                        message.consume(length);
+                    }
+                    row.push_back(value);
+                }
+                break;
+            }
+            case ROW_DESCRIPTION:
+            case COMMAND_COMPLETE:
+                break;
+            case PARAMETER_STATUS:
+            {
+                std::string name = message.getDelimited('\0', false, false);
+                m_parameters[name] = message.getDelimited('\0', false, false);
+                break;
+            }
+            case NOTICE_RESPONSE:
+            {
+                std::map<ErrorCode, std::string> messages = readErrorMessages(message);
+                MORDOR_LOG_INFO(g_log) << this << messages[SEVERITY] << ":  " << messages[MESSAGE];
+                break;
+            }
+            case ERROR_RESPONSE:
+            {
+                std::map<ErrorCode, std::string> messages = readErrorMessages(message);
+                MORDOR_THROW_EXCEPTION(ServerError(messages[MESSAGE], messages[CODE]));
+            }
+            case READY_FOR_QUERY:
+                if (row.size() != 2u)
+                    MORDOR_THROW_EXCEPTION(std::runtime_error("unexpected result checking replication role"));
+                m_standby = row[0] == "t";
+                m_readOnly = row[1] == "on";
+                m_roleKnown = true;
+                return;
+            default:
+                MORDOR_THROW_EXCEPTION(std::runtime_error("unknown response from server"));
+        }
+    }
+}
+
+void
+Server::execute(const std::string &query)
+{
+    Buffer message;
+    put(message, query);
+    writeV3Message(QUERY, message);
+    m_stream->flush();
+
+    std::string error;
+    V3MessageType type;
+    while (true) {
+        message.clear();
+        readV3Message(type, message);
+
+        switch (type) {
+            case COMMAND_COMPLETE:
+            case ROW_DESCRIPTION:
+            case DATA_ROW:
+                break;
+            case PARAMETER_STATUS:
+            {
+                std::string name = message.getDelimited('\0', false, false);
+                m_parameters[name] = message.getDelimited('\0', false, false);
+                break;
+            }
+            case NOTICE_RESPONSE:
+            {
+                std::map<ErrorCode, std::string> messages = readErrorMessages(message);
+                MORDOR_LOG_INFO(g_log) << this << messages[SEVERITY] << ":  " << messages[MESSAGE];
+                break;
+            }
+            case ERROR_RESPONSE:
+            {
+                // keep reading until ReadyForQuery, so the connection is
+                // still usable
+                std::map<ErrorCode, std::string> messages = readErrorMessages(message);
+                error = messages[MESSAGE];
+                break;
+            }
+            case READY_FOR_QUERY:
+                if (message.readAvailable() != 1u)
+                    MORDOR_THROW_EXCEPTION(std::runtime_error("malformed ReadyForQuery message"));
+                char status;
+                message.copyOut(&status, 1u);
+                m_status = (Status)status;
+                if (!error.empty())
+                    MORDOR_THROW_EXCEPTION(std::runtime_error(error));
+                return;
+            default:
+                MORDOR_THROW_EXCEPTION(std::runtime_error("unknown response from server"));
+        }
+    }
+}
+
+std::string
+Server::password(const std::string &host, unsigned short port,
+    const std::map<std::string, std::string> &parameters, const PgPassFile *pgpass)
+{
+    std::map<std::string, std::string>::const_iterator it;
+    if ( (it = parameters.find("password")) != parameters.end())
+        return it->second;
+    if (!pgpass)
+        return std::string();
+
+    std::string user, database;
+    if ( (it = parameters.find("user")) != parameters.end())
+        user = it->second;
+    if ( (it = parameters.find("dbname")) != parameters.end())
+        database = it->second;
+    else
+        database = user;
+    PgPassFile::const_iterator pgpassit = pgpass->find(host, port, database, user);
+    if (pgpassit != pgpass->end())
+        return pgpassit->password();
+    return std::string();
+}
+
 std::map<Connection::ErrorCode, std::string>
 Server::readErrorMessages(Buffer &message)
 {
@@ -392,6 +1010,8 @@ Server::clientParameter(const std::string &name)
            name == "hostaddr" ||
            name == "port" ||
            name == "sslmode" ||
+           name == "connect_timeout" ||
+           name == "target_session_attrs" ||
            name == "password";
 }
 
@@ -1,17 +1,42 @@
 // Copyright (c) 2013 - Cody Cutrer
 
+#include <map>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 #include "postguard/connection.h"
 
 namespace Mordor {
+class Address;
 class IOManager;
+class Scheduler;
+class Socket;
 struct URI;
 }
 
 namespace Postguard {
 
+class HealthChecker;
 class PgPassFile;
+class Resolver;
+
+/// The backend answered with an ErrorResponse, so it's up, even if it
+/// won't have us
+struct ServerError : public std::runtime_error
+{
+    ServerError(const std::string &message, const std::string &code)
+        : std::runtime_error(message),
+          code(code)
+    {}
+
+    /// If the backend isn't accepting any connections (shutting down,
+    /// starting up or recovering), rather than refusing this one
+    bool unavailable() const { return code.compare(0, 3, "57P") == 0; }
+
+    /// SQLSTATE
+    std::string code;
+};
 
 class Server : public Connection
 {
@@ -22,24 +47,73 @@ private:
     Server(std::shared_ptr<Mordor::Stream> stream);
 
 public:
+    ~Server();
+
+    /// host, hostaddr and port may be comma separated lists, as with libpq;
+    /// each host is tried in turn until one satisfies target_session_attrs
+    /// @param handshakeScheduler If not NULL, where to run CPU heavy SSL
+    /// handshakes and password hashing
+    /// @param health If not NULL, decides the order to try hosts in, and
+    /// is told how each attempt went
+    /// @param deadline TimerManager::now() by which to give up, even if
+    /// connect_timeout allows longer
     static ptr connect(Mordor::IOManager &ioManager,
         const std::map<std::string, std::string> &parameters,
-        const PgPassFile *pgpass = NULL);
+        const PgPassFile *pgpass = NULL, Resolver *resolver = NULL,
+        Mordor::Scheduler *handshakeScheduler = NULL,
+        HealthChecker *health = NULL, unsigned long long deadline = ~0ull);
+    /// @return The HealthChecker key of each host in parameters, in
+    /// connection string order
+    static std::vector<std::string> hostKeys(
+        const std::map<std::string, std::string> &parameters);
     static std::map<std::string, std::string> parseURI(const Mordor::URI &uri);
     static void applyEnvironmentVariables(std::map<std::string, std::string> &parameters);
 
+    /// Ask the backend to cancel the current query of this connection, over
+    /// a new connection to the same address with the same SSL settings
+    void cancel(Mordor::IOManager &ioManager);
+    /// Politely end the session
+    void terminate();
+    /// Query the replication role, unless the backend already reported it
+    void checkRole();
+    /// Run a query that returns no rows (i.e. SET), on behalf of postguard
+    /// rather than the client; parameters() reflects any changes it reports
+    void execute(const std::string &query);
+
     unsigned int pid() const { return m_pid; }
     unsigned int secretKey() const { return m_secretKey; }
     Status status() const { return m_status; }
     const std::map<std::string, std::string> &parameters() const
     { return m_parameters; }
+    std::shared_ptr<Mordor::Socket> socket() const { return m_socket; }
+    bool ssl() const { return m_ssl; }
+    bool roleKnown() const { return m_roleKnown; }
+    bool standby() const { return m_standby; }
+    bool readOnly() const { return m_readOnly; }
 
 private:
+    static ptr connectHost(Mordor::IOManager &ioManager,
+        const std::map<std::string, std::string> &parameters,
+        const PgPassFile *pgpass, Resolver *resolver,
+        Mordor::Scheduler *handshakeScheduler, unsigned long long deadline);
+    static std::vector<std::map<std::string, std::string> > splitHosts(
+        const std::map<std::string, std::string> &parameters);
+    static std::string hostKey(const std::map<std::string, std::string> &parameters);
     void connect(const std::string &host, unsigned short port,
         const std::string &sslMode,
         const std::map<std::string, std::string> &parameters,
         const PgPassFile *pgpass = NULL);
-    void startSSL(const std::string &host, const std::string &sslMode);
+    void startSSL(const std::string &host, unsigned short port,
+        const std::string &sslMode);
+    static std::pair<std::shared_ptr<Mordor::Socket>, std::shared_ptr<Mordor::Address> >
+        connectAny(Mordor::IOManager &ioManager,
+        const std::vector<std::shared_ptr<Mordor::Address> > &addresses,
+        unsigned long long timeout);
+    static std::vector<std::shared_ptr<Mordor::Address> > interleaveFamilies(
+        const std::vector<std::shared_ptr<Mordor::Address> > &addresses);
+    static std::string password(const std::string &host, unsigned short port,
+        const std::map<std::string, std::string> &parameters,
+        const PgPassFile *pgpass);
     static std::map<ErrorCode, std::string> readErrorMessages(Mordor::Buffer &message);
     static bool clientParameter(const std::string &name);
 
@@ -47,6 +121,15 @@ private:
     unsigned int m_pid, m_secretKey;
     Status m_status;
     std::map<std::string, std::string> m_parameters;
+    std::shared_ptr<Mordor::Socket> m_socket;
+    std::shared_ptr<Mordor::Address> m_address;
+    std::string m_host, m_sslMode;
+    unsigned short m_port;
+    bool m_ssl;
+    bool m_roleKnown, m_standby, m_readOnly;
+    Mordor::Scheduler *m_handshakeScheduler;
+    HealthChecker *m_health;
+    std::string m_healthKey;
 };
 
 }
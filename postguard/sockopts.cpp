@@ -0,0 +1,102 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/sockopts.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <mordor/config.h>
+#include <mordor/log.h>
+#include <mordor/socket.h>
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:sockopts");
+
+static ConfigVar<bool>::ptr g_noDelay =
+    Config::lookup("postguard.backend.nodelay", true,
+        "Disable Nagle's algorithm on backend connections");
+static ConfigVar<bool>::ptr g_keepAlive =
+    Config::lookup("postguard.backend.keepalive", true,
+        "Send TCP keepalives on backend connections");
+static ConfigVar<int>::ptr g_keepIdle =
+    Config::lookup("postguard.backend.keepidle", 60,
+        "Idle time before the first keepalive probe (s, 0 for the kernel default)");
+static ConfigVar<int>::ptr g_keepInterval =
+    Config::lookup("postguard.backend.keepintvl", 10,
+        "Time between keepalive probes (s, 0 for the kernel default)");
+static ConfigVar<int>::ptr g_keepCount =
+    Config::lookup("postguard.backend.keepcnt", 6,
+        "Unanswered keepalive probes before the connection is dropped (0 for the kernel default)");
+static ConfigVar<int>::ptr g_userTimeout =
+    Config::lookup("postguard.backend.usertimeout", 0,
+        "How long sent data can go unacknowledged before the connection is dropped (ms, 0 for the kernel default)");
+static ConfigVar<int>::ptr g_sendBuffer =
+    Config::lookup("postguard.backend.sndbuf", 0,
+        "SO_SNDBUF for backend connections (bytes, 0 for the kernel default)");
+static ConfigVar<int>::ptr g_receiveBuffer =
+    Config::lookup("postguard.backend.rcvbuf", 0,
+        "SO_RCVBUF for backend connections (bytes, 0 for the kernel default)");
+static ConfigVar<bool>::ptr g_cork =
+    Config::lookup("postguard.backend.cork", true,
+        "Coalesce relayed writes to backends during bulk transfers");
+
+namespace Postguard {
+
+static void setOption(Socket &socket, int level, int option, int value,
+    const char *name)
+{
+    try {
+        socket.setOption(level, option, value);
+    } catch (...) {
+        MORDOR_LOG_WARNING(g_log) << "Unable to set " << name << "="
+            << value << ": " << boost::current_exception_diagnostic_information();
+    }
+}
+
+void
+configureBackendSocket(Socket &socket)
+{
+    if (g_noDelay->val())
+        setOption(socket, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    if (g_keepAlive->val()) {
+        setOption(socket, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+        if (g_keepIdle->val() > 0)
+            setOption(socket, IPPROTO_TCP, TCP_KEEPIDLE, g_keepIdle->val(),
+                "TCP_KEEPIDLE");
+        if (g_keepInterval->val() > 0)
+            setOption(socket, IPPROTO_TCP, TCP_KEEPINTVL, g_keepInterval->val(),
+                "TCP_KEEPINTVL");
+        if (g_keepCount->val() > 0)
+            setOption(socket, IPPROTO_TCP, TCP_KEEPCNT, g_keepCount->val(),
+                "TCP_KEEPCNT");
+    }
+#ifdef TCP_USER_TIMEOUT
+    if (g_userTimeout->val() > 0)
+        setOption(socket, IPPROTO_TCP, TCP_USER_TIMEOUT, g_userTimeout->val(),
+            "TCP_USER_TIMEOUT");
+#endif
+    if (g_sendBuffer->val() > 0)
+        setOption(socket, SOL_SOCKET, SO_SNDBUF, g_sendBuffer->val(), "SO_SNDBUF");
+    if (g_receiveBuffer->val() > 0)
+        setOption(socket, SOL_SOCKET, SO_RCVBUF, g_receiveBuffer->val(), "SO_RCVBUF");
+}
+
+bool
+corkBackendWrites()
+{
+    return g_cork->val();
+}
+
+void
+corkSocket(Socket &socket, bool cork)
+{
+#ifdef TCP_CORK
+    setOption(socket, IPPROTO_TCP, TCP_CORK, cork ? 1 : 0, "TCP_CORK");
+#endif
+}
+
+}
@@ -0,0 +1,28 @@
+#ifndef __POSTGUARD_SOCKOPTS_H__
+#define __POSTGUARD_SOCKOPTS_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+namespace Mordor {
+class Socket;
+}
+
+namespace Postguard {
+
+/// Apply the postguard.backend.* socket profile (TCP_NODELAY, keepalive,
+/// TCP_USER_TIMEOUT and buffer sizes) to a new backend TCP socket
+///
+/// Call it before connecting, so that the receive buffer size is taken
+/// into account for the window scale.  Options the kernel doesn't support
+/// are logged and skipped.
+void configureBackendSocket(Mordor::Socket &socket);
+
+/// If relayed writes to backends should be coalesced with TCP_CORK or
+/// MSG_MORE while a bulk transfer is in progress
+bool corkBackendWrites();
+
+/// Hold back partial frames until uncorked (or the kernel's 200ms cap)
+void corkSocket(Mordor::Socket &socket, bool cork);
+
+}
+
+#endif
@@ -0,0 +1,293 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/sockstats.h"
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#endif
+
+#include <cstddef>
+#include <ostream>
+
+#include <boost/lexical_cast.hpp>
+
+#include <mordor/config.h>
+#include <mordor/iomanager.h>
+#include <mordor/log.h>
+#include <mordor/socket.h>
+#include <mordor/statistics.h>
+#include <mordor/timer.h>
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:sockstats");
+
+static ConfigVar<unsigned long long>::ptr g_interval =
+    Config::lookup("postguard.sockstats.interval", 10000000ull,
+        "How often to sample the kernel socket state of relayed sessions (us, 0 to disable)");
+
+static CountStatistic<unsigned long long> &g_stalledInPostguard =
+    Statistics::registerStatistic("postguard.sockstats.stalls.postguard",
+        CountStatistic<unsigned long long>("samples"));
+static CountStatistic<unsigned long long> &g_stalledInClient =
+    Statistics::registerStatistic("postguard.sockstats.stalls.client",
+        CountStatistic<unsigned long long>("samples"));
+static CountStatistic<unsigned long long> &g_stalledInBackend =
+    Statistics::registerStatistic("postguard.sockstats.stalls.backend",
+        CountStatistic<unsigned long long>("samples"));
+
+namespace Postguard {
+
+namespace {
+struct Queues
+{
+    Queues() : unread(0), unacked(0) {}
+
+    int unread, unacked;
+};
+
+struct Histograms
+{
+    Histogram clientUnread, clientUnacked, backendUnread, backendUnacked;
+    Histogram rtt, retransmits, cwnd, deliveryRate;
+};
+}
+
+static Histograms g_histograms;
+
+struct SocketSampler::Session
+{
+    unsigned long long id;
+    std::string user, issue;
+    std::shared_ptr<Socket> client, server;
+    bool tcp;
+
+    // only touched while sampling
+    bool sampled;
+    Queues lastClient, lastServer;
+    unsigned int lastRetransmits;
+};
+
+Histogram::Histogram()
+{
+    for (size_t i = 0; i < sizeof(m_buckets) / sizeof(m_buckets[0]); ++i)
+        m_buckets[i] = 0ull;
+}
+
+void
+Histogram::add(unsigned long long value)
+{
+    size_t bucket = 0u;
+    while (value != 0ull) {
+        ++bucket;
+        value >>= 1;
+    }
+    m_buckets[bucket].fetch_add(1ull, std::memory_order_relaxed);
+}
+
+std::ostream &
+Histogram::dump(std::ostream &os, const char *name, const char *units)
+{
+    static const size_t BUCKETS = sizeof(m_buckets) / sizeof(m_buckets[0]);
+    unsigned long long counts[BUCKETS], total = 0ull;
+    for (size_t i = 0; i < BUCKETS; ++i)
+        total += counts[i] = m_buckets[i].exchange(0ull, std::memory_order_relaxed);
+    if (total == 0ull)
+        return os;
+
+    os << name << ": count=" << total;
+    static const double percentiles[] = { 0.5, 0.9, 0.99, 1.0 };
+    static const char *labels[] = { "p50", "p90", "p99", "max" };
+    size_t bucket = 0u;
+    unsigned long long seen = counts[0];
+    for (size_t i = 0; i < 4u; ++i) {
+        while (seen < total * percentiles[i] && bucket + 1 < BUCKETS)
+            seen += counts[++bucket];
+        os << " " << labels[i] << "<";
+        if (bucket == 0u)
+            os << "1";
+        else if (bucket < 64u)
+            os << (1ull << bucket);
+        else
+            os << "2^64";
+    }
+    return os << " " << units << std::endl;
+}
+
+SocketSampler::SocketSampler(IOManager &ioManager)
+{
+    if (g_interval->val() != 0ull)
+        m_timer = ioManager.registerTimer(g_interval->val(),
+            std::bind(&SocketSampler::sampleAll, this), true);
+}
+
+SocketSampler::~SocketSampler()
+{
+    stop();
+}
+
+void
+SocketSampler::stop()
+{
+    if (m_timer)
+        m_timer->cancel();
+}
+
+std::shared_ptr<SocketSampler::Session>
+SocketSampler::watch(unsigned long long id, const std::string &user,
+    const std::string &issue, std::shared_ptr<Socket> client,
+    std::shared_ptr<Socket> server)
+{
+    if (!m_timer)
+        return std::shared_ptr<Session>();
+    std::shared_ptr<Session> session(new Session());
+    session->id = id;
+    session->user = user;
+    session->issue = issue;
+    session->client = client;
+    session->server = server;
+    session->tcp = server->family() != AF_UNIX;
+    session->sampled = false;
+    session->lastRetransmits = 0u;
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_sessions.push_back(session);
+    return session;
+}
+
+void
+SocketSampler::sampleAll()
+{
+    boost::mutex::scoped_lock sampling(m_sampling, boost::try_to_lock);
+    if (!sampling.owns_lock())
+        return;
+
+    // sessions that have finished are dropped on the way
+    std::vector<std::shared_ptr<Session> > sessions;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        sessions.reserve(m_sessions.size());
+        size_t live = 0u;
+        for (size_t i = 0; i < m_sessions.size(); ++i) {
+            std::shared_ptr<Session> session = m_sessions[i].lock();
+            if (!session)
+                continue;
+            sessions.push_back(session);
+            m_sessions[live++] = m_sessions[i];
+        }
+        m_sessions.resize(live);
+    }
+    for (size_t i = 0; i < sessions.size(); ++i)
+        sample(*sessions[i]);
+}
+
+static Queues
+queues(Socket &socket)
+{
+    Queues result;
+#ifdef __linux__
+    if (ioctl(socket.socket(), SIOCINQ, &result.unread) != 0)
+        result.unread = 0;
+    if (ioctl(socket.socket(), SIOCOUTQ, &result.unacked) != 0)
+        result.unacked = 0;
+#endif
+    return result;
+}
+
+void
+SocketSampler::sample(Session &session)
+{
+    Queues client = queues(*session.client);
+    Queues server = queues(*session.server);
+    g_histograms.clientUnread.add(client.unread);
+    g_histograms.clientUnacked.add(client.unacked);
+    g_histograms.backendUnread.add(server.unread);
+    g_histograms.backendUnacked.add(server.unacked);
+
+    unsigned int rtt = 0u, retransmits = 0u, cwnd = 0u;
+    bool haveInfo = false;
+#ifdef __linux__
+    if (session.tcp) {
+        struct tcp_info info;
+        size_t length = sizeof(info);
+        try {
+            session.server->getOption(IPPROTO_TCP, TCP_INFO, &info, &length);
+            haveInfo = true;
+        } catch (...) {
+            MORDOR_LOG_DEBUG(g_log) << "session " << session.id
+                << ": unable to read TCP_INFO: "
+                << boost::current_exception_diagnostic_information();
+        }
+        if (haveInfo) {
+            rtt = info.tcpi_rtt;
+            cwnd = info.tcpi_snd_cwnd;
+            retransmits = info.tcpi_total_retrans - session.lastRetransmits;
+            session.lastRetransmits = info.tcpi_total_retrans;
+            g_histograms.rtt.add(rtt);
+            g_histograms.cwnd.add(cwnd);
+            if (session.sampled)
+                g_histograms.retransmits.add(retransmits);
+            // older kernels fill in less of the struct
+            if (length >= offsetof(struct tcp_info, tcpi_delivery_rate) +
+                sizeof(info.tcpi_delivery_rate))
+                g_histograms.deliveryRate.add(info.tcpi_delivery_rate);
+        }
+    }
+#endif
+
+    MORDOR_LOG_VERBOSE(g_log) << "session " << session.id << " (" << session.user
+        << " " << session.issue << "): client unread=" << client.unread
+        << " unacked=" << client.unacked << ", backend unread=" << server.unread
+        << " unacked=" << server.unacked << " rtt=" << rtt << "us cwnd=" << cwnd
+        << " retransmits=" << retransmits;
+
+    // Bytes sitting unread across two samples: if the other side still has
+    // plenty unacknowledged it's the bottleneck, otherwise postguard isn't
+    // reading (throttled, or starved of CPU)
+    if (session.sampled && client.unread > 0 && session.lastClient.unread > 0) {
+        bool backend = server.unacked > 0;
+        (backend ? g_stalledInBackend : g_stalledInPostguard).increment();
+        std::string network;
+        if (haveInfo)
+            network = " (rtt=" + boost::lexical_cast<std::string>(rtt) +
+                "us cwnd=" + boost::lexical_cast<std::string>(cwnd) +
+                " retransmits=" + boost::lexical_cast<std::string>(retransmits) + ")";
+        MORDOR_LOG_INFO(g_log) << "session " << session.id << " (" << session.user
+            << " " << session.issue << "): client to backend stalled in "
+            << (backend ? "backend" : "postguard") << ", " << client.unread
+            << " bytes unread from client, " << server.unacked
+            << " bytes unacked by backend" << network;
+    }
+    if (session.sampled && server.unread > 0 && session.lastServer.unread > 0) {
+        bool slowClient = client.unacked > 0;
+        (slowClient ? g_stalledInClient : g_stalledInPostguard).increment();
+        MORDOR_LOG_INFO(g_log) << "session " << session.id << " (" << session.user
+            << " " << session.issue << "): backend to client stalled in "
+            << (slowClient ? "client" : "postguard") << ", " << server.unread
+            << " bytes unread from backend, " << client.unacked
+            << " bytes unread by client";
+    }
+    session.lastClient = client;
+    session.lastServer = server;
+    session.sampled = true;
+}
+
+std::ostream &
+SocketSampler::dump(std::ostream &os)
+{
+    g_histograms.clientUnread.dump(os, "sockets client unread", "bytes");
+    g_histograms.clientUnacked.dump(os, "sockets client unacked", "bytes");
+    g_histograms.backendUnread.dump(os, "sockets backend unread", "bytes");
+    g_histograms.backendUnacked.dump(os, "sockets backend unacked", "bytes");
+    g_histograms.rtt.dump(os, "sockets backend rtt", "us");
+    g_histograms.retransmits.dump(os, "sockets backend retransmits", "segments/sample");
+    g_histograms.cwnd.dump(os, "sockets backend cwnd", "segments");
+    g_histograms.deliveryRate.dump(os, "sockets backend delivery rate", "bytes/s");
+    return os;
+}
+
+}
@@ -0,0 +1,84 @@
+#ifndef __POSTGUARD_SOCKSTATS_H__
+#define __POSTGUARD_SOCKSTATS_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <atomic>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace Mordor {
+class IOManager;
+class Socket;
+class Timer;
+}
+
+namespace Postguard {
+
+/// Power of two buckets, that can be added to from any thread without a lock
+class Histogram : boost::noncopyable
+{
+public:
+    Histogram();
+
+    void add(unsigned long long value);
+
+    /// Writes the count and percentiles (as the upper bound of the bucket
+    /// they fall in), and starts over
+    std::ostream &dump(std::ostream &os, const char *name, const char *units);
+
+private:
+    /// Bucket i holds values of less than 2^i, and at least 2^(i-1)
+    std::atomic<unsigned long long> m_buckets[65];
+};
+
+/// Periodically reads the kernel's view of each relayed session's sockets
+///
+/// For both sides the bytes queued but not yet read (SIOCINQ) and written
+/// but not yet acknowledged (SIOCOUTQ) are sampled, and for TCP backends
+/// also TCP_INFO's RTT, retransmits, congestion window and delivery rate.
+/// They're aggregated into histograms for the stats log.  Bytes left
+/// unread across two samples mean a direction is stalled; whether the
+/// receiving side still has unacknowledged data of its own tells if it's
+/// that side that isn't keeping up, or postguard that isn't reading.
+/// Stalls are logged with the session's numbers, and counted.
+class SocketSampler : boost::noncopyable
+{
+public:
+    struct Session;
+
+public:
+    SocketSampler(Mordor::IOManager &ioManager);
+    ~SocketSampler();
+
+    void stop();
+
+    /// Sample a relayed session for as long as the returned handle lives
+    /// @return NULL if sampling is disabled
+    std::shared_ptr<Session> watch(unsigned long long session,
+        const std::string &user, const std::string &issue,
+        std::shared_ptr<Mordor::Socket> client,
+        std::shared_ptr<Mordor::Socket> server);
+
+    /// Histograms of the samples taken since the last dump
+    static std::ostream &dump(std::ostream &os);
+
+private:
+    void sampleAll();
+    void sample(Session &session);
+
+private:
+    boost::mutex m_mutex;
+    std::vector<std::weak_ptr<Session> > m_sessions;
+    /// Held while sampling, so a slow round isn't overlapped by the next
+    boost::mutex m_sampling;
+    std::shared_ptr<Mordor::Timer> m_timer;
+};
+
+}
+
+#endif
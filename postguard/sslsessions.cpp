@@ -0,0 +1,186 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/sslsessions.h"
+
+#include <openssl/x509v3.h>
+
+#include <mordor/config.h>
+#include <mordor/exception.h>
+#include <mordor/log.h>
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:sslsessions");
+
+static ConfigVar<long>::ptr g_serverCacheSize =
+    Config::lookup("postguard.ssl.sessioncachesize", 20480l,
+        "Number of SSL sessions from connecting clients to cache for resumption");
+static ConfigVar<long>::ptr g_sessionTimeout =
+    Config::lookup("postguard.ssl.sessiontimeout", 3600l,
+        "How long SSL sessions can be resumed for (s)");
+static ConfigVar<size_t>::ptr g_clientCacheSize =
+    Config::lookup("postguard.ssl.backendcachesize", (size_t)256u,
+        "Number of backend targets to keep SSL sessions for");
+
+namespace Postguard {
+
+namespace {
+/// Per SSL_CTX state; freed along with the context itself, so it outlives
+/// any connection still using the context after eviction from the cache
+struct Target
+{
+    Target() : session(NULL) {}
+    ~Target() { if (session) SSL_SESSION_free(session); }
+
+    boost::mutex mutex;
+    SSL_SESSION *session;
+    std::string name;
+};
+}
+
+static void freeTarget(void *, void *ptr, CRYPTO_EX_DATA *, int, long, void *)
+{
+    delete (Target *)ptr;
+}
+
+static int targetIndex()
+{
+    static int index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, &freeTarget);
+    return index;
+}
+
+static Target *target(SSL *ssl)
+{
+    return (Target *)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), targetIndex());
+}
+
+static int newSession(SSL *ssl, SSL_SESSION *session)
+{
+    Target *t = target(ssl);
+    boost::mutex::scoped_lock lock(t->mutex);
+    if (t->session)
+        SSL_SESSION_free(t->session);
+    // we keep the reference OpenSSL handed us
+    t->session = session;
+    return 1;
+}
+
+static void infoCallback(const SSL *constSsl, int where, int)
+{
+    SSL *ssl = const_cast<SSL *>(constSsl);
+    Target *t = target(ssl);
+    if (where & SSL_CB_HANDSHAKE_START) {
+        // Nothing has been sent yet, so the ClientHello will offer the
+        // cached session
+        boost::mutex::scoped_lock lock(t->mutex);
+        if (t->session && SSL_SESSION_is_resumable(t->session))
+            SSL_set_session(ssl, t->session);
+    } else if (where & SSL_CB_HANDSHAKE_DONE) {
+        MORDOR_LOG_DEBUG(g_log) << ssl << " handshake with " << t->name
+            << (SSL_session_reused(ssl) ? " resumed" : " full");
+    }
+}
+
+void
+configureServerSessionCache(SSL_CTX *ctx)
+{
+    static const unsigned char sessionIdContext[] = "postguard";
+    SSL_CTX_set_session_id_context(ctx, sessionIdContext,
+        sizeof(sessionIdContext) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, g_serverCacheSize->val());
+    SSL_CTX_set_timeout(ctx, g_sessionTimeout->val());
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+}
+
+SSLSessionCache::~SSLSessionCache()
+{
+    for (Contexts::const_iterator it(m_contexts.begin());
+        it != m_contexts.end();
+        ++it)
+        SSL_CTX_free(it->second);
+}
+
+std::shared_ptr<SSL_CTX>
+SSLSessionCache::clientContext(const std::string &host, unsigned short port,
+    const std::string &serverName, const std::string &sslMode)
+{
+    Key key;
+    key.host = host;
+    key.port = port;
+    key.serverName = serverName;
+    key.sslMode = sslMode;
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    SSL_CTX *ctx;
+    std::map<Key, Contexts::iterator>::iterator it = m_index.find(key);
+    if (it != m_index.end()) {
+        m_contexts.splice(m_contexts.begin(), m_contexts, it->second);
+        ctx = it->second->second;
+    } else {
+        ctx = createContext(key);
+        m_contexts.push_front(std::make_pair(key, ctx));
+        m_index[key] = m_contexts.begin();
+        while (m_contexts.size() > std::max<size_t>(g_clientCacheSize->val(), 1u)) {
+            m_index.erase(m_contexts.back().first);
+            SSL_CTX_free(m_contexts.back().second);
+            m_contexts.pop_back();
+        }
+    }
+    SSL_CTX_up_ref(ctx);
+    return std::shared_ptr<SSL_CTX>(ctx, &SSL_CTX_free);
+}
+
+SSL_CTX *
+SSLSessionCache::createContext(const Key &key)
+{
+    SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+    if (!ctx)
+        MORDOR_THROW_EXCEPTION(std::runtime_error("Unable to create SSL context"));
+    Target *t = new Target();
+    std::ostringstream os;
+    os << key.host << ":" << key.port;
+    t->name = os.str();
+    SSL_CTX_set_ex_data(ctx, targetIndex(), t);
+
+    if (key.sslMode == "verify-ca" || key.sslMode == "verify-full") {
+        SSL_CTX_set_default_verify_paths(ctx);
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+        if (key.sslMode == "verify-full") {
+            X509_VERIFY_PARAM *param = SSL_CTX_get0_param(ctx);
+            // hostaddr connections check the certificate's IP SANs instead
+            if (!X509_VERIFY_PARAM_set1_ip_asc(param, key.host.c_str()))
+                X509_VERIFY_PARAM_set1_host(param, key.host.c_str(),
+                    key.host.length());
+        }
+    }
+
+    SSL_CTX_set_session_cache_mode(ctx,
+        SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, &newSession);
+    SSL_CTX_set_info_callback(ctx, &infoCallback);
+    return ctx;
+}
+
+SSLSessionCache &
+SSLSessionCache::get()
+{
+    static SSLSessionCache cache;
+    return cache;
+}
+
+bool
+SSLSessionCache::Key::operator <(const Key &rhs) const
+{
+    if (host != rhs.host)
+        return host < rhs.host;
+    if (port != rhs.port)
+        return port < rhs.port;
+    if (serverName != rhs.serverName)
+        return serverName < rhs.serverName;
+    return sslMode < rhs.sslMode;
+}
+
+}
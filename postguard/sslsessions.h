@@ -0,0 +1,62 @@
+#ifndef __POSTGUARD_SSLSESSIONS_H__
+#define __POSTGUARD_SSLSESSIONS_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <openssl/ssl.h>
+
+namespace Postguard {
+
+/// Enable session tickets and a server-side session cache on the context
+/// used to accept client connections
+void configureServerSessionCache(SSL_CTX *ctx);
+
+/// Client SSL contexts for backend connections, one per (host, port, SNI,
+/// sslmode), each of which resumes the most recent session to its target
+///
+/// Certificate verification for verify-ca and verify-full is done by
+/// OpenSSL during the handshake, so a resumed session reuses the result
+/// established by the original full handshake.  sslmode is part of the key,
+/// so that a session from an unverified connection is never resumed by a
+/// connection that requires verification.
+class SSLSessionCache : boost::noncopyable
+{
+public:
+    SSLSessionCache() {}
+    ~SSLSessionCache();
+
+    std::shared_ptr<SSL_CTX> clientContext(const std::string &host,
+        unsigned short port, const std::string &serverName,
+        const std::string &sslMode);
+
+    static SSLSessionCache &get();
+
+private:
+    struct Key
+    {
+        std::string host, serverName, sslMode;
+        unsigned short port;
+
+        bool operator <(const Key &rhs) const;
+    };
+
+    typedef std::list<std::pair<Key, SSL_CTX *> > Contexts;
+
+    static SSL_CTX *createContext(const Key &key);
+
+private:
+    boost::mutex m_mutex;
+    Contexts m_contexts;
+    std::map<Key, Contexts::iterator> m_index;
+};
+
+}
+
+#endif
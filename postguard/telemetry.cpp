@@ -0,0 +1,161 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/telemetry.h"
+
+#include <mordor/log.h>
+#include <mordor/timer.h>
+
+using namespace Mordor;
+
+static Logger::ptr g_log = Log::lookup("postguard:telemetry");
+
+namespace Postguard {
+
+void
+Telemetry::record(const std::string &user, const std::string &issue,
+    const Totals &statement)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    Totals &totals = m_totals[std::make_pair(user, issue)];
+    totals.statements += statement.statements;
+    totals.serverTime += statement.serverTime;
+    totals.thinkTime += statement.thinkTime;
+    totals.rows += statement.rows;
+    totals.bytes += statement.bytes;
+}
+
+std::ostream &
+Telemetry::dump(std::ostream &os)
+{
+    std::map<std::pair<std::string, std::string>, Totals> totals;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        totals.swap(m_totals);
+    }
+    for (std::map<std::pair<std::string, std::string>, Totals>::const_iterator it(totals.begin());
+        it != totals.end();
+        ++it) {
+        os << it->first.first << " " << it->first.second
+            << ": statements=" << it->second.statements
+            << " server=" << it->second.serverTime << "us"
+            << " think=" << it->second.thinkTime << "us"
+            << " rows=" << it->second.rows
+            << " bytes=" << it->second.bytes << std::endl;
+    }
+    return os;
+}
+
+Telemetry &
+Telemetry::get()
+{
+    static Telemetry telemetry;
+    return telemetry;
+}
+
+StatementTracker::StatementTracker(const std::string &user,
+    const std::string &issue)
+    : m_user(user),
+      m_issue(issue),
+      m_lost(false),
+      m_inBatch(false),
+      m_idleSince(TimerManager::now()),
+      m_rows(0ull),
+      m_serverBytes(0ull)
+{}
+
+void
+StatementTracker::observe(Direction direction, const char *data, size_t length)
+{
+    unsigned long long now = TimerManager::now();
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_lost)
+        return;
+    V3Framing &framing = m_framing[direction];
+    while (true) {
+        switch (framing.next(data, length)) {
+            case V3Framing::DONE:
+                return;
+            case V3Framing::MESSAGE:
+                message(direction, framing.type(), framing.length() + 1ull, now);
+                break;
+            case V3Framing::PAYLOAD:
+                break;
+            case V3Framing::LOST:
+                MORDOR_LOG_WARNING(g_log) << this << " lost protocol framing for "
+                    << m_user << " " << m_issue;
+                m_lost = true;
+                return;
+        }
+    }
+}
+
+void
+StatementTracker::message(Direction direction, char type,
+    unsigned long long length, unsigned long long now)
+{
+    if (direction == FROM_CLIENT) {
+        switch (type) {
+            case 'Q':
+                begin(now);
+                m_statements.push_back(m_batch);
+                m_statements.back().bytes += length;
+                m_inBatch = false;
+                return;
+            case 'P':
+            case 'B':
+            case 'D':
+            case 'E':
+                begin(now);
+                m_batch.bytes += length;
+                return;
+            case 'S':
+                if (m_inBatch) {
+                    m_statements.push_back(m_batch);
+                    m_statements.back().bytes += length;
+                    m_inBatch = false;
+                }
+                return;
+            default:
+                if (m_inBatch)
+                    m_batch.bytes += length;
+                else if (!m_statements.empty())
+                    m_statements.back().bytes += length;
+                return;
+        }
+    }
+
+    m_serverBytes += length;
+    if (type == 'D') {
+        ++m_rows;
+    } else if (type == 'Z' && !m_statements.empty()) {
+        const Statement &statement = m_statements.front();
+        Telemetry::Totals totals;
+        totals.statements = 1ull;
+        totals.serverTime = now - statement.start;
+        totals.thinkTime = statement.thinkTime;
+        totals.rows = m_rows;
+        totals.bytes = statement.bytes + m_serverBytes;
+        m_statements.pop_front();
+        m_rows = m_serverBytes = 0ull;
+        if (m_statements.empty() && !m_inBatch)
+            m_idleSince = now;
+        Telemetry::get().record(m_user, m_issue, totals);
+    }
+}
+
+void
+StatementTracker::begin(unsigned long long now)
+{
+    if (m_inBatch)
+        return;
+    // only time spent with nothing outstanding is the client thinking
+    unsigned long long thinkTime = 0ull;
+    if (m_statements.empty())
+        thinkTime = now - m_idleSince;
+    m_batch = Statement(now, thinkTime);
+    m_inBatch = true;
+}
+
+}
@@ -0,0 +1,101 @@
+#ifndef __POSTGUARD_TELEMETRY_H__
+#define __POSTGUARD_TELEMETRY_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <deque>
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "postguard/framing.h"
+
+namespace Postguard {
+
+/// Statement timings of relayed sessions, per Unix user and issue key
+class Telemetry : boost::noncopyable
+{
+public:
+    struct Totals
+    {
+        Totals() : statements(0ull), serverTime(0ull), thinkTime(0ull),
+            rows(0ull), bytes(0ull) {}
+
+        unsigned long long statements;
+        /// From the first Query/Parse/Execute until ReadyForQuery (us)
+        unsigned long long serverTime;
+        /// From ReadyForQuery until the client's next statement (us)
+        unsigned long long thinkTime;
+        unsigned long long rows, bytes;
+    };
+
+public:
+    Telemetry() {}
+
+    void record(const std::string &user, const std::string &issue,
+        const Totals &statement);
+
+    /// Writes the totals since the last dump, and starts over, so users and
+    /// issues that have gone quiet are forgotten
+    std::ostream &dump(std::ostream &os);
+
+    static Telemetry &get();
+
+private:
+    boost::mutex m_mutex;
+    std::map<std::pair<std::string, std::string>, Totals> m_totals;
+};
+
+/// Follows the v3 message framing of a relayed session, without copying
+/// anything but the message headers
+class StatementTracker : boost::noncopyable
+{
+public:
+    typedef std::shared_ptr<StatementTracker> ptr;
+
+    enum Direction
+    {
+        FROM_CLIENT,
+        FROM_SERVER
+    };
+
+public:
+    StatementTracker(const std::string &user, const std::string &issue);
+
+    /// Bytes that were just relayed in direction
+    void observe(Direction direction, const char *data, size_t length);
+
+private:
+    struct Statement
+    {
+        Statement(unsigned long long start = 0ull,
+            unsigned long long thinkTime = 0ull)
+            : start(start), thinkTime(thinkTime), bytes(0ull) {}
+
+        unsigned long long start, thinkTime, bytes;
+    };
+
+    void message(Direction direction, char type, unsigned long long length,
+        unsigned long long now);
+    void begin(unsigned long long now);
+
+private:
+    const std::string m_user, m_issue;
+    boost::mutex m_mutex;
+    bool m_lost;
+    V3Framing m_framing[2];
+    /// Statements sent, but not yet answered with ReadyForQuery; more than
+    /// one if the client pipelines
+    std::deque<Statement> m_statements;
+    /// An extended query batch that hasn't been Synced yet
+    Statement m_batch;
+    bool m_inBatch;
+    unsigned long long m_idleSince, m_rows, m_serverBytes;
+};
+
+}
+
+#endif
@@ -0,0 +1,122 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/throttle.h"
+
+#include <algorithm>
+#include <map>
+
+#include <boost/thread/mutex.hpp>
+
+#include <mordor/config.h>
+#include <mordor/statistics.h>
+#include <mordor/timer.h>
+
+using namespace Mordor;
+
+static ConfigVar<unsigned long long>::ptr g_sessionFromClient =
+    Config::lookup("postguard.throttle.session.fromclient", 0ull,
+        "Maximum rate each relayed session can send to the backend (bytes/s, 0 for no limit)");
+static ConfigVar<unsigned long long>::ptr g_sessionFromServer =
+    Config::lookup("postguard.throttle.session.fromserver", 0ull,
+        "Maximum rate each relayed session can receive from the backend (bytes/s, 0 for no limit)");
+static ConfigVar<unsigned long long>::ptr g_userFromClient =
+    Config::lookup("postguard.throttle.user.fromclient", 0ull,
+        "Maximum rate each Unix user's sessions can send to backends (bytes/s, 0 for no limit)");
+static ConfigVar<unsigned long long>::ptr g_userFromServer =
+    Config::lookup("postguard.throttle.user.fromserver", 0ull,
+        "Maximum rate each Unix user's sessions can receive from backends (bytes/s, 0 for no limit)");
+static ConfigVar<unsigned long long>::ptr g_globalFromClient =
+    Config::lookup("postguard.throttle.global.fromclient", 0ull,
+        "Maximum rate all relayed sessions can send to backends (bytes/s, 0 for no limit)");
+static ConfigVar<unsigned long long>::ptr g_globalFromServer =
+    Config::lookup("postguard.throttle.global.fromserver", 0ull,
+        "Maximum rate all relayed sessions can receive from backends (bytes/s, 0 for no limit)");
+static ConfigVar<unsigned long long>::ptr g_burst =
+    Config::lookup("postguard.throttle.burst", 100000ull,
+        "How long an idle bucket can save up credit for (us)");
+
+static CountStatistic<unsigned long long> &g_pauses =
+    Statistics::registerStatistic("postguard.throttle.pauses",
+        CountStatistic<unsigned long long>("pauses"));
+
+namespace Postguard {
+
+unsigned long long
+TokenBucket::consume(size_t bytes, unsigned long long rate,
+    unsigned long long burst, unsigned long long now)
+{
+    if (rate == 0ull)
+        return 0ull;
+    // in ns, so small reads at high rates don't round down to nothing
+    unsigned long long cost = bytes * 1000000000ull / rate;
+    now *= 1000ull;
+    burst *= 1000ull;
+    unsigned long long full = m_full.load(std::memory_order_relaxed);
+    unsigned long long next;
+    do {
+        next = std::max(full, now) + cost;
+    } while (!m_full.compare_exchange_weak(full, next, std::memory_order_relaxed));
+    return next > now + burst ? (next - now - burst + 999ull) / 1000ull : 0ull;
+}
+
+Throttle::Throttle(std::shared_ptr<Buckets> user)
+    : m_user(user)
+{}
+
+Throttle::ptr
+Throttle::create(const std::string &user)
+{
+    if (g_sessionFromClient->val() == 0ull && g_sessionFromServer->val() == 0ull &&
+        g_userFromClient->val() == 0ull && g_userFromServer->val() == 0ull &&
+        g_globalFromClient->val() == 0ull && g_globalFromServer->val() == 0ull)
+        return ptr();
+
+    // The user's buckets live as long as any of their sessions; only
+    // looking them up takes a lock, charging them doesn't
+    static boost::mutex mutex;
+    static std::map<std::string, std::weak_ptr<Buckets> > users;
+    std::shared_ptr<Buckets> buckets;
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        std::weak_ptr<Buckets> &entry = users[user];
+        buckets = entry.lock();
+        if (!buckets) {
+            buckets.reset(new Buckets());
+            entry = buckets;
+            for (std::map<std::string, std::weak_ptr<Buckets> >::iterator it(users.begin());
+                it != users.end();) {
+                if (it->second.expired())
+                    users.erase(it++);
+                else
+                    ++it;
+            }
+        }
+    }
+    return ptr(new Throttle(buckets));
+}
+
+unsigned long long
+Throttle::consume(StatementTracker::Direction direction, size_t bytes)
+{
+    static Buckets global;
+    bool fromClient = direction == StatementTracker::FROM_CLIENT;
+    unsigned long long now = TimerManager::now();
+    unsigned long long burst = g_burst->val();
+    unsigned long long delay = std::max(std::max(
+        m_session.directions[direction].consume(bytes,
+            fromClient ? g_sessionFromClient->val() : g_sessionFromServer->val(),
+            burst, now),
+        m_user->directions[direction].consume(bytes,
+            fromClient ? g_userFromClient->val() : g_userFromServer->val(),
+            burst, now)),
+        global.directions[direction].consume(bytes,
+            fromClient ? g_globalFromClient->val() : g_globalFromServer->val(),
+            burst, now));
+    if (delay != 0ull)
+        g_pauses.increment();
+    return delay;
+}
+
+}
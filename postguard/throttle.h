@@ -0,0 +1,76 @@
+#ifndef __POSTGUARD_THROTTLE_H__
+#define __POSTGUARD_THROTTLE_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+
+#include "postguard/telemetry.h"
+
+namespace Postguard {
+
+/// A token bucket that can be charged from any thread without a lock
+///
+/// Rather than counting tokens, it tracks the time at which the bucket
+/// will be full again (GCRA); charging moves that forward by the cost of
+/// the bytes, and the caller is told how long to hold off to stay within
+/// the rate.  Bytes already read are always charged, so a burst overshoots
+/// by at most one read, and is paid for by the following pause.
+class TokenBucket : boost::noncopyable
+{
+public:
+    TokenBucket() : m_full(0ull) {}
+
+    /// @param rate bytes/s, or 0 for unlimited
+    /// @param burst How much credit (us at rate) can build up while idle
+    /// @return How long to wait before reading more (us)
+    unsigned long long consume(size_t bytes, unsigned long long rate,
+        unsigned long long burst, unsigned long long now);
+
+private:
+    /// ns
+    std::atomic<unsigned long long> m_full;
+};
+
+/// Bandwidth limits for one relayed session
+///
+/// Each direction is charged against the session's own bucket, the Unix
+/// user's bucket (shared by all of their sessions), and a global bucket;
+/// the longest resulting pause wins.  The relay applies it by not reading
+/// from that side until the pause is over, so the kernel's socket buffers
+/// push back on the sender instead of postguard buffering the excess.
+class Throttle : boost::noncopyable
+{
+public:
+    typedef std::shared_ptr<Throttle> ptr;
+
+private:
+    struct Buckets;
+
+    Throttle(std::shared_ptr<Buckets> user);
+
+public:
+    /// @return NULL if no limits are configured
+    static ptr create(const std::string &user);
+
+    /// Charge bytes just relayed in direction
+    /// @return How long to wait before reading more from that side (us)
+    unsigned long long consume(StatementTracker::Direction direction,
+        size_t bytes);
+
+private:
+    struct Buckets
+    {
+        TokenBucket directions[2];
+    };
+
+    std::shared_ptr<Buckets> m_user;
+    Buckets m_session;
+};
+
+}
+
+#endif
@@ -0,0 +1,167 @@
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <mordor/predef.h>
+
+#include "postguard/timerwheel.h"
+
+#include <vector>
+
+#include <mordor/assert.h>
+#include <mordor/iomanager.h>
+#include <mordor/timer.h>
+
+using namespace Mordor;
+
+namespace Postguard {
+
+TimerWheel::Timeout::Timeout(TimerWheel &wheel, const std::function<void ()> &dg)
+    : m_wheel(wheel),
+      m_dg(dg),
+      m_expires(0ull),
+      m_slot(NULL),
+      m_prev(NULL),
+      m_next(NULL)
+{}
+
+TimerWheel::Timeout::~Timeout()
+{
+    cancel();
+}
+
+bool
+TimerWheel::Timeout::cancel()
+{
+    boost::mutex::scoped_lock lock(m_wheel.m_mutex);
+    if (!m_slot)
+        return false;
+    m_wheel.remove(this);
+    m_dg = NULL;
+    return true;
+}
+
+TimerWheel::TimerWheel(IOManager &ioManager, unsigned long long tick)
+    : m_ioManager(ioManager),
+      m_tick(std::max(tick, 1ull)),
+      m_current(0ull)
+{
+    m_timer = ioManager.registerTimer(m_tick,
+        std::bind(&TimerWheel::advance, this), true);
+}
+
+TimerWheel::~TimerWheel()
+{
+    stop();
+    boost::mutex::scoped_lock lock(m_mutex);
+    for (size_t level = 0; level < LEVELS; ++level) {
+        for (size_t index = 0; index < SLOTS; ++index) {
+            while (m_slots[level][index].head)
+                remove(m_slots[level][index].head);
+        }
+    }
+}
+
+void
+TimerWheel::stop()
+{
+    m_timer->cancel();
+}
+
+TimerWheel::Timeout::ptr
+TimerWheel::add(unsigned long long us, const std::function<void ()> &dg)
+{
+    Timeout::ptr timeout(new Timeout(*this, dg));
+    unsigned long long ticks = std::max((us + m_tick - 1) / m_tick, 1ull);
+    boost::mutex::scoped_lock lock(m_mutex);
+    timeout->m_expires = m_current + ticks;
+    insert(timeout.get());
+    return timeout;
+}
+
+void
+TimerWheel::insert(Timeout *timeout)
+{
+    unsigned long long expires = std::max(timeout->m_expires, m_current);
+    unsigned long long delta = expires - m_current;
+    size_t level = 0;
+    while (level < LEVELS - 1 && delta >= (1ull << ((level + 1) * BITS)))
+        ++level;
+    if (level == LEVELS - 1 && delta >= (1ull << (LEVELS * BITS)))
+        expires = m_current + (1ull << (LEVELS * BITS)) - 1;
+    Slot *slot = &m_slots[level][(expires >> (level * BITS)) & MASK];
+
+    timeout->m_slot = slot;
+    timeout->m_prev = NULL;
+    timeout->m_next = slot->head;
+    if (slot->head)
+        slot->head->m_prev = timeout;
+    slot->head = timeout;
+}
+
+void
+TimerWheel::remove(Timeout *timeout)
+{
+    MORDOR_ASSERT(timeout->m_slot);
+    if (timeout->m_prev)
+        timeout->m_prev->m_next = timeout->m_next;
+    else
+        timeout->m_slot->head = timeout->m_next;
+    if (timeout->m_next)
+        timeout->m_next->m_prev = timeout->m_prev;
+    timeout->m_slot = NULL;
+    timeout->m_prev = timeout->m_next = NULL;
+}
+
+size_t
+TimerWheel::cascade(size_t level)
+{
+    // Redistribute this slot of a coarser level into the finer levels,
+    // now that its timeouts are within their range
+    size_t index = (m_current >> (level * BITS)) & MASK;
+    Timeout *timeout = m_slots[level][index].head;
+    m_slots[level][index].head = NULL;
+    while (timeout) {
+        Timeout *next = timeout->m_next;
+        insert(timeout);
+        timeout = next;
+    }
+    return index;
+}
+
+void
+TimerWheel::advance()
+{
+    std::vector<std::function<void ()> > expired;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        size_t index = m_current & MASK;
+        if (index == 0) {
+            for (size_t level = 1; level < LEVELS; ++level) {
+                if (cascade(level) != 0)
+                    break;
+            }
+        }
+        Slot &slot = m_slots[0][index];
+        Timeout *timeout = slot.head;
+        slot.head = NULL;
+        while (timeout) {
+            Timeout *next = timeout->m_next;
+            if (timeout->m_expires > m_current) {
+                // beyond the range of the wheel when it was added
+                insert(timeout);
+            } else {
+                timeout->m_slot = NULL;
+                timeout->m_prev = timeout->m_next = NULL;
+                expired.push_back(timeout->m_dg);
+                timeout->m_dg = NULL;
+            }
+            timeout = next;
+        }
+        ++m_current;
+    }
+    for (std::vector<std::function<void ()> >::const_iterator it(expired.begin());
+        it != expired.end();
+        ++it)
+        m_ioManager.schedule(*it);
+}
+
+}
@@ -0,0 +1,98 @@
+#ifndef __POSTGUARD_TIMERWHEEL_H__
+#define __POSTGUARD_TIMERWHEEL_H__
+// Copyright (c) 2014 - Cody Cutrer
+
+#include <functional>
+#include <memory>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace Mordor {
+class IOManager;
+class Timer;
+}
+
+namespace Postguard {
+
+/// Hierarchical timing wheel for large numbers of coarse timeouts that
+/// mostly get cancelled before they fire
+///
+/// Adding and cancelling a timeout is O(1), and each tick only touches the
+/// timeouts that expire in it (plus an amortized cascade from the coarser
+/// levels), no matter how many sessions are being tracked.  The wheel is
+/// driven by a single recurring Mordor timer, and expired callbacks are
+/// scheduled on the IOManager.
+class TimerWheel : boost::noncopyable
+{
+private:
+    struct Slot;
+
+public:
+    class Timeout : boost::noncopyable
+    {
+        friend class TimerWheel;
+    public:
+        typedef std::shared_ptr<Timeout> ptr;
+
+    private:
+        Timeout(TimerWheel &wheel, const std::function<void ()> &dg);
+
+    public:
+        /// Cancels the timeout if it hasn't fired yet
+        ~Timeout();
+
+        /// @return false if it already fired (or was already cancelled)
+        bool cancel();
+
+    private:
+        TimerWheel &m_wheel;
+        std::function<void ()> m_dg;
+        unsigned long long m_expires;
+        Slot *m_slot;
+        Timeout *m_prev, *m_next;
+    };
+
+public:
+    /// @param tick Resolution of the wheel (us)
+    TimerWheel(Mordor::IOManager &ioManager, unsigned long long tick);
+    ~TimerWheel();
+
+    /// Stop ticking, so the IOManager can stop; nothing fires after this
+    void stop();
+
+    /// Call dg (on the IOManager) after at least us microseconds
+    Timeout::ptr add(unsigned long long us, const std::function<void ()> &dg);
+
+private:
+    enum {
+        BITS = 6,
+        SLOTS = 1 << BITS,
+        MASK = SLOTS - 1,
+        LEVELS = 4
+    };
+
+    struct Slot
+    {
+        Slot() : head(NULL) {}
+
+        Timeout *head;
+    };
+
+    void insert(Timeout *timeout);
+    void remove(Timeout *timeout);
+    size_t cascade(size_t level);
+    void advance();
+
+private:
+    Mordor::IOManager &m_ioManager;
+    const unsigned long long m_tick;
+    boost::mutex m_mutex;
+    unsigned long long m_current;
+    Slot m_slots[LEVELS][SLOTS];
+    std::shared_ptr<Mordor::Timer> m_timer;
+};
+
+}
+
+#endif